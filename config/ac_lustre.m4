@@ -18,4 +18,5 @@ AC_DEFUN([AC_LUSTRE],
              [--with-lustre was given, but test for liblustreapi failed])
          fi
         ], )])
+  AM_CONDITIONAL([HAVE_LIBLUSTREAPI], [test -n "$LIBLUSTREAPI"])
 ])
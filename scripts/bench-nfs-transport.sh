@@ -0,0 +1,53 @@
+#!/bin/bash -e
+
+# bench-nfs-transport.sh - compare UDP and TCP rquota transports
+#
+# Runs repquota against the rquota_svc_test stand-in over each transport,
+# with the stand-in ignoring a given percentage of UDP requests to mimic
+# packet loss, and prints the time each run took.  Run as root from the
+# top of a build tree:
+#
+#   scripts/bench-nfs-transport.sh [-n uids] [-w window] [loss% ...]
+
+declare -r prog=${0##*/}
+declare -r svc=src/librpc/rquota_svc_test
+declare -r repquota=src/cmd/repquota
+declare -r tmp=$(mktemp -d)
+declare nuids=10000 window=64 pid=""
+
+die() { echo -e "$prog: $@"; exit 1; }
+cleanup() { test -n "$pid" && kill $pid; rm -rf $tmp; }
+trap cleanup EXIT
+
+while getopts "n:w:" opt; do
+    case $opt in
+        n) nuids=$OPTARG ;;
+        w) window=$OPTARG ;;
+        *) die "Usage: $prog [-n uids] [-w window] [loss% ...]" ;;
+    esac
+done
+shift $((OPTIND-1))
+test $# -gt 0 || set -- 0 1 5
+test -x $svc -a -x $repquota || die "run from the top of a build tree"
+test "$(id -u)" = 0 || die "must run as root to query other uids"
+
+echo "/bench:svchost:/export:0" >$tmp/quota.conf
+printf "%-6s %-5s %9s %9s\n" "loss%" "proto" "seconds" "retrans"
+for loss in "$@"; do
+    rm -f $tmp/port
+    $svc -q -p 0 -l $loss >$tmp/port &
+    pid=$!
+    while ! test -s $tmp/port; do sleep 0.1; done
+    expires=$(($(date +%s)+3600))
+    for proto in udp tcp; do
+        echo "svchost $proto 127.0.0.1 $(cat $tmp/port) $expires" \
+            >$tmp/hosts
+        $repquota -D -n -W $window -P $proto -C $tmp -f $tmp/quota.conf \
+            -u 1-$nuids /bench | sed -n 's/^nfs: //p' >$tmp/out
+        secs=$(sed -n 's/.* in \([0-9.]*\)s:.*/\1/p' $tmp/out)
+        retrans=$(sed -n 's/.* \([0-9]*\) retransmits.*/\1/p' $tmp/out)
+        printf "%-6s %-5s %9s %9s\n" $loss $proto $secs $retrans
+    done
+    kill $pid
+    pid=""
+done
@@ -0,0 +1,169 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Per-server circuit breaker.
+ *
+ * When an NFS server goes down, every query to it waits out the full
+ * quota_nfs_timeout, which for a report over a large password file adds
+ * up to hours.  After quota_nfs_breaker consecutive timeouts, the
+ * breaker for that server opens and further queries fail at once,
+ * except that one query every quota_breaker_probe seconds is let through
+ * as a probe.  Any reply from the server closes the breaker again.
+ *
+ * The state lives for the life of the process and is shared by every
+ * query, so a dead server costs one timeout per process, not one per
+ * query.  A single mutex covers all breakers; the critical sections are
+ * a few instructions long.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "src/liblsd/list.h"
+#include "src/libutil/util.h"
+
+#include "breaker.h"
+
+extern int debug;
+
+int quota_nfs_breaker = 3;          /* consecutive timeouts, 0 = never */
+double quota_breaker_probe = 10;    /* seconds between probes */
+
+struct breaker {
+    char   *b_rhost;
+    int     b_timeouts;             /* consecutive */
+    int     b_open;
+    double  b_next_probe;
+};
+
+static List breakers = NULL;
+static pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+breaker_destroy(struct breaker *b)
+{
+    free(b->b_rhost);
+    free(b);
+}
+
+static int
+breaker_match(struct breaker *b, char *rhost)
+{
+    return !strcmp(b->b_rhost, rhost);
+}
+
+static void
+breaker_fini(void)
+{
+    if (breakers) {
+        list_destroy(breakers);
+        breakers = NULL;
+    }
+}
+
+/* Find (or create) the breaker for rhost.
+ */
+struct breaker *
+breaker_get(char *rhost)
+{
+    struct breaker *b;
+
+    pthread_mutex_lock(&breaker_lock);
+    if (!breakers) {
+        breakers = list_create((ListDelF)breaker_destroy);
+        atexit(breaker_fini);
+    }
+    if (!(b = list_find_first(breakers, (ListFindF)breaker_match, rhost))) {
+        b = xmalloc(sizeof(struct breaker));
+        memset(b, 0, sizeof(struct breaker));
+        b->b_rhost = xstrdup(rhost);
+        list_append(breakers, b);
+    }
+    pthread_mutex_unlock(&breaker_lock);
+    return b;
+}
+
+/* May a query be sent to b's server now?  Returns 1 if so (possibly
+ * as the probe of an open breaker), 0 if it should fail fast.
+ */
+int
+breaker_allow(struct breaker *b, double now)
+{
+    int allow = 1;
+
+    pthread_mutex_lock(&breaker_lock);
+    if (b->b_open) {
+        if (now >= b->b_next_probe) {
+            b->b_next_probe = now + quota_breaker_probe;
+            if (debug)
+                printf("breaker: %s: probe\n", b->b_rhost);
+        } else
+            allow = 0;
+    }
+    pthread_mutex_unlock(&breaker_lock);
+    return allow;
+}
+
+/* The server answered:  it's up.
+ */
+void
+breaker_ok(struct breaker *b)
+{
+    pthread_mutex_lock(&breaker_lock);
+    b->b_timeouts = 0;
+    if (b->b_open) {
+        b->b_open = 0;
+        if (debug)
+            printf("breaker: %s: closed\n", b->b_rhost);
+    }
+    pthread_mutex_unlock(&breaker_lock);
+}
+
+/* A query to the server timed out.
+ */
+void
+breaker_timeout(struct breaker *b, double now)
+{
+    pthread_mutex_lock(&breaker_lock);
+    b->b_timeouts++;
+    if (!b->b_open && quota_nfs_breaker > 0
+                   && b->b_timeouts >= quota_nfs_breaker) {
+        b->b_open = 1;
+        b->b_next_probe = now + quota_breaker_probe;
+        if (debug)
+            printf("breaker: %s: open after %d timeouts\n", b->b_rhost,
+                   b->b_timeouts);
+    }
+    pthread_mutex_unlock(&breaker_lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
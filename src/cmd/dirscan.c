@@ -0,0 +1,462 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Owners of the directories of a file system down to a given depth, for
+ * repquota -d.
+ *
+ * On NFS every stat() is a GETATTR round trip, and on Lustre a trip to
+ * the MDS, so a tree with 200k directories can't be stat'ed one entry
+ * at a time.  The walk is split into tasks: reading a directory, and
+ * stat'ing a chunk of up to DIRSCAN_CHUNK of its entries.  Reading a
+ * directory drops entries that d_type says aren't directories (or
+ * symbolic links, which are followed) and queues the rest in chunks.
+ * Stat'ing a chunk asks statx() for just the type and owner, letting it
+ * use cached attributes, and queues a read of each directory above the
+ * depth limit.  Symbolic links and other file systems are not descended.
+ *
+ * Each of DIRSCAN_THREADS threads works depth first from its own deque
+ * and, when that is empty, steals the oldest task of another, which is
+ * the one nearest the top and so likely to lead to the most work.  Owners
+ * are handed to the caller as they are found, de-duplicated below the
+ * top level, where each directory is passed on with its name.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* statx */
+#endif
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>   /* makedev */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "src/libutil/util.h"
+#include "src/libutil/uidset.h"
+
+#include "dirscan.h"
+
+#define DIRSCAN_THREADS 32
+#define DIRSCAN_CHUNK   16      /* entries stat'ed per task */
+
+extern int debug;
+
+/* A directory being read, shared by the tasks stat'ing its entries.
+ */
+struct wdir {
+    DIR        *d_dir;
+    char       *d_path;
+    int         d_depth;        /* of the entries; 1 at the top */
+    int         d_refs;         /* tasks holding it, under w_lock */
+};
+
+struct task {
+    struct wdir *t_dir;         /* stat entries of, or NULL to read t_path */
+    char       *t_path;         /* directory to read */
+    int         t_depth;        /* ... and the depth of its entries */
+    char       *t_names;        /* entries to stat, NUL separated */
+    int         t_count;
+};
+
+/* A worker's deque: it pushes and pops at the tail, others steal from
+ * the head.
+ */
+struct worker {
+    pthread_t       k_thread;
+    struct walk    *k_walk;
+    pthread_mutex_t k_lock;
+    struct task    *k_tasks;
+    int             k_head;
+    int             k_tail;
+    int             k_size;
+    int             k_entries;  /* counters, summed at the end */
+    int             k_stats;
+    int             k_dirs;
+    int             k_reads;
+    int             k_steals;
+};
+
+struct walk {
+    pthread_mutex_t w_lock;
+    pthread_cond_t  w_cond;     /* work was queued, or the walk is over */
+    int             w_pending;  /* tasks queued or running */
+    unsigned        w_pushes;   /* tasks ever queued */
+    int             w_idle;     /* workers waiting on w_cond */
+    struct worker   w_workers[DIRSCAN_THREADS];
+    int             w_count;
+    int             w_maxdepth;
+    dev_t           w_dev;      /* of the top */
+    int             w_failed;   /* the top couldn't be read */
+    pthread_mutex_t w_cblock;   /* serializes w_f */
+    uidset_t        w_seen;
+    dirscan_f       w_f;
+    void           *w_arg;
+};
+
+static void
+push(struct worker *k, struct task *t)
+{
+    struct walk *w = k->k_walk;
+
+    pthread_mutex_lock(&k->k_lock);
+    if (k->k_head > 0 && k->k_head == k->k_tail)
+        k->k_head = k->k_tail = 0;
+    if (k->k_tail == k->k_size) {
+        if (k->k_head > k->k_size / 2) {
+            memmove(k->k_tasks, k->k_tasks + k->k_head,
+                    sizeof(struct task) * (k->k_tail - k->k_head));
+            k->k_tail -= k->k_head;
+            k->k_head = 0;
+        } else {
+            k->k_size = k->k_size ? k->k_size * 2 : 64;
+            k->k_tasks = xrealloc(k->k_tasks,
+                                  sizeof(struct task) * k->k_size);
+        }
+    }
+    k->k_tasks[k->k_tail++] = *t;
+    pthread_mutex_unlock(&k->k_lock);
+
+    pthread_mutex_lock(&w->w_lock);
+    w->w_pending++;
+    w->w_pushes++;
+    if (w->w_idle > 0)
+        pthread_cond_signal(&w->w_cond);
+    pthread_mutex_unlock(&w->w_lock);
+}
+
+static int
+pop(struct worker *k, struct task *t)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&k->k_lock);
+    if (k->k_tail > k->k_head) {
+        *t = k->k_tasks[--k->k_tail];
+        rc = 0;
+    }
+    pthread_mutex_unlock(&k->k_lock);
+    return rc;
+}
+
+static int
+steal(struct worker *k, struct task *t)
+{
+    struct walk *w = k->k_walk;
+    struct worker *v;
+    int i, rc = -1;
+
+    for (i = 1; i < w->w_count && rc < 0; i++) {
+        v = &w->w_workers[(k - w->w_workers + i) % w->w_count];
+        pthread_mutex_lock(&v->k_lock);
+        if (v->k_tail > v->k_head) {
+            *t = v->k_tasks[v->k_head++];
+            rc = 0;
+        }
+        pthread_mutex_unlock(&v->k_lock);
+    }
+    if (rc == 0)
+        k->k_steals++;
+    return rc;
+}
+
+static void
+release(struct walk *w, struct wdir *d)
+{
+    int last;
+
+    pthread_mutex_lock(&w->w_lock);
+    last = (--d->d_refs == 0);
+    pthread_mutex_unlock(&w->w_lock);
+    if (last) {
+        closedir(d->d_dir);
+        free(d->d_path);
+        free(d);
+    }
+}
+
+static void
+report(struct walk *w, uid_t uid, char *name, int top)
+{
+    pthread_mutex_lock(&w->w_cblock);
+    if (uidset_add(w->w_seen, uid) || top)
+        w->w_f(uid, top ? name : NULL, w->w_arg);
+    pthread_mutex_unlock(&w->w_cblock);
+}
+
+/* Read a directory, queueing its likely subdirectories in chunks.
+ */
+static void
+read_dir(struct worker *k, struct task *rt)
+{
+    struct walk *w = k->k_walk;
+    struct dirent *dp;
+    struct wdir *d;
+    struct task t;
+    size_t len, size = 0, max = 0;
+    DIR *dir;
+    int fd, flags = O_RDONLY | O_DIRECTORY;
+
+    /* the top may be a link, like the rpath in quota.conf, but links
+     * below it are stat'ed, not descended */
+    if (rt->t_depth > 1)
+        flags |= O_NOFOLLOW;
+    fd = open(rt->t_path, flags);
+    if (fd < 0 || !(dir = fdopendir(fd))) {
+        if (fd >= 0)
+            close(fd);
+        if (rt->t_depth == 1) {
+            pthread_mutex_lock(&w->w_lock);
+            w->w_failed = 1;
+            pthread_mutex_unlock(&w->w_lock);
+        }
+        return;
+    }
+    k->k_reads++;
+    d = xmalloc(sizeof(*d));
+    d->d_dir = dir;
+    d->d_path = xstrdup(rt->t_path);
+    d->d_depth = rt->t_depth;
+    d->d_refs = 1;                      /* ours, until the end */
+    memset(&t, 0, sizeof(t));
+    t.t_dir = d;
+    while ((dp = readdir(dir))) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+            continue;
+        k->k_entries++;
+        if (dp->d_type != DT_DIR && dp->d_type != DT_LNK
+                                 && dp->d_type != DT_UNKNOWN)
+            continue;
+        len = strlen(dp->d_name) + 1;
+        while (size + len > max) {
+            max = max ? max * 2 : 1024;
+            t.t_names = xrealloc(t.t_names, max);
+        }
+        memcpy(t.t_names + size, dp->d_name, len);
+        size += len;
+        if (++t.t_count == DIRSCAN_CHUNK) {
+            pthread_mutex_lock(&w->w_lock);
+            d->d_refs++;
+            pthread_mutex_unlock(&w->w_lock);
+            push(k, &t);
+            t.t_names = NULL;
+            t.t_count = 0;
+            size = max = 0;
+        }
+    }
+    if (t.t_count > 0) {
+        pthread_mutex_lock(&w->w_lock);
+        d->d_refs++;
+        pthread_mutex_unlock(&w->w_lock);
+        push(k, &t);
+    }
+    release(w, d);
+}
+
+/* Find the type and owner of name in directory fd, following symbolic
+ * links as stat() does.
+ */
+static int
+stat_owner(int fd, char *name, uid_t *uidp, int *isdirp, dev_t *devp)
+{
+#if HAVE_STATX
+    struct statx stx;
+
+    if (statx(fd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_UID, &stx) < 0)
+        return -1;
+    *uidp = stx.stx_uid;
+    *isdirp = S_ISDIR(stx.stx_mode);
+    *devp = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+#else
+    struct stat sb;
+
+    if (fstatat(fd, name, &sb, 0) < 0)
+        return -1;
+    *uidp = sb.st_uid;
+    *isdirp = S_ISDIR(sb.st_mode);
+    *devp = sb.st_dev;
+#endif
+    return 0;
+}
+
+/* Stat a chunk of entries, reporting the owners of directories and
+ * queueing reads of those to descend.
+ */
+static void
+stat_chunk(struct worker *k, struct task *st)
+{
+    struct walk *w = k->k_walk;
+    struct wdir *d = st->t_dir;
+    int fd = dirfd(d->d_dir);
+    char *name = st->t_names;
+    struct task t;
+    uid_t uid;
+    dev_t dev;
+    int i, isdir, len;
+
+    memset(&t, 0, sizeof(t));
+    for (i = 0; i < st->t_count; i++, name += strlen(name) + 1) {
+        k->k_stats++;
+        if (stat_owner(fd, name, &uid, &isdir, &dev) < 0 || !isdir)
+            continue;
+        k->k_dirs++;
+        report(w, uid, name, d->d_depth == 1);
+        if (d->d_depth < w->w_maxdepth && dev == w->w_dev) {
+            /* the path is only read later, so the walk holds one
+             * open directory per level, not one per queued read */
+            len = strlen(d->d_path) + strlen(name) + 2;
+            t.t_path = xmalloc(len);
+            snprintf(t.t_path, len, "%s/%s", d->d_path, name);
+            t.t_depth = d->d_depth + 1;
+            push(k, &t);
+        }
+    }
+    free(st->t_names);
+    release(w, d);
+}
+
+static void *
+walk_worker(void *arg)
+{
+    struct worker *k = arg;
+    struct walk *w = k->k_walk;
+    struct task t;
+    unsigned pushes;
+
+    memset(&t, 0, sizeof(t));
+    for (;;) {
+        pthread_mutex_lock(&w->w_lock);
+        pushes = w->w_pushes;
+        pthread_mutex_unlock(&w->w_lock);
+        if (pop(k, &t) == 0 || steal(k, &t) == 0) {
+            if (t.t_dir)
+                stat_chunk(k, &t);
+            else
+                read_dir(k, &t);
+            free(t.t_path);
+            pthread_mutex_lock(&w->w_lock);
+            if (--w->w_pending == 0)
+                pthread_cond_broadcast(&w->w_cond);
+            pthread_mutex_unlock(&w->w_lock);
+            continue;
+        }
+        /* nothing found: wait unless something was queued meanwhile */
+        pthread_mutex_lock(&w->w_lock);
+        if (w->w_pending == 0) {
+            pthread_mutex_unlock(&w->w_lock);
+            break;
+        }
+        if (w->w_pushes == pushes) {
+            w->w_idle++;
+            pthread_cond_wait(&w->w_cond, &w->w_lock);
+            w->w_idle--;
+        }
+        pthread_mutex_unlock(&w->w_lock);
+    }
+    return NULL;
+}
+
+/* Call f with the owner and name of each directory in path, and once
+ * with the owner and a NULL name for each other owner of a directory
+ * down to depth levels below it.  Calls are serialized but come from
+ * several threads, in no particular order.
+ * Returns -1 if path can't be read.
+ */
+int
+dirscan_walk(char *path, int depth, dirscan_f f, void *arg)
+{
+    struct walk *w;
+    struct worker *k;
+    struct task t;
+    struct stat sb;
+    double t0 = monotime();
+    int i, entries = 0, stats = 0, dirs = 0, reads = 0, steals = 0, rc;
+
+    if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode) || access(path, R_OK) < 0)
+        return -1;
+    w = xmalloc(sizeof(*w));
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->w_lock, NULL);
+    pthread_cond_init(&w->w_cond, NULL);
+    pthread_mutex_init(&w->w_cblock, NULL);
+    w->w_maxdepth = depth < 1 ? 1 : depth;
+    w->w_dev = sb.st_dev;
+    w->w_seen = uidset_create();
+    w->w_f = f;
+    w->w_arg = arg;
+    w->w_count = DIRSCAN_THREADS;
+    for (i = 0; i < w->w_count; i++) {
+        w->w_workers[i].k_walk = w;
+        pthread_mutex_init(&w->w_workers[i].k_lock, NULL);
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.t_path = xstrdup(path);
+    t.t_depth = 1;
+    push(&w->w_workers[0], &t);
+    for (i = 1; i < w->w_count; i++) {
+        k = &w->w_workers[i];
+        if (pthread_create(&k->k_thread, NULL, walk_worker, k) != 0)
+            break;
+    }
+    walk_worker(&w->w_workers[0]);
+    while (--i > 0)
+        pthread_join(w->w_workers[i].k_thread, NULL);
+
+    for (i = 0; i < w->w_count; i++) {
+        k = &w->w_workers[i];
+        entries += k->k_entries;
+        stats += k->k_stats;
+        dirs += k->k_dirs;
+        reads += k->k_reads;
+        steals += k->k_steals;
+        free(k->k_tasks);
+        pthread_mutex_destroy(&k->k_lock);
+    }
+    if (debug)
+        printf("dirscan: %s: %d directories of %d entries (%d stat'ed "
+               "by %d threads) in %.3fs\n"
+               "dirscan: %d owners, %d directories read to depth %d, "
+               "%d tasks stolen\n", path, dirs, entries, stats, w->w_count,
+               monotime() - t0, uidset_count(w->w_seen), reads,
+               w->w_maxdepth, steals);
+    uidset_destroy(w->w_seen);
+    pthread_mutex_destroy(&w->w_cblock);
+    pthread_cond_destroy(&w->w_cond);
+    pthread_mutex_destroy(&w->w_lock);
+    rc = w->w_failed ? -1 : 0;
+    free(w);
+    return rc;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
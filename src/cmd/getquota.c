@@ -33,14 +33,22 @@
 #include <string.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <time.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "src/libutil/util.h"
+#include "src/libutil/listint.h"
 
 #include "getquota.h"
 #include "getquota_private.h"
 
 extern char *prog;
+extern int debug;
+
+int quota_lustre_depth = 0;             /* overrides quota.conf if set */
+
+static struct quota_backend *backend_get(char *rhost);
 
 quota_t
 quota_create(char *label, char *rhost, char *rpath, int thresh)
@@ -53,6 +61,7 @@ quota_create(char *label, char *rhost, char *rpath, int thresh)
     q->q_label = xstrdup(label);
     q->q_rhost = xstrdup(rhost);
     q->q_rpath = xstrdup(rpath);
+    q->q_backend = backend_get(rhost);
     q->q_thresh = thresh;
 
     return q;
@@ -70,6 +79,10 @@ quota_destroy(quota_t q)
         free(q->q_rhost);
     if (q->q_rpath)
         free(q->q_rpath);
+    if (q->q_proto)
+        free(q->q_proto);
+    if (q->q_targets)
+        list_destroy(q->q_targets);
     memset(q, 0, sizeof(struct quota_struct));
     free(q);
 }
@@ -146,43 +159,605 @@ quota_get_test(uid_t uid, quota_t q)
             rc = 1;
             break;
     }
+    if (rc == 0 && q->q_want_targets) {
+        quota_t t = quota_add_target(q, "MDT0000");
+
+        t->q_files_used = q->q_files_used;
+        t = quota_add_target(q, "OST0000");
+        t->q_bytes_used = q->q_bytes_used / 2;
+        t = quota_add_target(q, "OST0001");
+        t->q_bytes_used = q->q_bytes_used - q->q_bytes_used / 2;
+    }
     return rc;
 }
-#endif
 
-int
-quota_get(uid_t uid, quota_t q)
+/* The test "file system" has quota records for uids 100-106.
+ */
+static int
+quota_get_all_test(quota_t q, listint_t uids, List qlist)
 {
-    int rc;
+    quota_t x;
+    uid_t uid;
+    int n = 0;
 
-    assert(q->q_magic == QUOTA_MAGIC);
-    if (!strcmp(q->q_rhost, "test")) {
-#ifndef NDEBUG
-        rc = quota_get_test(uid, q);
+    for (uid = 100; uid <= 106; uid++) {
+        if (uids && !listint_member(uids, uid))
+            continue;
+        x = quota_create(q->q_label, q->q_rhost, q->q_rpath, q->q_thresh);
+        (void)quota_get_test(uid, x);
+        list_append(qlist, x);
+        n++;
+    }
+    return n;
+}
 #else
-        fprintf(stderr, "%s: compiled with -DNDEBUG\n", prog);
-        rc = 1;
+static int
+quota_get_test(uid_t uid, quota_t q)
+{
+    fprintf(stderr, "%s: compiled with -DNDEBUG\n", prog);
+    return 1;
+}
+
+static int
+quota_get_all_test(quota_t q, listint_t uids, List qlist)
+{
+    return -1;
+}
 #endif
-    } else if (!strcmp(q->q_rhost, "lustre")) {
-#if HAVE_LIBLUSTREAPI
-        rc = quota_get_lustre(uid, q);
-#else
-        fprintf(stderr, "%s: not configured with lustre support\n", prog);
-        rc = 1;
+
+/* Like the Lustre backend, say how deep a pool the batch would get, so
+ * tests can check that quota.conf limits reach blocking backends.
+ */
+static int
+quota_get_test_many(uid_t *uids, int n, quota_t *qv, int *rcv,
+                    double deadline, quota_done_f done, void *arg)
+{
+    if (debug && n > 0)
+        printf("test: %d quotas, depth %d\n", n, quota_pool_depth(qv[0]));
+    return quota_get_serial(uids, n, qv, rcv, deadline, done, arg);
+}
+
+static struct quota_backend quota_backend_test = {
+    "test",
+    1,                      /* blocking */
+    NULL,                   /* init */
+    quota_get_test,
+    quota_get_test_many,
+    quota_get_all_test,
+    NULL,                   /* fini */
+};
+
+#if !HAVE_LIBLUSTREAPI
+static int
+quota_get_nolustre(uid_t uid, quota_t q)
+{
+    fprintf(stderr, "%s: not configured with lustre support\n", prog);
+    return 1;
+}
+
+struct quota_backend quota_backend_lustre = {
+    "lustre",
+    1,                      /* blocking */
+    NULL,                   /* init */
+    quota_get_nolustre,
+    quota_get_serial,
+    NULL,                   /* get_all */
+    NULL,                   /* fini */
+};
 #endif
-    } else {
-        rc = quota_get_nfs(uid, q);
+
+#if !HAVE_LINUX_QUOTA_H
+static int
+quota_get_nolocal(uid_t uid, quota_t q)
+{
+    fprintf(stderr, "%s: local quotas are not supported on this system\n",
+            prog);
+    return 1;
+}
+
+struct quota_backend quota_backend_local = {
+    "local",
+    0,                      /* blocking */
+    NULL,                   /* init */
+    quota_get_nolocal,
+    quota_get_serial,
+    NULL,                   /* get_all */
+    NULL,                   /* fini */
+};
+#endif
+
+/* Backends by name.  The last one (NFS) takes any other rhost.
+ */
+static struct quota_backend *backends[] = {
+    &quota_backend_test,
+    &quota_backend_lustre,
+    &quota_backend_local,
+    &quota_backend_nfs,
+};
+#define NBACKENDS ((int)(sizeof(backends) / sizeof(backends[0])))
+
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+static int backend_workers = 0;     /* batch workers still running */
+
+/* Release the backends' state at exit, unless a batch worker that the
+ * caller gave up on at its deadline may still be inside one of them, in
+ * which case the state is left for the exit to reclaim.
+ */
+static void
+backend_fini(void)
+{
+    int i, busy;
+
+    pthread_mutex_lock(&backend_lock);
+    busy = backend_workers;
+    pthread_mutex_unlock(&backend_lock);
+    if (busy > 0)
+        return;
+    for (i = 0; i < NBACKENDS; i++) {
+        if (backends[i]->qb_ready && backends[i]->qb_fini)
+            backends[i]->qb_fini();
+        backends[i]->qb_ready = 0;
     }
-    return rc;
+}
+
+/* Find the backend for rhost, initializing it on first use.
+ */
+static struct quota_backend *
+backend_get(char *rhost)
+{
+    static int registered = 0;
+    struct quota_backend *b;
+    int i;
+
+    for (i = 0; i < NBACKENDS - 1; i++)
+        if (!strcmp(backends[i]->qb_name, rhost))
+            break;
+    b = backends[i];
+    pthread_mutex_lock(&backend_lock);
+    if (!b->qb_ready) {
+        if (!registered) {
+            atexit(backend_fini);
+            registered = 1;
+        }
+        if (b->qb_init)
+            b->qb_init();
+        b->qb_ready = 1;
+    }
+    pthread_mutex_unlock(&backend_lock);
+    return b;
+}
+
+static void
+quota_clear_targets(quota_t q)
+{
+    if (q->q_targets) {
+        list_destroy(q->q_targets);
+        q->q_targets = NULL;
+    }
+}
+
+/* Fill in q with uid's quota.  Returns 0 on success, nonzero with a
+ * message on stderr on failure.  MT-safe:  any number of threads may
+ * call this at once as long as each has its own q.  The NFS client
+ * handle cache, host cache and circuit breakers are shared under locks.
+ */
+int
+quota_get(uid_t uid, quota_t q)
+{
+    assert(q->q_magic == QUOTA_MAGIC);
+    quota_clear_targets(q);
+    return q->q_backend->qb_get(uid, q);
+}
+
+/* Queries a blocking backend keeps in flight for q: --lustre-depth,
+ * else the quota.conf window flag, else QUOTA_LUSTRE_DEPTH.
+ */
+int
+quota_pool_depth(quota_t q)
+{
+    int depth = QUOTA_LUSTRE_DEPTH;
+
+    if (quota_lustre_depth > 0)
+        depth = quota_lustre_depth;
+    else if (q->q_window > 0)
+        depth = q->q_window;
+    return depth < QUOTA_POOL_MAX_DEPTH ? depth : QUOTA_POOL_MAX_DEPTH;
+}
+
+/* get_many() for backends that fetch one quota at a time.
+ */
+int
+quota_get_serial(uid_t *uids, int n, quota_t *qv, int *rcv,
+                 double deadline, quota_done_f done, void *arg)
+{
+    int i, fails = 0;
+
+    for (i = 0; i < n; i++) {
+        if (deadline > 0 && monotime() >= deadline) {
+            fprintf(stderr, "%s: %s: timed out\n", prog, qv[i]->q_label);
+            rcv[i] = -1;
+        } else
+            rcv[i] = quota_get(uids[i], qv[i]);
+        if (rcv[i] != 0)
+            fails++;
+        if (done)
+            done(i, arg);
+    }
+    return fails;
+}
+
+/* Copy the result of a query from src to dst.  Per-target results move.
+ */
+static void
+quota_copy_result(quota_t dst, quota_t src)
+{
+    quota_clear_targets(dst);
+    dst->q_targets = src->q_targets;
+    src->q_targets = NULL;
+    dst->q_uid = src->q_uid;
+    dst->q_bytes_used = src->q_bytes_used;
+    dst->q_bytes_softlim = src->q_bytes_softlim;
+    dst->q_bytes_hardlim = src->q_bytes_hardlim;
+    dst->q_bytes_secleft = src->q_bytes_secleft;
+    dst->q_bytes_state = src->q_bytes_state;
+    dst->q_files_used = src->q_files_used;
+    dst->q_files_softlim = src->q_files_softlim;
+    dst->q_files_hardlim = src->q_files_hardlim;
+    dst->q_files_secleft = src->q_files_secleft;
+    dst->q_files_state = src->q_files_state;
+}
+
+/* State shared by quota_get_many() and the worker thread that runs the
+ * queries to blocking backends while the caller runs the others (NFS).
+ * Queries are grouped by backend so that each group is one get_many()
+ * call.  A worker stuck in a hung file system may outlive the caller's
+ * deadline, so it works on private copies of its quotas and the batch
+ * is freed by whichever of the two lets go of it last.
+ */
+struct batch {
+    pthread_mutex_t b_lock;
+    pthread_cond_t  b_cond;
+    int             b_refs;
+    int             b_abandoned;    /* caller gave up waiting */
+    quota_t        *b_qv;
+    int            *b_rcv;
+    quota_done_f    b_done;
+    void           *b_arg;
+    int            *b_fg_ix;        /* caller's index -> quota_get_many's */
+    uid_t          *b_fg_uids;
+    quota_t        *b_fg_qv;
+    int            *b_fg_rcv;
+    int             b_nfg;
+    int             b_fg_base;      /* first index of the current group */
+    int            *b_bg_ix;        /* worker's index -> quota_get_many's */
+    uid_t          *b_bg_uids;
+    quota_t        *b_bg_qv;        /* worker's private copies */
+    int            *b_bg_rcv;
+    char           *b_bg_fin;       /* finished before the deadline */
+    int             b_nbg;
+    int             b_bg_base;
+    int             b_nbg_done;
+};
+
+static void
+batch_release(struct batch *b)
+{
+    int i, refs;
+
+    pthread_mutex_lock(&b->b_lock);
+    refs = --b->b_refs;
+    pthread_mutex_unlock(&b->b_lock);
+    if (refs > 0)
+        return;
+    for (i = 0; i < b->b_nbg; i++)
+        quota_destroy(b->b_bg_qv[i]);
+    pthread_mutex_destroy(&b->b_lock);
+    pthread_cond_destroy(&b->b_cond);
+    free(b->b_fg_ix);
+    free(b->b_fg_uids);
+    free(b->b_fg_qv);
+    free(b->b_fg_rcv);
+    free(b->b_bg_ix);
+    free(b->b_bg_uids);
+    free(b->b_bg_qv);
+    free(b->b_bg_rcv);
+    free(b->b_bg_fin);
+    free(b);
+}
+
+/* Record the result of query i and tell the caller.  Call with b_lock held.
+ */
+static void
+batch_finish(struct batch *b, int i, int rc)
+{
+    b->b_rcv[i] = rc;
+    if (b->b_done)
+        b->b_done(i, b->b_arg);
+}
+
+static void
+batch_fg_done(int j, void *arg)
+{
+    struct batch *b = arg;
+
+    j += b->b_fg_base;
+    pthread_mutex_lock(&b->b_lock);
+    batch_finish(b, b->b_fg_ix[j], b->b_fg_rcv[j]);
+    pthread_mutex_unlock(&b->b_lock);
+}
+
+static void
+batch_bg_done(int k, void *arg)
+{
+    struct batch *b = arg;
+
+    k += b->b_bg_base;
+    pthread_mutex_lock(&b->b_lock);
+    if (!b->b_abandoned) {
+        quota_copy_result(b->b_qv[b->b_bg_ix[k]], b->b_bg_qv[k]);
+        batch_finish(b, b->b_bg_ix[k], b->b_bg_rcv[k]);
+        b->b_bg_fin[k] = 1;
+        b->b_nbg_done++;
+        pthread_cond_signal(&b->b_cond);
+    }
+    pthread_mutex_unlock(&b->b_lock);
+}
+
+/* Length of the run of queries to one backend starting at qv[i].
+ */
+static int
+group_len(quota_t *qv, int i, int n)
+{
+    int m = 1;
+
+    while (i + m < n && qv[i + m]->q_backend == qv[i]->q_backend)
+        m++;
+    return m;
+}
+
+static void *
+batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    struct quota_backend *be;
+    int k, m, abandoned = 0;
+
+    for (k = 0; k < b->b_nbg && !abandoned; k += m) {
+        m = group_len(b->b_bg_qv, k, b->b_nbg);
+        be = b->b_bg_qv[k]->q_backend;
+        b->b_bg_base = k;
+        be->qb_get_many(&b->b_bg_uids[k], m, &b->b_bg_qv[k],
+                        &b->b_bg_rcv[k], 0, batch_bg_done, b);
+        pthread_mutex_lock(&b->b_lock);
+        abandoned = b->b_abandoned;
+        pthread_mutex_unlock(&b->b_lock);
+    }
+    batch_release(b);
+    pthread_mutex_lock(&backend_lock);
+    backend_workers--;
+    pthread_mutex_unlock(&backend_lock);
+    return NULL;
+}
+
+/* Wait for the worker to finish its queries or for the deadline to pass,
+ * in which case its unfinished queries fail.
+ */
+static void
+batch_wait(struct batch *b, double deadline)
+{
+    struct timespec ts;
+    quota_t q;
+    int k;
+
+    pthread_mutex_lock(&b->b_lock);
+    while (b->b_nbg_done < b->b_nbg) {
+        if (deadline > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            if (ts.tv_sec + ts.tv_nsec * 1E-9 >= deadline)
+                break;
+            ts.tv_sec = deadline;
+            ts.tv_nsec = (deadline - ts.tv_sec) * 1E9;
+            pthread_cond_timedwait(&b->b_cond, &b->b_lock, &ts);
+        } else
+            pthread_cond_wait(&b->b_cond, &b->b_lock);
+    }
+    if (b->b_nbg_done < b->b_nbg) {
+        b->b_abandoned = 1;
+        for (k = 0; k < b->b_nbg; k++) {
+            if (b->b_bg_fin[k])
+                continue;
+            q = b->b_qv[b->b_bg_ix[k]];
+            fprintf(stderr, "%s: %s: timed out\n", prog, q->q_label);
+            batch_finish(b, b->b_bg_ix[k], -1);
+        }
+    }
+    pthread_mutex_unlock(&b->b_lock);
+}
+
+/* Get quotas for uids[0..n-1] into qv[0..n-1].  The quotas may be on
+ * any mix of file systems.  The queries to each backend are handed to
+ * its get_many() in one batch:  NFS quotas are fetched concurrently by
+ * the pipelined client, while those to backends that may block are
+ * fetched by a worker thread.  rcv[i] is set to the result of each
+ * query, and then done(i, arg) is called if done is non-NULL; calls to
+ * done() are serialized but may come from either thread, in completion
+ * order.  If timeout is nonzero, queries not complete after that many
+ * seconds fail.  Returns the number of failures.
+ */
+int
+quota_get_many(uid_t *uids, int n, quota_t *qv, int *rcv,
+               double timeout, quota_done_f done, void *arg)
+{
+    double deadline = timeout > 0 ? monotime() + timeout : 0;
+    struct batch *b = xmalloc(sizeof(struct batch));
+    struct quota_backend *be;
+    pthread_condattr_t attr;
+    pthread_t t;
+    quota_t q;
+    int i, j, m, fails = 0;
+
+    memset(b, 0, sizeof(struct batch));
+    pthread_mutex_init(&b->b_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&b->b_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    b->b_refs = 1;
+    b->b_qv = qv;
+    b->b_rcv = rcv;
+    b->b_done = done;
+    b->b_arg = arg;
+    b->b_fg_ix = xmalloc(sizeof(int) * (n + 1));
+    b->b_fg_uids = xmalloc(sizeof(uid_t) * (n + 1));
+    b->b_fg_qv = xmalloc(sizeof(quota_t) * (n + 1));
+    b->b_fg_rcv = xmalloc(sizeof(int) * (n + 1));
+    b->b_bg_ix = xmalloc(sizeof(int) * (n + 1));
+    b->b_bg_uids = xmalloc(sizeof(uid_t) * (n + 1));
+    b->b_bg_qv = xmalloc(sizeof(quota_t) * (n + 1));
+    b->b_bg_rcv = xmalloc(sizeof(int) * (n + 1));
+    b->b_bg_fin = xmalloc(n + 1);
+    memset(b->b_bg_fin, 0, n + 1);
+
+    for (j = 0; j < NBACKENDS; j++) {
+        be = backends[j];
+        for (i = 0; i < n; i++) {
+            q = qv[i];
+            assert(q->q_magic == QUOTA_MAGIC);
+            if (q->q_backend != be)
+                continue;
+            quota_clear_targets(q);
+            if (!be->qb_blocking) {
+                b->b_fg_uids[b->b_nfg] = uids[i];
+                b->b_fg_qv[b->b_nfg] = q;
+                b->b_fg_ix[b->b_nfg++] = i;
+            } else {
+                b->b_bg_uids[b->b_nbg] = uids[i];
+                b->b_bg_qv[b->b_nbg] = quota_create(q->q_label, q->q_rhost,
+                                                    q->q_rpath, q->q_thresh);
+                quota_settargets(b->b_bg_qv[b->b_nbg], q->q_want_targets);
+                quota_setproto(b->b_bg_qv[b->b_nbg], q->q_proto);
+                quota_setlimits(b->b_bg_qv[b->b_nbg], q->q_window, q->q_qps);
+                b->b_bg_ix[b->b_nbg++] = i;
+            }
+        }
+    }
+
+    /* The worker is counted until it returns, so that backend_fini()
+     * leaves alone a backend it may still be blocked in.
+     */
+    if (b->b_nbg > 0) {
+        b->b_refs++;
+        pthread_mutex_lock(&backend_lock);
+        backend_workers++;
+        pthread_mutex_unlock(&backend_lock);
+    }
+    /* Without other queries or a deadline to overlap with, there is no
+     * point in a thread: run the rest right here.
+     */
+    if (b->b_nbg > 0 && b->b_nfg == 0 && deadline == 0)
+        batch_worker(b);
+    else if (b->b_nbg > 0) {
+        if ((errno = pthread_create(&t, NULL, batch_worker, b)) != 0) {
+            fprintf(stderr, "%s: pthread_create: %s\n", prog,
+                    strerror(errno));
+            exit(1);
+        }
+        pthread_detach(t);
+    }
+    for (i = 0; i < b->b_nfg; i += m) {
+        m = group_len(b->b_fg_qv, i, b->b_nfg);
+        be = b->b_fg_qv[i]->q_backend;
+        b->b_fg_base = i;
+        be->qb_get_many(&b->b_fg_uids[i], m, &b->b_fg_qv[i],
+                        &b->b_fg_rcv[i], deadline, batch_fg_done, b);
+    }
+    batch_wait(b, deadline);
+    batch_release(b);
+
+    for (i = 0; i < n; i++)
+        if (rcv[i] != 0)
+            fails++;
+    return fails;
+}
+
+/* Get the quota of every uid with a quota record (usage or limits) on
+ * q's file system, or of those in uids if it is non-NULL, appending the
+ * new quotas to qlist.  Returns the number found, or -1 if the backend
+ * can't list its quota records, in which case the caller must find the
+ * uids some other way and query them one by one.
+ */
+int
+quota_get_all(quota_t q, listint_t uids, List qlist)
+{
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (!q->q_backend->qb_get_all)
+        return -1;
+    return q->q_backend->qb_get_all(q, uids, qlist);
+}
+
+uid_t
+quota_uid(quota_t q)
+{
+    assert(q->q_magic == QUOTA_MAGIC);
+    return q->q_uid;
 }
 
 void
 quota_adduser(quota_t q, char *name)
 {
     assert(q->q_magic == QUOTA_MAGIC);
+    if (q->q_name)
+        free(q->q_name);
     q->q_name = xstrdup(name);
 }
 
+/* Set the NFS transport ("udp" or "tcp") for q.  NULL selects the
+ * default, quota_nfs_transport.
+ */
+void
+quota_setproto(quota_t q, char *proto)
+{
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (q->q_proto)
+        free(q->q_proto);
+    q->q_proto = proto ? xstrdup(proto) : NULL;
+}
+
+/* Ask for q's usage and granted limits on each of its file system's
+ * storage targets as well as the total, where the backend has them
+ * (Lustre MDTs and OSTs).  quota_print() shows them after the total.
+ */
+void
+quota_settargets(quota_t q, int flag)
+{
+    assert(q->q_magic == QUOTA_MAGIC);
+    q->q_want_targets = flag;
+}
+
+/* Add an empty quota for target name to q's targets, for a backend to
+ * fill in.
+ */
+quota_t
+quota_add_target(quota_t q, char *name)
+{
+    quota_t t = quota_create(name, q->q_rhost, q->q_rpath, 0);
+
+    assert(q->q_magic == QUOTA_MAGIC);
+    t->q_uid = q->q_uid;
+    if (!q->q_targets)
+        q->q_targets = list_create((ListDelF)quota_destroy);
+    list_append(q->q_targets, t);
+    return t;
+}
+
+void
+quota_setlimits(quota_t q, int window, double qps)
+{
+    assert(q->q_magic == QUOTA_MAGIC);
+    q->q_window = window;
+    q->q_qps = qps;
+}
+
 int
 quota_match_uid(quota_t x, uid_t *key)
 {
@@ -527,26 +1102,48 @@ quota_print_raw(quota_t q, void *arg)
     return 0;
 }
 
+#define REALPATH_LEN 64
+
 /* helper for quota_print_realpath() */
 static char *
-make_realpath(quota_t q)
+make_realpath(quota_t q, char *buf, int len)
 {
-    static char tmpstr[64];
     char *label = q->q_rpath;
 
-    if (strcmp(q->q_rhost, "lustre") != 0) {
-        snprintf(tmpstr, sizeof(tmpstr), "%s:%s", q->q_rhost, q->q_rpath);
-        label = tmpstr;
+    if (q->q_backend == &quota_backend_nfs) {
+        snprintf(buf, len, "%s:%s", q->q_rhost, q->q_rpath);
+        label = buf;
     }
     return label;
 }
 
+/* helper for quota_print() */
+static void
+report_targets(quota_t q)
+{
+    ListIterator itr;
+    char label[64];
+    quota_t t;
+
+    if (!q->q_targets)
+        return;
+    itr = list_iterator_create(q->q_targets);
+    while ((t = list_next(itr))) {
+        snprintf(label, sizeof(label), "  %s", t->q_label);
+        report_usage(t, label);
+    }
+    list_iterator_destroy(itr);
+}
+
 int
 quota_print_realpath(quota_t q, void *arg)
 {
+    char buf[REALPATH_LEN];
+
     assert(q->q_magic == QUOTA_MAGIC);
-    report_usage(q, make_realpath(q));
-    report_warning(q, make_realpath(q), "*** ");
+    report_usage(q, make_realpath(q, buf, sizeof(buf)));
+    report_targets(q);
+    report_warning(q, make_realpath(q, buf, sizeof(buf)), "*** ");
     return 0;
 }
 
@@ -555,6 +1152,7 @@ quota_print(quota_t q, void *arg)
 {
     assert(q->q_magic == QUOTA_MAGIC);
     report_usage(q, q->q_label);
+    report_targets(q);
     report_warning(q, q->q_label, "*** ");
     return 0;
 }
@@ -570,8 +1168,10 @@ quota_print_justwarn(quota_t q, int *msgcount)
 int
 quota_print_justwarn_realpath(quota_t q, int *msgcount)
 {
+    char buf[REALPATH_LEN];
+
     assert(q->q_magic == QUOTA_MAGIC);
-    *msgcount += report_warning(q, make_realpath(q), "");
+    *msgcount += report_warning(q, make_realpath(q, buf, sizeof(buf)), "");
     return 0;
 }
 
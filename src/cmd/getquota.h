@@ -22,13 +22,27 @@
  *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
 \*****************************************************************************/
 
+#include "src/liblsd/list.h"
+#include "src/libutil/listint.h"
+
+#define QUOTA_NFS_HOST_WINDOW 64    /* default NFS calls in flight/server */
+#define QUOTA_LUSTRE_DEPTH 8        /* default Lustre quotactls in flight */
+
 typedef struct quota_struct *quota_t;
+typedef void (*quota_done_f)(int i, void *arg);
 
 quota_t quota_create(char *label, char *rhost, char *rpath, int thresh);
 void quota_destroy(quota_t q);
 
 int quota_get(uid_t uid, quota_t q);
+int quota_get_many(uid_t *uids, int n, quota_t *qv, int *rcv,
+                   double timeout, quota_done_f done, void *arg);
+int quota_get_all(quota_t q, listint_t uids, List qlist);
+uid_t quota_uid(quota_t q);
 void quota_adduser(quota_t q, char *name);
+void quota_setproto(quota_t q, char *proto);
+void quota_setlimits(quota_t q, int window, double qps);
+void quota_settargets(quota_t q, int flag);
 
 int quota_match_uid(quota_t x, uid_t *key);
 int quota_cmp_uid(quota_t x, quota_t y);
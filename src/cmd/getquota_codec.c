@@ -0,0 +1,216 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Hand-rolled XDR for the pipelined rquota client.
+ *
+ * The rpcgen stubs go through xdr_callmsg()/xdr_replymsg() and a chain
+ * of per-field xdr_* calls through function pointers.  GETQUOTA is small
+ * and fixed, so here the call is written straight into the packet buffer
+ * and the reply is read straight out of it into a quota_t.  Error
+ * handling follows the sunrpc decoder exactly, so that a reply the stubs
+ * would reject is rejected here too, with the same clnt_stat; test/tcodec
+ * checks this against the rpcgen output.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <rpc/rpc.h>
+#include <string.h>
+
+#include "src/librpc/rquota.h"
+
+#include "getquota.h"
+#include "getquota_private.h"
+#include "getquota_codec.h"
+
+#define MAX_MACHINE_NAME 255    /* as in xdr_authunix_parms() */
+
+#define PUT32(p, v)     do { \
+    u_int32_t _w = htonl((u_int32_t)(v)); \
+    memcpy((p), &_w, 4); \
+    (p) += 4; \
+} while (0)
+
+/* Fetch the next word of the reply, or give up if it's truncated.
+ */
+#define GET32(v)        do { \
+    if (end - p < 4) \
+        return RPC_CANTDECODERES; \
+    memcpy(&(v), p, 4); \
+    (v) = ntohl(v); \
+    p += 4; \
+} while (0)
+
+static char *
+put_string(char *p, char *str, int len)
+{
+    PUT32(p, len);
+    if ((len & 3))
+        memset(p + (len & ~3), 0, 4);   /* pad, partly overwritten below */
+    memcpy(p, str, len);
+    return p + RNDUP(len);
+}
+
+/* Encode a GETQUOTA call for uid with AUTH_UNIX credentials (no
+ * supplementary groups) into buf.  Returns the length of the call,
+ * or -1 if it won't fit or the strings are too long for XDR.
+ */
+int
+gq_encode_call(char *buf, int len, u_int32_t xid, u_int32_t stamp,
+               char *lhost, uid_t uid, gid_t gid, char *path)
+{
+    int hlen = strlen(lhost);
+    int plen = strlen(path);
+    int credlen = 4 + 4 + RNDUP(hlen) + 4 + 4 + 4;
+    char *p = buf;
+
+    if (hlen > MAX_MACHINE_NAME || plen > RQ_PATHLEN
+            || credlen > MAX_AUTH_BYTES
+            || 6*4 + 2*4 + credlen + 2*4 + 4 + RNDUP(plen) + 4 > len)
+        return -1;
+    PUT32(p, xid);
+    PUT32(p, CALL);
+    PUT32(p, RPC_MSG_VERSION);
+    PUT32(p, RQUOTAPROG);
+    PUT32(p, RQUOTAVERS);
+    PUT32(p, RQUOTAPROC_GETQUOTA);
+    PUT32(p, AUTH_UNIX);
+    PUT32(p, credlen);
+    PUT32(p, stamp);
+    p = put_string(p, lhost, hlen);
+    PUT32(p, uid);
+    PUT32(p, gid);
+    PUT32(p, 0);                /* gids */
+    PUT32(p, AUTH_NONE);        /* verifier */
+    PUT32(p, 0);
+    p = put_string(p, path, plen);
+    PUT32(p, uid);
+    return p - buf;
+}
+
+/* Get the XID of a reply, so it can be matched to its call before
+ * decoding.  Returns 0 on success, -1 if the reply is too short.
+ */
+int
+gq_reply_xid(char *buf, int len, u_int32_t *xidp)
+{
+    if (len < 4)
+        return -1;
+    memcpy(xidp, buf, 4);
+    *xidp = ntohl(*xidp);
+    return 0;
+}
+
+/* Decode a GETQUOTA reply for uid.  Returns RPC_CANTDECODERES if the
+ * reply is garbage, otherwise the RPC status as _seterr_reply() would
+ * report it.  On RPC_SUCCESS, *statusp is set to the gqr_status, and if
+ * that is Q_OK, the quota is filled into q.  q is untouched otherwise.
+ */
+enum clnt_stat
+gq_decode_reply(char *buf, int len, uid_t uid, quota_t q, int *statusp)
+{
+    char *p = buf, *end = buf + len;
+    struct rquota rq;
+    u_int32_t w, status;
+
+    GET32(w);                   /* xid */
+    GET32(w);
+    if (w != REPLY)
+        return RPC_CANTDECODERES;
+    GET32(w);
+    if (w == MSG_DENIED) {
+        GET32(w);
+        if (w == RPC_MISMATCH) {
+            GET32(w);           /* low, high */
+            GET32(w);
+            return RPC_VERSMISMATCH;
+        }
+        if (w == AUTH_ERROR) {
+            GET32(w);           /* why */
+            return RPC_AUTHERROR;
+        }
+        return RPC_CANTDECODERES;
+    }
+    if (w != MSG_ACCEPTED)
+        return RPC_CANTDECODERES;
+    GET32(w);                   /* verifier flavor */
+    GET32(w);                   /* verifier length */
+    if (w > MAX_AUTH_BYTES || RNDUP(w) > end - p)
+        return RPC_CANTDECODERES;
+    p += RNDUP(w);
+    GET32(w);
+    switch (w) {
+        case SUCCESS:
+            break;
+        case PROG_MISMATCH:
+            GET32(w);           /* low, high */
+            GET32(w);
+            return RPC_PROGVERSMISMATCH;
+        case PROG_UNAVAIL:
+            return RPC_PROGUNAVAIL;
+        case PROC_UNAVAIL:
+            return RPC_PROCUNAVAIL;
+        case GARBAGE_ARGS:
+            return RPC_CANTDECODEARGS;
+        case SYSTEM_ERR:
+            return RPC_SYSTEMERROR;
+        default:
+            return RPC_FAILED;
+    }
+    GET32(status);
+    if (status == Q_OK) {
+        GET32(w);
+        rq.rq_bsize = (int)w;
+        GET32(w);
+        rq.rq_active = (w != 0);
+        GET32(w);
+        rq.rq_bhardlimit = w;
+        GET32(w);
+        rq.rq_bsoftlimit = w;
+        GET32(w);
+        rq.rq_curblocks = w;
+        GET32(w);
+        rq.rq_fhardlimit = w;
+        GET32(w);
+        rq.rq_fsoftlimit = w;
+        GET32(w);
+        rq.rq_curfiles = w;
+        GET32(w);
+        rq.rq_btimeleft = w;
+        GET32(w);
+        rq.rq_ftimeleft = w;
+        quota_nfs_fill(uid, q, &rq);
+    } else if (status != Q_NOQUOTA && status != Q_EPERM)
+        return RPC_CANTDECODERES;
+    *statusp = status;
+    return RPC_SUCCESS;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
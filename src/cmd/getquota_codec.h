@@ -0,0 +1,37 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/* Hand-rolled XDR for GETQUOTA calls and replies, see getquota_codec.c.
+ */
+
+int            gq_encode_call(char *buf, int len, u_int32_t xid,
+                              u_int32_t stamp, char *lhost, uid_t uid,
+                              gid_t gid, char *path);
+int            gq_reply_xid(char *buf, int len, u_int32_t *xidp);
+enum clnt_stat gq_decode_reply(char *buf, int len, uid_t uid, quota_t q,
+                               int *statusp);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,277 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#if HAVE_LINUX_QUOTA_H
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/quota.h>
+#include <mntent.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "src/liblsd/list.h"
+#include "src/libutil/util.h"
+#include "src/libutil/listint.h"
+
+#include "getquota.h"
+#include "getquota_private.h"
+
+extern char *prog;
+
+#define PATH_MOUNTS "/proc/self/mounts"
+
+static qstate_t
+set_state(unsigned long long used, unsigned long long soft,
+          unsigned long long hard, unsigned long long xtim, time_t now)
+{
+    qstate_t state;
+
+    if (!hard && !soft)
+        state = NONE;
+    else if (hard && used > hard)
+        state = EXPIRED;
+    else if (soft && used > soft)
+        if (xtim)
+            state = xtim > now ? STARTED : EXPIRED;
+        else
+            state = UNDER;
+    else
+        state = UNDER;
+
+    return state;
+}
+
+/* A local mount point and the block device that quotactl(2) wants for
+ * it, looked up on its first query and kept for the rest of the run.
+ */
+struct lmnt {
+    char   *lm_mnt;
+    char   *lm_dev;         /* NULL if not usable */
+};
+
+static List mounts = NULL;
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+lmnt_destroy(struct lmnt *lm)
+{
+    if (lm->lm_dev)
+        free(lm->lm_dev);
+    free(lm->lm_mnt);
+    free(lm);
+}
+
+static int
+lmnt_match(struct lmnt *lm, char *mnt)
+{
+    return !strcmp(lm->lm_mnt, mnt);
+}
+
+/* Find the device mounted on mnt.  If something is mounted over it,
+ * the last entry is the one that's visible.  On failure, say why and
+ * leave lm_dev NULL so that later queries fail quietly.
+ */
+static struct lmnt *
+lmnt_create(char *mnt)
+{
+    struct lmnt *lm = xmalloc(sizeof(struct lmnt));
+    struct mntent *me;
+    FILE *f;
+
+    lm->lm_mnt = xstrdup(mnt);
+    lm->lm_dev = NULL;
+    if (!(f = setmntent(PATH_MOUNTS, "r"))) {
+        fprintf(stderr, "%s: %s: %s\n", prog, PATH_MOUNTS, strerror(errno));
+        return lm;
+    }
+    while ((me = getmntent(f))) {
+        if (!strcmp(me->mnt_dir, mnt)) {
+            if (lm->lm_dev)
+                free(lm->lm_dev);
+            lm->lm_dev = xstrdup(me->mnt_fsname);
+        }
+    }
+    endmntent(f);
+    if (!lm->lm_dev)
+        fprintf(stderr, "%s: %s is not mounted\n", prog, mnt);
+    return lm;
+}
+
+/* Return the mount for mnt, or NULL if it isn't mounted.
+ */
+static struct lmnt *
+lmnt_get(char *mnt)
+{
+    struct lmnt *lm;
+
+    pthread_mutex_lock(&mount_lock);
+    if (!(lm = list_find_first(mounts, (ListFindF)lmnt_match, mnt))) {
+        lm = lmnt_create(mnt);
+        list_append(mounts, lm);
+    }
+    pthread_mutex_unlock(&mount_lock);
+    return lm->lm_dev ? lm : NULL;
+}
+
+static void
+local_init(void)
+{
+    mounts = list_create((ListDelF)lmnt_destroy);
+}
+
+static void
+local_fini(void)
+{
+    list_destroy(mounts);
+    mounts = NULL;
+}
+
+/* Not all C libraries declare quotactl(), so call it directly.
+ */
+static int
+local_quotactl(int cmd, struct lmnt *lm, uid_t uid, void *addr)
+{
+    return syscall(SYS_quotactl, QCMD(cmd, USRQUOTA), lm->lm_dev, uid, addr);
+}
+
+static void
+local_error(struct lmnt *lm)
+{
+    if (errno == ESRCH)
+        fprintf(stderr, "%s: %s: user quotas are not enabled\n", prog,
+                lm->lm_mnt);
+    else
+        fprintf(stderr, "%s: quotactl %s: %s\n", prog, lm->lm_mnt,
+                strerror(errno));
+}
+
+/* An if_nextdqblk is an if_dqblk with the id appended, so this fills q
+ * from either.
+ */
+static void
+local_fill(quota_t q, uid_t uid, struct if_nextdqblk *dqb, time_t now)
+{
+    q->q_uid            = uid;
+
+    q->q_bytes_used     = dqb->dqb_curspace;
+    q->q_bytes_softlim  = dqb->dqb_bsoftlimit * QIF_DQBLKSIZE;
+    q->q_bytes_hardlim  = dqb->dqb_bhardlimit * QIF_DQBLKSIZE;
+    q->q_bytes_state = set_state(q->q_bytes_used, q->q_bytes_softlim,
+                                 q->q_bytes_hardlim, dqb->dqb_btime, now);
+    if (q->q_bytes_state == STARTED)
+        q->q_bytes_secleft = dqb->dqb_btime - now;
+
+    q->q_files_used     = dqb->dqb_curinodes;
+    q->q_files_softlim  = dqb->dqb_isoftlimit;
+    q->q_files_hardlim  = dqb->dqb_ihardlimit;
+    q->q_files_state = set_state(q->q_files_used, q->q_files_softlim,
+                                 q->q_files_hardlim, dqb->dqb_itime, now);
+    if (q->q_files_state == STARTED)
+        q->q_files_secleft = dqb->dqb_itime - now;
+}
+
+static int
+quota_get_local(uid_t uid, quota_t q)
+{
+    struct if_nextdqblk dqb;
+    struct lmnt *lm;
+
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (!(lm = lmnt_get(q->q_rpath)))
+        return -1;
+    memset(&dqb, 0, sizeof(dqb));
+    if (local_quotactl(Q_GETQUOTA, lm, uid, &dqb) < 0) {
+        local_error(lm);
+        return -1;
+    }
+    local_fill(q, uid, &dqb, time(NULL));
+    return 0;
+}
+
+/* Walk the quota records in id order with Q_GETNEXTQUOTA, one quotactl
+ * per record, rather than querying every candidate uid.  XFS answers
+ * the generic command too, so Q_XGETNEXTQUOTA isn't needed.  Kernels
+ * older than 4.6 don't have it, so the caller falls back to a scan.
+ */
+static int
+quota_get_all_local(quota_t q, listint_t uids, List qlist)
+{
+    struct if_nextdqblk dqb;
+    struct lmnt *lm;
+    time_t now = time(NULL);
+    uint32_t id = 0;
+    quota_t x;
+    int n = 0;
+
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (!(lm = lmnt_get(q->q_rpath)))
+        return 0;
+    for (;;) {
+        memset(&dqb, 0, sizeof(dqb));
+        if (local_quotactl(Q_GETNEXTQUOTA, lm, id, &dqb) < 0) {
+            if (errno == ENOENT)
+                break;
+            if (id == 0 && (errno == EINVAL || errno == ENOSYS
+                                            || errno == EOPNOTSUPP))
+                return -1;
+            local_error(lm);
+            break;
+        }
+        if (!uids || listint_member(uids, dqb.dqb_id)) {
+            x = quota_create(q->q_label, q->q_rhost, q->q_rpath, q->q_thresh);
+            local_fill(x, dqb.dqb_id, &dqb, now);
+            list_append(qlist, x);
+            n++;
+        }
+        if (dqb.dqb_id == UINT32_MAX)
+            break;
+        id = dqb.dqb_id + 1;
+    }
+    return n;
+}
+
+struct quota_backend quota_backend_local = {
+    "local",
+    0,                      /* blocking */
+    local_init,
+    quota_get_local,
+    quota_get_serial,
+    quota_get_all_local,
+    local_fini,
+};
+#endif /* HAVE_LINUX_QUOTA_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
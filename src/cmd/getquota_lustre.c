@@ -28,12 +28,17 @@
 #if HAVE_LIBLUSTREAPI
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/vfs.h>
+#include <stdint.h>
 #include <time.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <lustre/lustreapi.h>
 #ifndef QUOTABLOCK_SIZE
 #define QUOTABLOCK_SIZE (1 << 10)
@@ -42,11 +47,13 @@
 
 #include "src/liblsd/list.h"
 #include "src/libutil/util.h"
+#include "src/libutil/listint.h"
 
 #include "getquota.h"
 #include "getquota_private.h"
 
 extern char *prog;
+extern int debug;
 
 static qstate_t
 set_state(unsigned long long used, unsigned long long soft,
@@ -69,85 +76,482 @@ set_state(unsigned long long used, unsigned long long soft,
     return state;
 }
 
-int llapi_quotactl(char *mnt, struct if_quotactl *qctl)
+/* liblustreapi is loaded at run time so that the binaries work on
+ * nodes without it.  It's needed only if the ioctl isn't known at
+ * compile time.
+ */
+#ifndef LL_IOC_QUOTACTL
+static void *lustre_dso = NULL;
+static int (*lustre_quotactl)(char *mnt, struct if_quotactl *qctl) = NULL;
+static int (*lustre_obd_count)(char *mnt, int *count, int is_mdt) = NULL;
+#endif
+
+/* A Lustre mount point, validated and opened on its first query and
+ * kept for the rest of the run, so that a query is just the quotactl.
+ */
+struct lsess {
+    char   *ls_mnt;
+    int     ls_fd;          /* mount point directory, -1 if not usable */
+};
+
+static List sessions = NULL;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+lsess_destroy(struct lsess *ls)
 {
-    void *dso = NULL;
-    int (*fun)(char *mnt, struct if_quotactl *qctl);
-    int rc = -1;
+    if (ls->ls_fd >= 0)
+        (void)close(ls->ls_fd);
+    free(ls->ls_mnt);
+    free(ls);
+}
 
-    if (!(dso = dlopen("liblustreapi.so", RTLD_LAZY | RTLD_LOCAL))) {
-        errno = EINVAL;
-        goto done;
-    }
-    if (!(fun = dlsym (dso, "llapi_quotactl"))) {
-        errno = EINVAL;
-        goto done;
-    }
-    rc = fun(mnt, qctl);
-done:
-    if (dso)
-        dlclose(dso);
-    return rc;
+static int
+lsess_match(struct lsess *ls, char *mnt)
+{
+    return !strcmp(ls->ls_mnt, mnt);
 }
 
-int
-quota_get_lustre(uid_t uid, quota_t q)
+/* Open mnt and check that it is a Lustre mount.  On failure, say why and
+ * leave ls_fd at -1 so that later queries fail quietly.
+ */
+static struct lsess *
+lsess_create(char *mnt)
 {
-    time_t now = 0;
-    struct if_quotactl qctl;
+    struct lsess *ls = xmalloc(sizeof(struct lsess));
     struct statfs f;
-    int rc;
-
-    assert(q->q_magic == QUOTA_MAGIC);
 
+    ls->ls_mnt = xstrdup(mnt);
     /* additional 'fs not mounted' error hanlding per chaos bz 1100/issue 1 */
-    if (statfs (q->q_rpath, &f) < 0) {
+    if ((ls->ls_fd = open(mnt, O_RDONLY | O_DIRECTORY)) < 0
+                                || fstatfs(ls->ls_fd, &f) < 0) {
         if (errno == ENOENT)
-            fprintf (stderr, "%s: %s is not mounted\n", prog, q->q_rpath);
+            fprintf (stderr, "%s: %s is not mounted\n", prog, mnt);
         else
-            fprintf (stderr, "%s: %s %s\n", prog, q->q_rpath, strerror (errno));
-        return -1;
+            fprintf (stderr, "%s: %s %s\n", prog, mnt, strerror (errno));
+        goto error;
     }
     if (f.f_type != LL_SUPER_MAGIC) {
-        fprintf (stderr, "%s: %s is not mounted\n", prog, q->q_rpath);
+        fprintf (stderr, "%s: %s is not mounted\n", prog, mnt);
+        goto error;
+    }
+    return ls;
+error:
+    if (ls->ls_fd >= 0)
+        (void)close(ls->ls_fd);
+    ls->ls_fd = -1;
+    return ls;
+}
+
+/* Return the session for mnt, or NULL if it isn't a usable Lustre mount.
+ */
+static struct lsess *
+lsess_get(char *mnt)
+{
+    struct lsess *ls;
+
+    pthread_mutex_lock(&session_lock);
+    if (!(ls = list_find_first(sessions, (ListFindF)lsess_match, mnt))) {
+        ls = lsess_create(mnt);
+        list_append(sessions, ls);
+    }
+    pthread_mutex_unlock(&session_lock);
+    return ls->ls_fd >= 0 ? ls : NULL;
+}
+
+static void
+lustre_init(void)
+{
+    sessions = list_create((ListDelF)lsess_destroy);
+#ifndef LL_IOC_QUOTACTL
+    if ((lustre_dso = dlopen("liblustreapi.so", RTLD_LAZY | RTLD_LOCAL))) {
+        lustre_quotactl = dlsym(lustre_dso, "llapi_quotactl");
+        lustre_obd_count = dlsym(lustre_dso, "llapi_get_obd_count");
+    }
+#endif
+}
+
+static void
+lustre_fini(void)
+{
+    list_destroy(sessions);
+    sessions = NULL;
+#ifndef LL_IOC_QUOTACTL
+    if (lustre_dso)
+        dlclose(lustre_dso);
+    lustre_dso = NULL;
+    lustre_quotactl = NULL;
+    lustre_obd_count = NULL;
+#endif
+}
+
+static int
+lsess_quotactl(struct lsess *ls, struct if_quotactl *qctl)
+{
+#ifdef LL_IOC_QUOTACTL
+    return ioctl(ls->ls_fd, LL_IOC_QUOTACTL, qctl);
+#else
+    if (!lustre_quotactl) {
+        errno = EINVAL;
         return -1;
     }
-    if (time(&now) < 0) {
-        fprintf(stderr, "%s: time: %s\n", prog, strerror(errno));
+    return lustre_quotactl(ls->ls_mnt, qctl);
+#endif
+}
+
+/* Get the number of MDTs (is_mdt) or OSTs in ls's file system.
+ */
+static int
+lsess_obd_count(struct lsess *ls, int is_mdt, int *count)
+{
+#if defined(LL_IOC_QUOTACTL) && defined(LL_IOC_GETOBDCOUNT)
+    *count = is_mdt;
+    return ioctl(ls->ls_fd, LL_IOC_GETOBDCOUNT, count);
+#elif !defined(LL_IOC_QUOTACTL)
+    if (!lustre_obd_count) {
+        errno = EINVAL;
         return -1;
     }
+    return lustre_obd_count(ls->ls_mnt, count, is_mdt);
+#else
+    errno = ENOTTY;
+    return -1;
+#endif
+}
+
+static void
+lustre_fill(quota_t q, uid_t uid, struct obd_dqblk *dqb, time_t now)
+{
+    q->q_uid            = uid;
+
+    q->q_bytes_used     = dqb->dqb_curspace;
+    q->q_bytes_softlim  = dqb->dqb_bsoftlimit * QUOTABLOCK_SIZE;
+    q->q_bytes_hardlim  = dqb->dqb_bhardlimit * QUOTABLOCK_SIZE;
+    q->q_bytes_state = set_state(q->q_bytes_used, q->q_bytes_softlim,
+                                 q->q_bytes_hardlim, dqb->dqb_btime, now);
+    if (q->q_bytes_state == STARTED)
+        q->q_bytes_secleft = dqb->dqb_btime - now;
+
+    q->q_files_used     = dqb->dqb_curinodes;
+    q->q_files_softlim  = dqb->dqb_isoftlimit;
+    q->q_files_hardlim  = dqb->dqb_ihardlimit;
+    q->q_files_state = set_state(q->q_files_used, q->q_files_softlim,
+                                 q->q_files_hardlim, dqb->dqb_itime, now);
+    if (q->q_files_state == STARTED)
+        q->q_files_secleft = dqb->dqb_itime - now;
+}
+
+/* One MDT or OST, for lustre_targets().
+ */
+struct ltarget {
+    int                 lt_mdt;
+    int                 lt_idx;
+    int                 lt_errno;   /* 0 = qctl is valid */
+    struct if_quotactl  lt_qctl;
+};
+
+struct ltpool {
+    pthread_mutex_t     tp_lock;
+    struct lsess       *tp_ls;
+    uid_t               tp_uid;
+    struct ltarget     *tp_tv;
+    int                 tp_n;
+    int                 tp_next;
+};
+
+static void *
+target_worker(void *arg)
+{
+    struct ltpool *p = arg;
+    struct ltarget *t;
+    int i;
+
+    pthread_mutex_lock(&p->tp_lock);
+    while ((i = p->tp_next) < p->tp_n) {
+        p->tp_next++;
+        pthread_mutex_unlock(&p->tp_lock);
+        t = &p->tp_tv[i];
+        t->lt_qctl.qc_cmd = LUSTRE_Q_GETQUOTA;
+        t->lt_qctl.qc_id = p->tp_uid;
+        t->lt_qctl.qc_valid = t->lt_mdt ? QC_MDTIDX : QC_OSTIDX;
+        t->lt_qctl.qc_idx = t->lt_idx;
+        if (lsess_quotactl(p->tp_ls, &t->lt_qctl) < 0)
+            t->lt_errno = errno;
+        pthread_mutex_lock(&p->tp_lock);
+    }
+    pthread_mutex_unlock(&p->tp_lock);
+    return NULL;
+}
+
+/* Name a target as lfs does, less the file system name and "_UUID".
+ */
+static void
+target_name(struct ltarget *t, char *name, int len)
+{
+    char *uuid = (char *)t->lt_qctl.obd_uuid.uuid;
+    char *p;
+
+    if (uuid[0] == '\0') {
+        snprintf(name, len, "%s%04x", t->lt_mdt ? "MDT" : "OST", t->lt_idx);
+        return;
+    }
+    if ((p = strrchr(uuid, '-')))
+        uuid = p + 1;
+    snprintf(name, len, "%s", uuid);
+    if ((p = strstr(name, "_UUID")))
+        *p = '\0';
+}
+
+/* Add uid's usage and granted limits on each MDT and OST to q's targets.
+ * The targets are queried concurrently.  A target that fails is reported
+ * and left out.
+ */
+static void
+lustre_targets(struct lsess *ls, uid_t uid, quota_t q, time_t now)
+{
+    struct ltpool p;
+    pthread_t *t;
+    quota_t tq;
+    char name[64];
+    int i, nmdt, nost, depth, nt = 0;
+
+    if (lsess_obd_count(ls, 1, &nmdt) < 0
+                            || lsess_obd_count(ls, 0, &nost) < 0) {
+        fprintf(stderr, "%s: %s: can't count targets: %s\n", prog,
+                ls->ls_mnt, strerror(errno));
+        return;
+    }
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.tp_lock, NULL);
+    p.tp_ls = ls;
+    p.tp_uid = uid;
+    p.tp_n = nmdt + nost;
+    p.tp_tv = xmalloc(sizeof(struct ltarget) * (p.tp_n + 1));
+    memset(p.tp_tv, 0, sizeof(struct ltarget) * (p.tp_n + 1));
+    for (i = 0; i < p.tp_n; i++) {
+        p.tp_tv[i].lt_mdt = i < nmdt;
+        p.tp_tv[i].lt_idx = i < nmdt ? i : i - nmdt;
+    }
+
+    /* the caller's thread is one of the pool */
+    depth = quota_pool_depth(q);
+    t = xmalloc(sizeof(pthread_t) * depth);
+    while (nt < depth - 1 && nt < p.tp_n - 1) {
+        if (pthread_create(&t[nt], NULL, target_worker, &p) != 0)
+            break;
+        nt++;
+    }
+    target_worker(&p);
+    for (i = 0; i < nt; i++)
+        pthread_join(t[i], NULL);
+    pthread_mutex_destroy(&p.tp_lock);
+    free(t);
+
+    for (i = 0; i < p.tp_n; i++) {
+        target_name(&p.tp_tv[i], name, sizeof(name));
+        if (p.tp_tv[i].lt_errno != 0) {
+            fprintf(stderr, "%s: %s: %s: %s\n", prog, ls->ls_mnt, name,
+                    strerror(p.tp_tv[i].lt_errno));
+            continue;
+        }
+        tq = quota_add_target(q, name);
+        lustre_fill(tq, uid, &p.tp_tv[i].lt_qctl.qc_dqblk, now);
+    }
+    free(p.tp_tv);
+}
+
+static int
+lustre_quota(struct lsess *ls, uid_t uid, quota_t q, time_t now)
+{
+    struct if_quotactl qctl;
+    int rc;
+
     memset(&qctl, 0, sizeof(qctl));
     qctl.qc_cmd = LUSTRE_Q_GETQUOTA;
     qctl.qc_id = uid;
-    rc = llapi_quotactl(q->q_rpath, &qctl);
-    if (rc) {
+    if ((rc = lsess_quotactl(ls, &qctl))) {
         fprintf(stderr, "%s: llapi_quotactl %s: %s\n",
-                        prog, q->q_rpath, strerror(errno));
+                        prog, ls->ls_mnt, strerror(errno));
         return rc;
     }
-    if (q) {
-        struct obd_dqblk *dqb = &qctl.qc_dqblk;
+    lustre_fill(q, uid, &qctl.qc_dqblk, now);
+    if (q->q_want_targets)
+        lustre_targets(ls, uid, q, now);
+    return 0;
+}
+
+static int
+quota_get_lustre(uid_t uid, quota_t q)
+{
+    struct lsess *ls;
+
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (!(ls = lsess_get(q->q_rpath)))
+        return -1;
+    return lustre_quota(ls, uid, q, time(NULL));
+}
+
+/* When the caller has to find candidate uids itself (see
+ * quota_get_all_lustre()), each quotactl is a round trip to the quota
+ * master, so several are kept in flight by a pool of threads, as many
+ * as the quota.conf window flag (or --lustre-depth) allows, see
+ * quota_pool_depth().  The same depth applies to the targets of a
+ * single query.
+ */
+struct lpool {
+    pthread_mutex_t lp_lock;
+    uid_t          *lp_uids;
+    quota_t        *lp_qv;
+    int            *lp_rcv;
+    int             lp_n;
+    int             lp_next;        /* next query to start */
+    int             lp_fails;
+    time_t          lp_now;
+    double          lp_deadline;
+    quota_done_f    lp_done;
+    void           *lp_arg;
+};
+
+static void *
+lustre_worker(void *arg)
+{
+    struct lpool *p = arg;
+    struct lsess *ls;
+    quota_t q;
+    int i, rc;
+
+    pthread_mutex_lock(&p->lp_lock);
+    while ((i = p->lp_next) < p->lp_n) {
+        p->lp_next++;
+        pthread_mutex_unlock(&p->lp_lock);
+        q = p->lp_qv[i];
+        assert(q->q_magic == QUOTA_MAGIC);
+        if (p->lp_deadline > 0 && monotime() >= p->lp_deadline) {
+            fprintf(stderr, "%s: %s: timed out\n", prog, q->q_label);
+            rc = -1;
+        } else if ((ls = lsess_get(q->q_rpath)))
+            rc = lustre_quota(ls, p->lp_uids[i], q, p->lp_now);
+        else
+            rc = -1;
+        pthread_mutex_lock(&p->lp_lock);
+        p->lp_rcv[i] = rc;
+        if (rc != 0)
+            p->lp_fails++;
+        if (p->lp_done)
+            p->lp_done(i, p->lp_arg);
+    }
+    pthread_mutex_unlock(&p->lp_lock);
+    return NULL;
+}
 
-        q->q_uid            = uid;
+/* Like quota_get_serial(), but with up to quota_pool_depth() queries in
+ * flight.  Calls to done() are serialized.
+ */
+static int
+quota_get_lustre_many(uid_t *uids, int n, quota_t *qv, int *rcv,
+                      double deadline, quota_done_f done, void *arg)
+{
+    pthread_t *t;
+    struct lpool p;
+    double t0 = monotime();
+    int i, depth, nt = 0;
 
-        q->q_bytes_used     = dqb->dqb_curspace;
-        q->q_bytes_softlim  = dqb->dqb_bsoftlimit * QUOTABLOCK_SIZE;
-        q->q_bytes_hardlim  = dqb->dqb_bhardlimit * QUOTABLOCK_SIZE;
-        q->q_bytes_state = set_state(q->q_bytes_used, q->q_bytes_softlim,
-                                     q->q_bytes_hardlim, dqb->dqb_btime, now);
-        if (q->q_bytes_state == STARTED)
-            q->q_bytes_secleft = dqb->dqb_btime - now;
+    if (n == 0)
+        return 0;
+    depth = quota_pool_depth(qv[0]);
+    t = xmalloc(sizeof(pthread_t) * depth);
 
-        q->q_files_used     = dqb->dqb_curinodes;
-        q->q_files_softlim  = dqb->dqb_isoftlimit;
-        q->q_files_hardlim  = dqb->dqb_ihardlimit;
-        q->q_files_state = set_state(q->q_files_used, q->q_files_softlim,
-                                     q->q_files_hardlim, dqb->dqb_itime, now);
-        if (q->q_files_state == STARTED)
-            q->q_files_secleft = dqb->dqb_itime - now;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.lp_lock, NULL);
+    p.lp_uids = uids;
+    p.lp_qv = qv;
+    p.lp_rcv = rcv;
+    p.lp_n = n;
+    p.lp_now = time(NULL);
+    p.lp_deadline = deadline;
+    p.lp_done = done;
+    p.lp_arg = arg;
+
+    /* the caller's thread is one of the pool */
+    while (nt < depth - 1 && nt < n - 1) {
+        if (pthread_create(&t[nt], NULL, lustre_worker, &p) != 0)
+            break;
+        nt++;
     }
-    return 0;
+    lustre_worker(&p);
+    for (i = 0; i < nt; i++)
+        pthread_join(t[i], NULL);
+    pthread_mutex_destroy(&p.lp_lock);
+    free(t);
+    if (debug)
+        printf("lustre: %d quotas (%d failed) in %.3fs, depth %d\n",
+               n, p.lp_fails, monotime() - t0, nt + 1);
+    return p.lp_fails;
+}
+
+#ifdef LUSTRE_Q_ITERQUOTA
+/* Walk the quota master's records in id order with LUSTRE_Q_ITERQUOTA,
+ * which returns the first id at or after qc_id that has usage or limits,
+ * like Q_GETNEXTQUOTA on local file systems.  Servers that don't support
+ * it fail the first call, and the caller falls back to a scan.
+ */
+static int
+quota_get_all_lustre(quota_t q, listint_t uids, List qlist)
+{
+    struct if_quotactl qctl;
+    struct lsess *ls;
+    time_t now = time(NULL);
+    double t0 = monotime();
+    uint32_t id = 0;
+    quota_t x;
+    int n = 0, calls = 0;
+
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (!(ls = lsess_get(q->q_rpath)))
+        return 0;
+    for (;;) {
+        memset(&qctl, 0, sizeof(qctl));
+        qctl.qc_cmd = LUSTRE_Q_ITERQUOTA;
+        qctl.qc_id = id;
+        calls++;
+        if (lsess_quotactl(ls, &qctl) < 0) {
+            if (errno == ENOENT)
+                break;
+            if (id == 0 && (errno == EINVAL || errno == ENOTTY
+                            || errno == ENOSYS || errno == EOPNOTSUPP))
+                return -1;
+            fprintf(stderr, "%s: llapi_quotactl %s: %s\n",
+                            prog, ls->ls_mnt, strerror(errno));
+            break;
+        }
+        if (!uids || listint_member(uids, qctl.qc_id)) {
+            x = quota_create(q->q_label, q->q_rhost, q->q_rpath, q->q_thresh);
+            lustre_fill(x, qctl.qc_id, &qctl.qc_dqblk, now);
+            list_append(qlist, x);
+            n++;
+        }
+        if (qctl.qc_id == UINT32_MAX)
+            break;
+        id = qctl.qc_id + 1;
+    }
+    if (debug)
+        printf("lustre: %d quota records in %.3fs, %d quotactls\n",
+               n, monotime() - t0, calls);
+    return n;
 }
+#else
+#define quota_get_all_lustre NULL
+#endif
+
+struct quota_backend quota_backend_lustre = {
+    "lustre",
+    1,                      /* blocking */
+    lustre_init,
+    quota_get_lustre,
+    quota_get_lustre_many,
+    quota_get_all_lustre,   /* or NULL, see above */
+    lustre_fini,
+};
 #endif /* HAVE_LIBLUSTREAPI */
 
 /*
@@ -35,14 +35,19 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "src/liblsd/list.h"
 #include "src/libutil/util.h"
 #include "src/librpc/rquota.h"
 
 #include "getquota.h"
 #include "getquota_private.h"
+#include "hostcache.h"
+#include "breaker.h"
 
 #define QUIRK_NETAPP  1 /* (uint32_t)(-1) for any limit == no quota */
 #define QUIRK_DEC     0 /* 2 block block limits == no quota */
@@ -52,6 +57,11 @@ extern int debug;
 
 double quota_nfs_timeout = 2.5;         // default sunrpc 25s
 double quota_nfs_retry_timeout = 0.5;   // default sunrpc 5s
+char *quota_nfs_transport = NULL;       // overrides quota.conf if set
+int quota_nfs_host_window = 0;          // per server, overrides quota.conf
+double quota_nfs_host_qps = 0;          // per server, overrides quota.conf
+
+#define RTO_MIN     0.02    /* floor on the adaptive retransmit timeout */
 
 /* Normalize reply from quirky servers.
  */
@@ -108,141 +118,471 @@ set_state(unsigned long long used, unsigned long long soft,
     return state;
 }
 
+/* Round trip time estimation per RFC 6298, so each server is retransmitted
+ * to on its own schedule.  The caller only samples calls that were never
+ * retransmitted (Karn's algorithm), since a reply to a retransmitted call
+ * can't be matched to a transmission.
+ */
+void
+quota_rtt_sample(struct rtt *r, double sample)
+{
+    double err;
+
+    if (r->r_srtt <= 0) {
+        r->r_srtt = sample;
+        r->r_rttvar = sample / 2;
+    } else {
+        err = sample > r->r_srtt ? sample - r->r_srtt : r->r_srtt - sample;
+        r->r_rttvar = 0.75 * r->r_rttvar + 0.25 * err;
+        r->r_srtt = 0.875 * r->r_srtt + 0.125 * sample;
+    }
+}
+
+/* Return the retransmit timeout for r:  the --nfs-retry-timeout until
+ * there is an estimate, then srtt + 4 * rttvar, never more than
+ * --nfs-retry-timeout.
+ */
+double
+quota_rtt_rto(struct rtt *r)
+{
+    double rto = r->r_srtt + 4 * r->r_rttvar;
+
+    if (r->r_srtt <= 0 || rto > quota_nfs_retry_timeout)
+        return quota_nfs_retry_timeout;
+    if (rto < RTO_MIN)
+        rto = RTO_MIN;
+    return rto;
+}
+
+/* Load the persistent RTT estimate for rhost, if any.
+ */
+void
+quota_rtt_load(char *rhost, char *proto, struct rtt *r)
+{
+    if (hostcache_get_rtt(rhost, proto, &r->r_srtt, &r->r_rttvar) < 0)
+        r->r_srtt = r->r_rttvar = 0;
+    if (debug)
+        printf("rtt: %s/%s: srtt %.6f rttvar %.6f rto %.6f\n", rhost, proto,
+               r->r_srtt, r->r_rttvar, quota_rtt_rto(r));
+}
+
+void
+quota_rtt_save(char *rhost, char *proto, struct rtt *r)
+{
+    if (r->r_srtt > 0)
+        hostcache_set_rtt(rhost, proto, r->r_srtt, r->r_rttvar);
+}
+
 static void tv_double (double t, struct timeval *tv)
 {
         tv->tv_sec = t;
             tv->tv_usec = (t - tv->tv_sec)*1E6;
 }
 
-int
-quota_get_nfs(uid_t uid, quota_t q)
-{
-    static char lhost[MAXHOSTNAMELEN+1] = "";
-    uid_t myuid = geteuid();
-    getquota_args args;
-    getquota_rslt *result;
-    CLIENT *cl = NULL;
-    struct timeval tv;
-    int rc = -1; /* fail */
+/* Cache of RPC client handles, by (rhost, transport).
+ * clnt_create() costs a portmapper round trip and a new socket, so
+ * handles are kept for the life of the process and torn down at exit.
+ * The AUTH_UNIX credential is kept with the handle and only recreated
+ * when the uid being queried changes.  A handle can't carry two calls
+ * at once, so rclnt_get() takes it out of the cache and rclnt_put()
+ * returns it; concurrent queries to one server each get their own.
+ */
+struct rclnt {
+    char   *rc_rhost;
+    char   *rc_proto;
+    uid_t   rc_uid;
+    CLIENT *rc_cl;
+    struct rtt rc_rtt;
+};
 
-    assert(q->q_magic == QUOTA_MAGIC);
-    if (myuid != 0 && myuid != uid) {
-        fprintf(stderr, "%s: only root can query someone else's quota\n", prog);
-        goto done;
-    }
+static List rclnt_cache = NULL;
+static pthread_mutex_t rclnt_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    /* just do this once and cache the result */
-    if (lhost[0] == '\0') {
-        if (gethostname(lhost, sizeof(lhost)) < 0) {
-            fprintf(stderr, "%s: gethostbyname %s\n", prog, strerror(errno));
-            goto done;
-        }
+static void
+rclnt_destroy(struct rclnt *rc)
+{
+    if (rc->rc_cl) {
+        if (rc->rc_cl->cl_auth)
+            auth_destroy(rc->rc_cl->cl_auth);
+        clnt_destroy(rc->rc_cl);
     }
+    free(rc->rc_rhost);
+    free(rc->rc_proto);
+    free(rc);
+}
 
-    cl = clnt_create(q->q_rhost, RQUOTAPROG, RQUOTAVERS, "udp");
-    if (cl == NULL) {
-        fprintf(stderr, "%s: %s\n", prog, clnt_spcreateerror(q->q_rhost));
-        goto done;
+static int
+rclnt_match(struct rclnt *rc, struct rclnt *key)
+{
+    return (!strcmp(rc->rc_rhost, key->rc_rhost)
+         && !strcmp(rc->rc_proto, key->rc_proto));
+}
+
+static void
+rclnt_cache_fini(void)
+{
+    if (rclnt_cache) {
+        list_destroy(rclnt_cache);
+        rclnt_cache = NULL;
     }
+}
 
-    /* Gnat48: authunix_create_default() fails if in >16 groups (Tru64),
-     * so call authunix_create() with empty supplementary group list.
-     */
-    cl->cl_auth = authunix_create(lhost, uid, getgid(), 0, NULL);
-    if (cl->cl_auth == NULL) {
-        fprintf(stderr, "%s: %s\n", prog, clnt_sperror(cl, "authunix"));
-        goto done;
+/* Drop a handle, e.g. after an RPC error left it in doubt.
+ */
+static void
+rclnt_evict(struct rclnt *rc)
+{
+    rclnt_destroy(rc);
+}
+
+/* Return a handle to the cache.
+ */
+static void
+rclnt_put(struct rclnt *rc)
+{
+    pthread_mutex_lock(&rclnt_lock);
+    list_append(rclnt_cache, rc);
+    pthread_mutex_unlock(&rclnt_lock);
+}
+
+/* Create an RPC client handle for rhost and set our timeouts on it.
+ * The server address and port come from the host cache, so a cached
+ * host costs neither a DNS lookup nor a portmapper round trip.
+ */
+static CLIENT *
+rclnt_create(char *rhost, char *proto)
+{
+    CLIENT *cl;
+    struct timeval tv;
+    struct sockaddr_in sin;
+    int sock = RPC_ANYSOCK;
+
+    if (hostcache_lookup(rhost, proto, &sin) < 0)
+        return NULL;
+    if (!strcmp(proto, "tcp")) {
+        cl = clnttcp_create(&sin, RQUOTAPROG, RQUOTAVERS, &sock, 0, 0);
+    } else {
+        tv_double (quota_nfs_retry_timeout, &tv);
+        cl = clntudp_create(&sin, RQUOTAPROG, RQUOTAVERS, tv, &sock);
     }
+    if (cl == NULL) {
+        hostcache_invalidate(rhost, proto);
+        fprintf(stderr, "%s: %s\n", prog, clnt_spcreateerror(rhost));
+        return NULL;
+    }
+    cl->cl_auth = NULL;
 
     /* github issue #7 - alter default RPC timeouts
      * of 5s retry timeout, 25s total timeout
+     * (TCP handles don't retransmit, so only the total applies)
      */
     tv_double (quota_nfs_retry_timeout, &tv);
-    if (!clnt_control (cl, CLSET_RETRY_TIMEOUT, (char *)&tv)) {
+    if (strcmp(proto, "tcp") != 0
+                && !clnt_control (cl, CLSET_RETRY_TIMEOUT, (char *)&tv)) {
         fprintf(stderr, "%s: clnt_control CLSET_RETRY_TIMEOUT\n", prog);
-        goto done;
+        goto error;
     }
     tv_double (quota_nfs_timeout, &tv);
     if (!clnt_control (cl, CLSET_TIMEOUT, (char *)&tv)) {
         fprintf(stderr, "%s: clnt_control CLSET_TIMEOUT\n", prog);
-        goto done;
+        goto error;
     }
+    return cl;
+error:
+    clnt_destroy(cl);
+    return NULL;
+}
 
-    args.gqa_pathp  = q->q_rpath;
-    args.gqa_uid    = uid;
-    result = rquotaproc_getquota_1(&args, cl);
+/* Take (or create) a client handle for rhost from the cache, with an
+ * AUTH_UNIX credential for uid attached.  Give it back with rclnt_put().
+ */
+static struct rclnt *
+rclnt_get(char *rhost, char *proto, char *lhost, uid_t uid)
+{
+    struct rclnt key, *rc = NULL;
+    ListIterator itr;
+
+    pthread_mutex_lock(&rclnt_lock);
+    if (!rclnt_cache)
+        rclnt_cache = list_create((ListDelF)rclnt_destroy);
+    key.rc_rhost = rhost;
+    key.rc_proto = proto;
+    itr = list_iterator_create(rclnt_cache);
+    if (list_find(itr, (ListFindF)rclnt_match, &key))
+        rc = list_remove(itr);
+    list_iterator_destroy(itr);
+    pthread_mutex_unlock(&rclnt_lock);
+    if (!rc) {
+        CLIENT *cl = rclnt_create(rhost, proto);
+
+        if (!cl)
+            return NULL;
+        rc = xmalloc(sizeof(struct rclnt));
+        rc->rc_rhost = xstrdup(rhost);
+        rc->rc_proto = xstrdup(proto);
+        rc->rc_cl = cl;
+        quota_rtt_load(rhost, proto, &rc->rc_rtt);
+    }
+    if (rc->rc_cl->cl_auth && rc->rc_uid != uid) {
+        auth_destroy(rc->rc_cl->cl_auth);
+        rc->rc_cl->cl_auth = NULL;
+    }
+    if (!rc->rc_cl->cl_auth) {
+        /* Gnat48: authunix_create_default() fails if in >16 groups (Tru64),
+         * so call authunix_create() with empty supplementary group list.
+         */
+        rc->rc_cl->cl_auth = authunix_create(lhost, uid, getgid(), 0, NULL);
+        if (rc->rc_cl->cl_auth == NULL) {
+            fprintf(stderr, "%s: %s\n", prog,
+                    clnt_sperror(rc->rc_cl, "authunix"));
+            rclnt_evict(rc);
+            return NULL;
+        }
+        rc->rc_uid = uid;
+    }
+    return rc;
+}
 
-    if (result == NULL) {
-        fprintf(stderr, "%s: %s\n", prog, clnt_sperror(cl, q->q_rhost));
-        goto done;
+static char lhost[MAXHOSTNAMELEN+1] = "";
+static int lhost_errno = 0;
+static pthread_once_t lhost_once = PTHREAD_ONCE_INIT;
+
+static void
+lhost_init(void)
+{
+    if (gethostname(lhost, sizeof(lhost)) < 0)
+        lhost_errno = errno;
+}
+
+/* Return the local hostname for AUTH_UNIX credentials, or NULL on error.
+ */
+char *
+quota_nfs_lhost(void)
+{
+    /* just do this once and cache the result */
+    pthread_once(&lhost_once, lhost_init);
+    if (lhost_errno != 0) {
+        fprintf(stderr, "%s: gethostbyname %s\n", prog,
+                strerror(lhost_errno));
+        return NULL;
     }
-    if (result->gqr_status == Q_NOQUOTA) {
+    return lhost;
+}
+
+/* Return the transport ("udp" or "tcp") to use for q:  the command line
+ * setting if any, else the quota.conf flag, else UDP.
+ */
+char *
+quota_nfs_proto(quota_t q)
+{
+    if (quota_nfs_transport)
+        return quota_nfs_transport;
+    if (q->q_proto)
+        return q->q_proto;
+    return "udp";
+}
+
+/* Return the most calls to have in flight at once to q's server, and
+ * the most to start per second (0 = no limit), likewise.
+ */
+int
+quota_nfs_limit(quota_t q)
+{
+    if (quota_nfs_host_window > 0)
+        return quota_nfs_host_window;
+    if (q->q_window > 0)
+        return q->q_window;
+    return QUOTA_NFS_HOST_WINDOW;
+}
+
+double
+quota_nfs_qps(quota_t q)
+{
+    if (quota_nfs_host_qps > 0)
+        return quota_nfs_host_qps;
+    return q->q_qps;
+}
+
+/* Check that the caller may query uid's quota.
+ */
+int
+quota_nfs_permitted(uid_t uid)
+{
+    uid_t myuid = geteuid();
+
+    if (myuid != 0 && myuid != uid) {
+        fprintf(stderr, "%s: only root can query someone else's quota\n", prog);
+        return 0;
+    }
+    return 1;
+}
+
+/* Check the gqr_status of a GETQUOTA result for q.  Returns 0 if it
+ * is Q_OK, or -1 (with a message on stderr) if the server returned an error.
+ */
+int
+quota_nfs_status(quota_t q, int status)
+{
+    if (status == Q_NOQUOTA) {
         fprintf(stderr, "%s: rquota %s:%s: no quota\n", prog,
                 q->q_rhost, q->q_rpath);
-        goto done;
+        return -1;
     }
-    if (result->gqr_status == Q_EPERM) {
+    if (status == Q_EPERM) {
         fprintf(stderr, "%s: rquota %s:%s: permission denied\n",
                 prog, q->q_rhost, q->q_rpath);
-        goto done;
+        return -1;
     }
-    if (result->gqr_status != Q_OK) {
+    if (status != Q_OK) {
         fprintf(stderr, "%s: rquota %s:%s: unknown error: %d\n",
-                prog, q->q_rhost, q->q_rpath, result->gqr_status);
-        goto done;
-    }
-    rc = 0;
-
-    if (q) {
-        struct rquota *rq = &result->getquota_rslt_u.gqr_rquota;
-
-        if (debug) {
-            printf("%s:%s: rq_bsize=%llu rq_curblocks=%llu rq_bsoftlimit=%llu "
-                   "rq_bhardlimit=%llu rq_btimeleft=%llu rq_curfiles=%llu "
-                   "rq_fsoftlimit=%llu rq_fhardlimit=%llu rq_ftimeleft=%llu\n",
-                   q->q_rhost, q->q_rpath,
-                   (unsigned long long)rq->rq_bsize,
-                   (unsigned long long)rq->rq_curblocks,
-                   (unsigned long long)rq->rq_bsoftlimit,
-                   (unsigned long long)rq->rq_bhardlimit,
-                   (unsigned long long)rq->rq_btimeleft,
-                   (unsigned long long)rq->rq_curfiles,
-                   (unsigned long long)rq->rq_fsoftlimit,
-                   (unsigned long long)rq->rq_fhardlimit,
-                   (unsigned long long)rq->rq_ftimeleft
-            );
-        }
+                prog, q->q_rhost, q->q_rpath, status);
+        return -1;
+    }
+    return 0;
+}
 
-        workaround_quirks(rq);
+/* Convert the rquota for uid from a Q_OK GETQUOTA result into q.
+ */
+void
+quota_nfs_fill(uid_t uid, quota_t q, struct rquota *rq)
+{
+    if (debug) {
+        printf("%s:%s: rq_bsize=%llu rq_curblocks=%llu rq_bsoftlimit=%llu "
+               "rq_bhardlimit=%llu rq_btimeleft=%llu rq_curfiles=%llu "
+               "rq_fsoftlimit=%llu rq_fhardlimit=%llu rq_ftimeleft=%llu\n",
+               q->q_rhost, q->q_rpath,
+               (unsigned long long)rq->rq_bsize,
+               (unsigned long long)rq->rq_curblocks,
+               (unsigned long long)rq->rq_bsoftlimit,
+               (unsigned long long)rq->rq_bhardlimit,
+               (unsigned long long)rq->rq_btimeleft,
+               (unsigned long long)rq->rq_curfiles,
+               (unsigned long long)rq->rq_fsoftlimit,
+               (unsigned long long)rq->rq_fhardlimit,
+               (unsigned long long)rq->rq_ftimeleft
+        );
+    }
 
-        q->q_uid = uid;
+    workaround_quirks(rq);
+
+    q->q_uid = uid;
+
+    q->q_bytes_used = (unsigned long long)rq->rq_curblocks*rq->rq_bsize;
+    q->q_bytes_softlim = (unsigned long long)rq->rq_bsoftlimit*rq->rq_bsize;
+    q->q_bytes_hardlim = (unsigned long long)rq->rq_bhardlimit*rq->rq_bsize;
+    q->q_bytes_state = set_state(q->q_bytes_used, q->q_bytes_softlim,
+                                 q->q_bytes_hardlim, rq->rq_btimeleft);
+    if (q->q_bytes_state == STARTED)
+        q->q_bytes_secleft  = rq->rq_btimeleft;
+
+    q->q_files_used     = rq->rq_curfiles;
+    q->q_files_softlim  = rq->rq_fsoftlimit;
+    q->q_files_hardlim  = rq->rq_fhardlimit;
+    q->q_files_state = set_state(q->q_files_used, q->q_files_softlim,
+                                 q->q_files_hardlim, rq->rq_ftimeleft);
+    if (q->q_files_state == STARTED)
+        q->q_files_secleft  = rq->rq_ftimeleft;
+}
+
+/* Query one server, rhost, for the result.  Returns 0 on success,
+ * -1 on failure.
+ */
+static int
+get_nfs_host(uid_t uid, quota_t q, char *rhost, char *lhost,
+             getquota_rslt *result)
+{
+    getquota_args args;
+    enum clnt_stat stat;
+    struct rclnt *rcl;
+    struct breaker *brk;
+    struct timeval tv;
+    double rto = 0, t0;     /* t0 is the call start, then its duration */
 
-        q->q_bytes_used = (unsigned long long)rq->rq_curblocks*rq->rq_bsize;
-        q->q_bytes_softlim = (unsigned long long)rq->rq_bsoftlimit*rq->rq_bsize;
-        q->q_bytes_hardlim = (unsigned long long)rq->rq_bhardlimit*rq->rq_bsize;
-        q->q_bytes_state = set_state(q->q_bytes_used, q->q_bytes_softlim,
-                                     q->q_bytes_hardlim, rq->rq_btimeleft);
-        if (q->q_bytes_state == STARTED)
-            q->q_bytes_secleft  = rq->rq_btimeleft;
+    brk = breaker_get(rhost);
+    if (!breaker_allow(brk, monotime())) {
+        fprintf(stderr, "%s: %s: not responding, skipped\n", prog, rhost);
+        return -1;
+    }
+    if (!(rcl = rclnt_get(rhost, quota_nfs_proto(q), lhost, uid)))
+        return -1;
 
-        q->q_files_used     = rq->rq_curfiles;
-        q->q_files_softlim  = rq->rq_fsoftlimit;
-        q->q_files_hardlim  = rq->rq_fhardlimit;
-        q->q_files_state = set_state(q->q_files_used, q->q_files_softlim,
-                                     q->q_files_hardlim, rq->rq_ftimeleft);
-        if (q->q_files_state == STARTED)
-            q->q_files_secleft  = rq->rq_ftimeleft;
+    /* Retransmit on the host's own schedule.  A reply that comes back
+     * within the first timeout can't have been retransmitted, so it's a
+     * valid RTT sample.
+     */
+    if (strcmp(rcl->rc_proto, "udp") == 0) {
+        rto = quota_rtt_rto(&rcl->rc_rtt);
+        tv_double (rto, &tv);
+        (void)clnt_control (rcl->rc_cl, CLSET_RETRY_TIMEOUT, (char *)&tv);
+    }
+    args.gqa_pathp  = q->q_rpath;
+    args.gqa_uid    = uid;
+    memset(result, 0, sizeof(*result));
+    t0 = monotime();
+    stat = rquotaproc_getquota_1(&args, result, rcl->rc_cl);
+    t0 = monotime() - t0;
+    if (stat == RPC_SUCCESS && t0 < rto) {
+        quota_rtt_sample(&rcl->rc_rtt, t0);
+        quota_rtt_save(rcl->rc_rhost, rcl->rc_proto, &rcl->rc_rtt);
     }
 
-done:
-    if (cl != NULL) {
-        if (cl->cl_auth != NULL)
-            auth_destroy(cl->cl_auth);
-        clnt_destroy(cl);
+    if (stat != RPC_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", prog, clnt_sperror(rcl->rc_cl, rhost));
+        if (stat == RPC_TIMEDOUT)
+            breaker_timeout(brk, monotime());
+        else
+            breaker_ok(brk);    /* something answered */
+        hostcache_invalidate(rcl->rc_rhost, rcl->rc_proto);
+        rclnt_evict(rcl);
+        return -1;
     }
-    return rc;
+    breaker_ok(brk);
+    rclnt_put(rcl);
+    return 0;
 }
 
+/* Get uid's quota from q's server, or if it lists several, from the
+ * first of them that answers.
+ */
+int
+quota_get_nfs(uid_t uid, quota_t q)
+{
+    getquota_rslt result;
+    char *hosts, *host, *save;
+    char *lhost;
+    int rc = -1;
+
+    assert(q->q_magic == QUOTA_MAGIC);
+    if (!quota_nfs_permitted(uid))
+        return -1;
+    if (!(lhost = quota_nfs_lhost()))
+        return -1;
+    hosts = xstrdup(q->q_rhost);
+    for (host = strtok_r(hosts, ",", &save); host && rc < 0;
+                                    host = strtok_r(NULL, ",", &save))
+        rc = get_nfs_host(uid, q, host, lhost, &result);
+    free(hosts);
+    if (rc < 0)
+        return -1;
+    if (quota_nfs_status(q, result.gqr_status) < 0)
+        return -1;
+    quota_nfs_fill(uid, q, &result.getquota_rslt_u.gqr_rquota);
+    return 0;
+}
+
+/* Any rhost that doesn't name another backend is an NFS server (or a
+ * comma separated list of replicas).
+ */
+struct quota_backend quota_backend_nfs = {
+    NULL,                   /* name */
+    0,                      /* blocking */
+    NULL,                   /* init */
+    quota_get_nfs,
+    quota_get_nfs_many,
+    NULL,                   /* get_all */
+    rclnt_cache_fini,
+};
+
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
  */
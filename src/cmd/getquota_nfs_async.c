@@ -0,0 +1,1191 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Pipelined rquota client for querying many uids at once.
+ *
+ * quota_get_nfs() waits a full round trip per uid, so a report over a
+ * large password file is bounded by 1/RTT.  Here up to quota_nfs_window
+ * GETQUOTA calls are kept in flight on a single non-blocking UDP socket.
+ * Each call gets an XID that encodes its slot in the window, replies are
+ * matched back to their slot by XID, and retransmission is done here.
+ * Each server's first retransmit timeout comes from its measured round
+ * trip time (see quota_rtt_sample()), capped at quota_nfs_retry_timeout,
+ * and doubles on each retransmission of a call, giving up after
+ * quota_nfs_timeout.  Calls and replies are moved in batches
+ * with sendmmsg()/recvmmsg() where available, and encoded and decoded in
+ * place by the codec in getquota_codec.c.
+ *
+ * The requests may be for any mix of servers, so the same engine serves
+ * both repquota (many uids, one server) and quota (one uid, many servers).
+ * Each server has its own queue of requests, and the window is filled
+ * from the queues round robin, subject to each server's limit on calls
+ * in flight (quota_nfs_limit()) and calls started per second
+ * (quota_nfs_qps()), so no one server is flooded and the others are
+ * kept busy.
+ * An optional deadline bounds the whole batch, and a callback reports
+ * each request as it completes.
+ *
+ * Servers configured for TCP get one connection each for the batch, and
+ * their calls are pipelined on it as RPC records (RFC 5531 record
+ * marking) drawing on the same window of slots.  TCP calls are never
+ * retransmitted; they just time out after quota_nfs_timeout.  If the
+ * connection fails, its calls fail with it and the error is reported once.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sendmmsg, recvmmsg */
+#endif
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <rpc/rpc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "src/libutil/util.h"
+#include "src/librpc/rquota.h"
+
+#include "getquota.h"
+#include "getquota_private.h"
+#include "hostcache.h"
+#include "breaker.h"
+#include "getquota_codec.h"
+
+#define SLOT_BITS   12
+#define MAX_WINDOW  (1 << SLOT_BITS)
+#define SLOT_MASK   (MAX_WINDOW - 1)
+#define MAX_BATCH   64          /* messages per sendmmsg/recvmmsg */
+#define CALL_SIZE   2048        /* >= header + AUTH_UNIX cred + RQ_PATHLEN */
+#define REPLY_SIZE  512
+#define RM_HDR      4           /* record mark size */
+#define RM_LAST     0x80000000  /* record mark: last fragment */
+#define MAX_RECORD  (64*1024)   /* larger replies are garbage */
+#define MAX_REPLICAS 8          /* hosts per rhost list */
+#define HEDGE_SAMPLES 20        /* replies before trusting a server's p95 */
+#define LAT_BUCKETS 128         /* quarter octaves of microseconds */
+
+#if !HAVE_SENDMMSG
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int  msg_len;
+};
+#endif
+
+extern char *prog;
+extern int debug;
+extern double quota_nfs_timeout;
+extern double quota_nfs_retry_timeout;
+
+int quota_nfs_window = 0;       /* max GETQUOTA calls in flight overall,
+                                   0 = the sum of the per-server limits */
+
+/* Latency histogram */
+struct lat {
+    unsigned long l_n;
+    double        l_max;
+    unsigned long l_b[LAT_BUCKETS];
+};
+
+struct dest {
+    char              *d_rhost;
+    char              *d_proto; /* "udp" or "tcp" */
+    int                d_tcp;
+    struct sockaddr_in d_sin;
+    int                d_ok;    /* address was resolved, and (TCP)
+                                   the connection hasn't failed */
+    struct breaker    *d_brk;   /* shared by all transports to rhost */
+    int                d_skipped;   /* requests failed by the breaker */
+    int               *d_queue; /* requests not yet started */
+    int                d_nqueue;
+    int                d_qsize;
+    int                d_qnext;
+    int                d_limit; /* max calls in flight */
+    int                d_inflight;
+    int                d_peak;
+    double             d_qps;   /* max calls started/sec, 0 = no limit */
+    double             d_next_start;
+    double             d_hedge; /* hedge delay, from d_lat */
+    unsigned long      d_hedge_n;   /* d_lat.l_n at d_hedge */
+    struct lat         d_lat;   /* call latencies (first answer) */
+    struct rtt         d_rtt;   /* UDP only */
+    int                d_samples;
+    /* TCP only */
+    int                d_fd;    /* -1 if not connected */
+    int                d_connecting;
+    char              *d_out;   /* record-marked calls not yet written */
+    int                d_outoff;
+    int                d_outlen;
+    int                d_outsize;
+    char              *d_in;    /* reply bytes not yet handled */
+    int                d_inlen;
+    int                d_insize;
+};
+
+/* The servers a request may go to, in order of preference:  the hosts
+ * in its comma separated rhost list, over its transport.
+ */
+struct group {
+    char       *g_rhost;
+    char       *g_proto;
+    int         g_n;
+    int         g_dix[MAX_REPLICAS];
+};
+
+struct slot {
+    int         s_req;          /* request index, or -1 if free */
+    int         s_dix;          /* dest index */
+    int         s_sib;          /* slot of the request's other call, or -1 */
+    int         s_hedge;        /* this is the hedged call */
+    u_int32_t   s_xid;
+    double      s_start;        /* time the request was first sent */
+    double      s_first;        /* time of first transmission */
+    double      s_sent;         /* time of last transmission */
+    double      s_rto;          /* current retransmit timeout */
+    int         s_tries;        /* transmissions so far */
+};
+
+struct engine {
+    int          fd;
+    char        *lhost;
+    gid_t        gid;           /* for AUTH_UNIX credentials */
+    u_int32_t    stamp;
+    uid_t       *uids;
+    quota_t     *qv;
+    int         *rcv;
+    int         *dix;           /* request index -> dest it's queued on */
+    int         *gix;           /* request index -> group index */
+    int         *rep;           /* request index -> dix's place in group */
+    char        *hedged;        /* request has been hedged (or won't be) */
+    struct dest *dests;
+    int          ndests;
+    int          dsize;
+    struct group *groups;
+    int          ngroups;
+    int          gsize;
+    int          rr;            /* next dest to start a call to */
+    int          pending;       /* requests not yet started */
+    struct pollfd *pfds;        /* UDP socket, then TCP connections */
+    int         *pdix;          /* pfds index -> dest index */
+    struct slot *slots;
+    int          nslots;
+    int         *freeslots;     /* stack of free slot indices */
+    int          nfree;
+    u_int32_t    xid_base;
+    u_int32_t    seq;
+    int          inflight;
+    int          done;
+    quota_done_f donefun;
+    void        *donearg;
+    unsigned long calls;
+    unsigned long retrans;
+    unsigned long conns;
+    unsigned long hedges;
+    unsigned long hedge_wins;
+    struct lat   lat;           /* request latencies */
+
+    /* pending transmit batch */
+    struct mmsghdr   smsg[MAX_BATCH];
+    struct iovec     siov[MAX_BATCH];
+    char             sbuf[MAX_BATCH][CALL_SIZE];
+    int              nsend;
+
+    /* receive batch */
+    struct mmsghdr     rmsg[MAX_BATCH];
+    struct iovec       riov[MAX_BATCH];
+    struct sockaddr_in rfrom[MAX_BATCH];
+    char               rbuf[MAX_BATCH][REPLY_SIZE];
+};
+
+static void
+finish(struct engine *e, int i, int rc)
+{
+    e->rcv[i] = rc;
+    e->done++;
+    if (e->donefun)
+        e->donefun(i, e->donearg);
+}
+
+/* Record a latency of t seconds.  Buckets are a quarter octave wide,
+ * so quantiles are good to about 20%.
+ */
+static void
+lat_add(struct lat *l, double t)
+{
+    unsigned long us = t > 0 ? (unsigned long)(t * 1e6) : 0;
+    int k = 0, b;
+
+    while (us >> (k + 1))
+        k++;
+    b = k < 2 ? (int)us : k * 4 + (int)((us >> (k - 2)) & 3);
+    if (b >= LAT_BUCKETS)
+        b = LAT_BUCKETS - 1;
+    l->l_b[b]++;
+    l->l_n++;
+    if (t > l->l_max)
+        l->l_max = t;
+}
+
+/* Return (an upper bound on) the p quantile of the latencies in l.
+ */
+static double
+lat_quantile(struct lat *l, double p)
+{
+    unsigned long sum = 0;
+    double t = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        if ((sum += l->l_b[b]) >= p * l->l_n && sum > 0) {
+            t = b < 4 ? b + 1 : (double)(4 + b % 4 + 1) * (1UL << (b / 4 - 2));
+            t /= 1e6;
+            break;
+        }
+    }
+    return t < l->l_max ? t : l->l_max;
+}
+
+static void
+lat_print(char *what, char *proto, struct lat *l)
+{
+    printf("latency: %s%s%s: %lu, p50 %.6f p95 %.6f p99 %.6f max %.6f\n",
+           what, proto ? "/" : "", proto ? proto : "", l->l_n,
+           lat_quantile(l, 0.50), lat_quantile(l, 0.95),
+           lat_quantile(l, 0.99), l->l_max);
+}
+
+static void
+slot_free(struct engine *e, struct slot *s)
+{
+    e->dests[s->s_dix].d_inflight--;
+    if (s->s_sib >= 0)
+        e->slots[s->s_sib].s_sib = -1;
+    s->s_req = -1;
+    s->s_sib = -1;
+    e->freeslots[e->nfree++] = s - e->slots;
+    e->inflight--;
+}
+
+/* Give up on call s.  Its request fails, unless its other call is still
+ * in flight.  Returns 1 if the request failed.
+ */
+static int
+drop_call(struct engine *e, struct slot *s)
+{
+    int i = s->s_req, alone = (s->s_sib < 0);
+
+    slot_free(e, s);
+    if (alone)
+        finish(e, i, -1);
+    return alone;
+}
+
+static void
+flush_batch(struct engine *e)
+{
+    int sent = 0, n;
+
+    while (sent < e->nsend) {
+#if HAVE_SENDMMSG
+        n = sendmmsg(e->fd, &e->smsg[sent], e->nsend - sent, 0);
+#else
+        n = sendmsg(e->fd, &e->smsg[sent].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* EAGAIN/ENOBUFS etc: unsent calls go out on retransmit */
+            if (debug)
+                printf("nfs: send: %s\n", strerror(errno));
+            break;
+        }
+        sent += n;
+    }
+    e->nsend = 0;
+}
+
+/* Make room for len more bytes of output on d.
+ */
+static void
+tcp_reserve(struct dest *d, int len)
+{
+    if (d->d_outoff == d->d_outlen)
+        d->d_outoff = d->d_outlen = 0;
+    if (d->d_outsize - d->d_outlen >= len)
+        return;
+    if (d->d_outoff > 0) {
+        memmove(d->d_out, d->d_out + d->d_outoff, d->d_outlen - d->d_outoff);
+        d->d_outlen -= d->d_outoff;
+        d->d_outoff = 0;
+    }
+    if (d->d_outsize - d->d_outlen < len) {
+        d->d_outsize = (d->d_outlen + len) * 2;
+        d->d_out = xrealloc(d->d_out, d->d_outsize);
+    }
+}
+
+/* Queue a (re)transmission of slot s.
+ */
+static void
+queue_call(struct engine *e, struct slot *s)
+{
+    int i = s->s_req;
+    quota_t q = e->qv[i];
+    struct dest *d = &e->dests[s->s_dix];
+    u_int32_t mark;
+    char *buf;
+    int len;
+
+    if (d->d_tcp) {
+        tcp_reserve(d, RM_HDR + CALL_SIZE);
+        buf = d->d_out + d->d_outlen + RM_HDR;
+    } else {
+        if (e->nsend == MAX_BATCH)
+            flush_batch(e);
+        buf = e->sbuf[e->nsend];
+    }
+    len = gq_encode_call(buf, CALL_SIZE, s->s_xid, e->stamp, e->lhost,
+                         e->uids[i], e->gid, q->q_rpath);
+    if (len < 0) {
+        fprintf(stderr, "%s: %s: RPC: Can't encode arguments\n",
+                prog, d->d_rhost);
+        drop_call(e, s);
+        return;
+    }
+    s->s_sent = monotime();
+    s->s_tries++;
+    if (d->d_tcp) {
+        mark = htonl(RM_LAST | len);
+        memcpy(d->d_out + d->d_outlen, &mark, RM_HDR);
+        d->d_outlen += RM_HDR + len;
+        return;
+    }
+    e->siov[e->nsend].iov_base = e->sbuf[e->nsend];
+    e->siov[e->nsend].iov_len = len;
+    memset(&e->smsg[e->nsend], 0, sizeof(e->smsg[0]));
+    e->smsg[e->nsend].msg_hdr.msg_name = &d->d_sin;
+    e->smsg[e->nsend].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    e->smsg[e->nsend].msg_hdr.msg_iov = &e->siov[e->nsend];
+    e->smsg[e->nsend].msg_hdr.msg_iovlen = 1;
+    e->nsend++;
+}
+
+/* Start a call for request i to dest dix in a free slot.  If sib is
+ * non-NULL, the call is a hedge for the request's call in sib.
+ */
+static void
+start_call(struct engine *e, int i, int dix, struct slot *sib)
+{
+    struct slot *s = &e->slots[e->freeslots[--e->nfree]];
+    struct dest *d = &e->dests[dix];
+
+    if (++d->d_inflight > d->d_peak)
+        d->d_peak = d->d_inflight;
+    s->s_req = i;
+    s->s_dix = dix;
+    s->s_sib = -1;
+    s->s_hedge = 0;
+    s->s_first = s->s_start = monotime();
+    if (sib) {
+        s->s_sib = sib - e->slots;
+        sib->s_sib = s - e->slots;
+        s->s_hedge = 1;
+        s->s_start = sib->s_start;
+    }
+    s->s_xid = e->xid_base + ((e->seq++ << SLOT_BITS) | (s - e->slots));
+    e->inflight++;
+    e->calls++;
+    s->s_rto = quota_rtt_rto(&d->d_rtt);
+    s->s_tries = 0;
+    queue_call(e, s);
+}
+
+/* Handle a reply that arrived on TCP connection via, or if via is NULL,
+ * on the UDP socket from address from.
+ */
+static void
+handle_reply(struct engine *e, char *buf, int len, struct sockaddr_in *from,
+             struct dest *via)
+{
+    u_int32_t xid;
+    enum clnt_stat stat;
+    struct slot *s;
+    struct dest *d;
+    quota_t q;
+    double now;
+    int i, status;
+
+    if (gq_reply_xid(buf, len, &xid) < 0)
+        return;
+    s = &e->slots[(xid - e->xid_base) & SLOT_MASK];
+    if (s->s_req < 0 || s->s_xid != xid)
+        return; /* stale reply to a call we've finished with */
+    i = s->s_req;
+    d = &e->dests[s->s_dix];
+    if (via ? d != via
+            : (d->d_tcp || from->sin_addr.s_addr != d->d_sin.sin_addr.s_addr
+                        || from->sin_port != d->d_sin.sin_port))
+        return;
+    q = e->qv[i];
+    stat = gq_decode_reply(buf, len, e->uids[i], q, &status);
+    if (stat == RPC_CANTDECODERES)
+        return;
+    now = monotime();
+    breaker_ok(d->d_brk);
+    if (!d->d_tcp && s->s_tries == 1) {
+        quota_rtt_sample(&d->d_rtt, now - s->s_sent);
+        d->d_samples++;
+    }
+    lat_add(&d->d_lat, now - s->s_first);
+    lat_add(&e->lat, now - s->s_start);
+    if (s->s_hedge)
+        e->hedge_wins++;
+    if (s->s_sib >= 0)
+        slot_free(e, &e->slots[s->s_sib]);
+    slot_free(e, s);
+    if (stat != RPC_SUCCESS) {
+        fprintf(stderr, "%s: %s: %s\n", prog, d->d_rhost, clnt_sperrno(stat));
+        finish(e, i, -1);
+        return;
+    }
+    finish(e, i, quota_nfs_status(q, status));
+}
+
+static void
+recv_replies(struct engine *e)
+{
+    int n, j;
+
+    for (;;) {
+        for (j = 0; j < MAX_BATCH; j++) {
+            e->riov[j].iov_base = e->rbuf[j];
+            e->riov[j].iov_len = REPLY_SIZE;
+            memset(&e->rmsg[j], 0, sizeof(e->rmsg[0]));
+            e->rmsg[j].msg_hdr.msg_name = &e->rfrom[j];
+            e->rmsg[j].msg_hdr.msg_namelen = sizeof(e->rfrom[j]);
+            e->rmsg[j].msg_hdr.msg_iov = &e->riov[j];
+            e->rmsg[j].msg_hdr.msg_iovlen = 1;
+        }
+#if HAVE_RECVMMSG
+        n = recvmmsg(e->fd, e->rmsg, MAX_BATCH, MSG_DONTWAIT, NULL);
+#else
+        n = recvmsg(e->fd, &e->rmsg[0].msg_hdr, MSG_DONTWAIT);
+        if (n >= 0) {
+            e->rmsg[0].msg_len = n;
+            n = 1;
+        }
+#endif
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break; /* EAGAIN, or ICMP error reported via the socket */
+        }
+        for (j = 0; j < n; j++)
+            handle_reply(e, e->rbuf[j], e->rmsg[j].msg_len, &e->rfrom[j],
+                         NULL);
+        if (n < MAX_BATCH)
+            break;
+    }
+}
+
+/* Give up on d's connection:  report the error once, and fail the calls
+ * in flight on it.  Calls not yet started fail as they come up.
+ */
+static void
+tcp_fail(struct engine *e, struct dest *d, enum clnt_stat stat, int err)
+{
+    struct slot *s;
+
+    fprintf(stderr, "%s: %s: %s; errno = %s\n", prog, d->d_rhost,
+            clnt_sperrno(stat), strerror(err));
+    hostcache_invalidate(d->d_rhost, d->d_proto);
+    if (d->d_fd >= 0)
+        close(d->d_fd);
+    d->d_fd = -1;
+    d->d_ok = 0;
+    d->d_connecting = 0;
+    d->d_outoff = d->d_outlen = d->d_inlen = 0;
+    for (s = &e->slots[0]; s < &e->slots[e->nslots]; s++) {
+        if (s->s_req < 0 || &e->dests[s->s_dix] != d)
+            continue;
+        drop_call(e, s);
+    }
+}
+
+static int
+tcp_connect(struct engine *e, struct dest *d)
+{
+    int one = 1;
+
+    if ((d->d_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        tcp_fail(e, d, RPC_SYSTEMERROR, errno);
+        return -1;
+    }
+    (void)fcntl(d->d_fd, F_SETFL, fcntl(d->d_fd, F_GETFL) | O_NONBLOCK);
+    (void)setsockopt(d->d_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    e->conns++;
+    if (connect(d->d_fd, (struct sockaddr *)&d->d_sin,
+                sizeof(d->d_sin)) < 0) {
+        if (errno != EINPROGRESS) {
+            tcp_fail(e, d, RPC_SYSTEMERROR, errno);
+            return -1;
+        }
+        d->d_connecting = 1;
+    }
+    return 0;
+}
+
+/* Write as much of d's pending output as the connection will take,
+ * connecting first if need be.
+ */
+static void
+tcp_flush(struct engine *e, struct dest *d)
+{
+    int n;
+
+    if (d->d_fd < 0 && tcp_connect(e, d) < 0)
+        return;
+    while (!d->d_connecting && d->d_outoff < d->d_outlen) {
+        n = send(d->d_fd, d->d_out + d->d_outoff, d->d_outlen - d->d_outoff,
+                 MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                tcp_fail(e, d, RPC_CANTSEND, errno);
+            break;
+        }
+        d->d_outoff += n;
+    }
+}
+
+/* Handle each complete record in d's input buffer.  Fragments of a record
+ * are gathered in place before decoding.  Returns -1 if the connection
+ * had to be failed.
+ */
+static int
+tcp_records(struct engine *e, struct dest *d)
+{
+    u_int32_t mark;
+    int base = 0, end, len, src, dst, flen;
+
+    for (;;) {
+        /* find the end of the record starting at base */
+        end = base;
+        len = 0;
+        do {
+            if (end + RM_HDR > d->d_inlen)
+                goto partial;
+            memcpy(&mark, d->d_in + end, RM_HDR);
+            mark = ntohl(mark);
+            flen = mark & ~RM_LAST;
+            if ((len += flen) > MAX_RECORD) {
+                tcp_fail(e, d, RPC_CANTDECODERES, EMSGSIZE);
+                return -1;
+            }
+            end += RM_HDR + flen;
+            if (end > d->d_inlen)
+                goto partial;
+        } while (!(mark & RM_LAST));
+
+        for (src = dst = base; src < end; src += RM_HDR + flen) {
+            memcpy(&mark, d->d_in + src, RM_HDR);
+            flen = ntohl(mark) & ~RM_LAST;
+            memmove(d->d_in + dst, d->d_in + src + RM_HDR, flen);
+            dst += flen;
+        }
+        handle_reply(e, d->d_in + base, len, NULL, d);
+        base = end;
+    }
+partial:
+    memmove(d->d_in, d->d_in + base, d->d_inlen - base);
+    d->d_inlen -= base;
+    return 0;
+}
+
+static void
+tcp_recv(struct engine *e, struct dest *d)
+{
+    int n;
+
+    for (;;) {
+        if (d->d_insize - d->d_inlen < REPLY_SIZE) {
+            d->d_insize = d->d_insize * 2 + MAX_BATCH * REPLY_SIZE;
+            d->d_in = xrealloc(d->d_in, d->d_insize);
+        }
+        n = recv(d->d_fd, d->d_in + d->d_inlen, d->d_insize - d->d_inlen,
+                 MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                tcp_fail(e, d, RPC_CANTRECV, errno);
+            return;
+        }
+        if (n == 0) {
+            tcp_fail(e, d, RPC_CANTRECV, ECONNRESET);
+            return;
+        }
+        d->d_inlen += n;
+        if (tcp_records(e, d) < 0)
+            return;
+    }
+}
+
+/* Handle poll events on d's connection.
+ */
+static void
+tcp_event(struct engine *e, struct dest *d, short revents)
+{
+    socklen_t len;
+    int err;
+
+    if (d->d_connecting) {
+        len = sizeof(err);
+        if (getsockopt(d->d_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err != 0) {
+            tcp_fail(e, d, RPC_SYSTEMERROR, err);
+            return;
+        }
+        d->d_connecting = 0;
+    }
+    if ((revents & (POLLIN | POLLHUP | POLLERR)))
+        tcp_recv(e, d);
+    if (d->d_fd >= 0)
+        tcp_flush(e, d);
+}
+
+/* Send everything queued, on UDP and TCP.
+ */
+static void
+flush_all(struct engine *e)
+{
+    struct dest *d;
+
+    flush_batch(e);
+    for (d = &e->dests[0]; d < &e->dests[e->ndests]; d++)
+        if (d->d_tcp && d->d_ok && d->d_outoff < d->d_outlen)
+            tcp_flush(e, d);
+}
+
+/* Fill in e->pfds for the UDP socket and each open TCP connection,
+ * and return the number of entries.
+ */
+static int
+build_pollset(struct engine *e)
+{
+    struct dest *d;
+    int n = 1;
+
+    e->pfds[0].fd = e->fd;
+    e->pfds[0].events = POLLIN;
+    for (d = &e->dests[0]; d < &e->dests[e->ndests]; d++) {
+        if (!d->d_tcp || d->d_fd < 0)
+            continue;
+        e->pfds[n].fd = d->d_fd;
+        e->pfds[n].events = POLLIN;
+        if (d->d_connecting || d->d_outoff < d->d_outlen)
+            e->pfds[n].events |= POLLOUT;
+        e->pdix[n++] = d - e->dests;
+    }
+    return n;
+}
+
+/* Note a call started to d, for its rate limit.
+ */
+static void
+dest_pace(struct dest *d, double now)
+{
+    if (d->d_qps > 0)
+        d->d_next_start = (d->d_next_start > now ? d->d_next_start : now)
+                        + 1 / d->d_qps;
+}
+
+/* Return how long to wait for d to answer before hedging:  its p95
+ * latency once there are enough replies to tell, else its RTO.
+ */
+static double
+hedge_delay(struct dest *d)
+{
+    if (d->d_lat.l_n < HEDGE_SAMPLES)
+        return quota_rtt_rto(&d->d_rtt);
+    if (d->d_hedge_n == 0 || d->d_lat.l_n >= d->d_hedge_n + 16) {
+        d->d_hedge = lat_quantile(&d->d_lat, 0.95);
+        d->d_hedge_n = d->d_lat.l_n;
+    }
+    return d->d_hedge;
+}
+
+/* Send a duplicate of call s to the next server in its request's group,
+ * if that server is up and has room for it.  Either way, the request
+ * is not hedged again.
+ */
+static void
+start_hedge(struct engine *e, struct slot *s, double now)
+{
+    int i = s->s_req;
+    struct group *g = &e->groups[e->gix[i]];
+    int hdix = g->g_dix[(e->rep[i] + 1) % g->g_n];
+    struct dest *h = &e->dests[hdix];
+
+    e->hedged[i] = 1;
+    if (!h->d_ok || e->nfree == 0 || h->d_inflight >= h->d_limit
+                 || (h->d_qps > 0 && now < h->d_next_start)
+                 || !breaker_allow(h->d_brk, now))
+        return;
+    dest_pace(h, now);
+    e->hedges++;
+    start_call(e, i, hdix, s);
+}
+
+/* Time out, retransmit or hedge in-flight calls as needed, and return
+ * the time of the next timer event.
+ */
+static double
+run_timers(struct engine *e, double now)
+{
+    double next = now + quota_nfs_timeout, t;
+    struct slot *s;
+    struct dest *d;
+    int i;
+
+    for (s = &e->slots[0]; s < &e->slots[e->nslots]; s++) {
+        if ((i = s->s_req) < 0)
+            continue;
+        d = &e->dests[s->s_dix];
+        if (now >= s->s_first + quota_nfs_timeout) {
+            if (s->s_sib < 0)
+                fprintf(stderr, "%s: %s: %s\n", prog, d->d_rhost,
+                        clnt_sperrno(RPC_TIMEDOUT));
+            hostcache_invalidate(d->d_rhost, d->d_proto);
+            breaker_timeout(d->d_brk, now);
+            drop_call(e, s);
+            continue;
+        }
+        if (!e->hedged[i]) {
+            t = s->s_first + hedge_delay(d);
+            if (now >= t)
+                start_hedge(e, s, now);
+            else if (t < next)
+                next = t;
+        }
+        if (d->d_tcp) {
+            if (s->s_first + quota_nfs_timeout < next)
+                next = s->s_first + quota_nfs_timeout;
+            continue;
+        }
+        if (now >= s->s_sent + s->s_rto) {
+            s->s_rto *= 2;
+            if (s->s_rto > quota_nfs_retry_timeout)
+                s->s_rto = quota_nfs_retry_timeout;
+            queue_call(e, s);
+            e->retrans++;
+        }
+        if (s->s_sent + s->s_rto < next)
+            next = s->s_sent + s->s_rto;
+        if (s->s_first + quota_nfs_timeout < next)
+            next = s->s_first + quota_nfs_timeout;
+    }
+    return next;
+}
+
+/* Find or make the dest for (rhost, proto), resolving its address.
+ */
+static int
+get_dest(struct engine *e, char *rhost, char *proto)
+{
+    struct dest *d;
+    int j;
+
+    for (j = 0; j < e->ndests; j++)
+        if (!strcmp(e->dests[j].d_rhost, rhost)
+                    && !strcmp(e->dests[j].d_proto, proto))
+            return j;
+    if (e->ndests == e->dsize) {
+        e->dsize = e->dsize ? e->dsize * 2 : 4;
+        e->dests = xrealloc(e->dests, sizeof(struct dest) * e->dsize);
+    }
+    d = &e->dests[e->ndests];
+    memset(d, 0, sizeof(*d));
+    d->d_rhost = xstrdup(rhost);
+    d->d_proto = proto;
+    d->d_tcp = !strcmp(proto, "tcp");
+    d->d_fd = -1;
+    d->d_brk = breaker_get(d->d_rhost);
+    d->d_ok = (hostcache_lookup(d->d_rhost, proto, &d->d_sin) == 0);
+    if (d->d_ok && !d->d_tcp)
+        quota_rtt_load(d->d_rhost, proto, &d->d_rtt);
+    return e->ndests++;
+}
+
+/* Find or make the group for request i's rhost list and transport.
+ */
+static int
+get_group(struct engine *e, int i)
+{
+    quota_t q = e->qv[i];
+    char *proto = quota_nfs_proto(q);
+    char *hosts, *host, *save;
+    struct group *g;
+    int j;
+
+    for (j = 0; j < e->ngroups; j++)
+        if (!strcmp(e->groups[j].g_rhost, q->q_rhost)
+                    && !strcmp(e->groups[j].g_proto, proto))
+            return j;
+    if (e->ngroups == e->gsize) {
+        e->gsize = e->gsize ? e->gsize * 2 : 4;
+        e->groups = xrealloc(e->groups, sizeof(struct group) * e->gsize);
+    }
+    g = &e->groups[e->ngroups];
+    g->g_rhost = q->q_rhost;
+    g->g_proto = proto;
+    g->g_n = 0;
+    hosts = xstrdup(q->q_rhost);
+    for (host = strtok_r(hosts, ",", &save); host && g->g_n < MAX_REPLICAS;
+                                    host = strtok_r(NULL, ",", &save))
+        g->g_dix[g->g_n++] = get_dest(e, host, proto);
+    free(hosts);
+    if (g->g_n == 0)    /* empty rhost */
+        g->g_dix[g->g_n++] = get_dest(e, q->q_rhost, proto);
+    return e->ngroups++;
+}
+
+static void
+enqueue(struct dest *d, int i)
+{
+    if (d->d_nqueue == d->d_qsize) {
+        d->d_qsize = d->d_qsize ? d->d_qsize * 2 : 16;
+        d->d_queue = xrealloc(d->d_queue, sizeof(int) * d->d_qsize);
+    }
+    d->d_queue[d->d_nqueue++] = i;
+}
+
+/* Map each request to its group of servers, and queue it on the first
+ * of them whose address is known.  A server's limits are the tightest of
+ * those given for its requests.
+ */
+static void
+resolve_dests(struct engine *e, int n)
+{
+    struct group *g;
+    struct dest *d;
+    int i, j, limit;
+    double qps;
+
+    for (i = 0; i < n; i++) {
+        assert(e->qv[i]->q_magic == QUOTA_MAGIC);
+        e->gix[i] = get_group(e, i);
+        g = &e->groups[e->gix[i]];
+        limit = quota_nfs_limit(e->qv[i]);
+        qps = quota_nfs_qps(e->qv[i]);
+        for (j = 0; j < g->g_n; j++) {
+            d = &e->dests[g->g_dix[j]];
+            if (d->d_limit == 0 || limit < d->d_limit)
+                d->d_limit = limit;
+            if (qps > 0 && (d->d_qps == 0 || qps < d->d_qps))
+                d->d_qps = qps;
+        }
+        for (j = 0; j < g->g_n - 1; j++)
+            if (e->dests[g->g_dix[j]].d_ok)
+                break;
+        e->rep[i] = j;
+        e->dix[i] = g->g_dix[j];
+        e->hedged[i] = (g->g_n < 2);
+        enqueue(&e->dests[e->dix[i]], i);
+    }
+    e->pending = n;
+}
+
+/* Start queued requests, taking one from each destination in turn while
+ * there are free slots and the destination is within its limits.
+ * Requests that can't be sent move on to the next server in their group,
+ * or if there is none, fail here.  Returns the earliest time a
+ * destination held back only by its rate limit may start another call,
+ * or 0 if there is none.
+ */
+static double
+start_calls(struct engine *e, double now)
+{
+    double wake = 0;
+    struct group *g;
+    struct dest *d;
+    int i, idle = 0;
+
+    while (e->pending > 0 && idle < e->ndests) {
+        d = &e->dests[e->rr];
+        e->rr = (e->rr + 1) % e->ndests;
+        if (d->d_qnext == d->d_nqueue) {
+            idle++;
+            continue;
+        }
+        i = d->d_queue[d->d_qnext];
+        g = &e->groups[e->gix[i]];
+        if (!quota_nfs_permitted(e->uids[i]))
+            finish(e, i, -1);
+        else if (!d->d_ok) {
+            if (e->rep[i] < g->g_n - 1)
+                goto failover;
+            finish(e, i, -1);
+        } else {
+            if (e->nfree == 0 || d->d_inflight >= d->d_limit) {
+                idle++;
+                continue;
+            }
+            if (d->d_qps > 0 && now < d->d_next_start) {
+                if (wake == 0 || d->d_next_start < wake)
+                    wake = d->d_next_start;
+                idle++;
+                continue;
+            }
+            if (breaker_allow(d->d_brk, now)) {
+                dest_pace(d, now);
+                start_call(e, i, e->dix[i], NULL);
+            } else if (e->rep[i] < g->g_n - 1)
+                goto failover;
+            else {
+                d->d_skipped++;
+                finish(e, i, -1);
+            }
+        }
+        d->d_qnext++;
+        e->pending--;
+        idle = 0;
+        continue;
+failover:
+        d->d_qnext++;
+        e->dix[i] = g->g_dix[++e->rep[i]];
+        enqueue(&e->dests[e->dix[i]], i);
+        idle = 0;
+    }
+    return wake;
+}
+
+static int
+engine_init(struct engine *e, uid_t *uids, int n, quota_t *qv, int *rcv)
+{
+    int i;
+
+    memset(e, 0, sizeof(*e));
+    if (!(e->lhost = quota_nfs_lhost()))
+        return -1;
+    if ((e->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "%s: socket: %s\n", prog, strerror(errno));
+        return -1;
+    }
+    (void)fcntl(e->fd, F_SETFL, fcntl(e->fd, F_GETFL) | O_NONBLOCK);
+    /* Gnat48: no supplementary groups, as in quota_get_nfs() */
+    e->gid = getgid();
+    e->stamp = time(NULL);
+    e->uids = uids;
+    e->qv = qv;
+    e->rcv = rcv;
+    e->dix = xmalloc(sizeof(int) * n);
+    e->gix = xmalloc(sizeof(int) * n);
+    e->rep = xmalloc(sizeof(int) * n);
+    e->hedged = xmalloc(n);
+    resolve_dests(e, n);
+    e->pfds = xmalloc(sizeof(struct pollfd) * (e->ndests + 1));
+    e->pdix = xmalloc(sizeof(int) * (e->ndests + 1));
+
+    e->nslots = 0;
+    for (i = 0; i < e->ndests; i++)
+        if ((e->nslots += e->dests[i].d_limit) > MAX_WINDOW)
+            break;
+    if (quota_nfs_window > 0 && quota_nfs_window < e->nslots)
+        e->nslots = quota_nfs_window;
+    if (e->nslots < 1)
+        e->nslots = 1;
+    if (e->nslots > MAX_WINDOW)
+        e->nslots = MAX_WINDOW;
+    e->slots = xmalloc(sizeof(struct slot) * e->nslots);
+    e->freeslots = xmalloc(sizeof(int) * e->nslots);
+    for (i = e->nslots - 1; i >= 0; i--) {
+        e->slots[i].s_req = -1;
+        e->freeslots[e->nfree++] = i;
+    }
+    e->xid_base = (u_int32_t)random() ^ ((u_int32_t)getpid() << 16)
+                                      ^ (u_int32_t)time(NULL);
+    return 0;
+}
+
+static void
+engine_fini(struct engine *e)
+{
+    struct dest *d;
+
+    close(e->fd);
+    for (d = &e->dests[0]; d < &e->dests[e->ndests]; d++) {
+        if (debug)
+            printf("sched: %s/%s: %d requests, peak %d in flight (limit %d)"
+                   ", %g/s\n", d->d_rhost, d->d_proto, d->d_nqueue,
+                   d->d_peak, d->d_limit, d->d_qps);
+        if (debug && d->d_lat.l_n > 0)
+            lat_print(d->d_rhost, d->d_proto, &d->d_lat);
+        if (d->d_skipped > 0)
+            fprintf(stderr, "%s: %s: not responding, skipped %d quer%s\n",
+                    prog, d->d_rhost, d->d_skipped,
+                    d->d_skipped == 1 ? "y" : "ies");
+        if (d->d_samples > 0) {
+            if (debug)
+                printf("rtt: %s/%s: %d samples: srtt %.6f rttvar %.6f "
+                       "rto %.6f\n", d->d_rhost, d->d_proto, d->d_samples,
+                       d->d_rtt.r_srtt, d->d_rtt.r_rttvar,
+                       quota_rtt_rto(&d->d_rtt));
+            quota_rtt_save(d->d_rhost, d->d_proto, &d->d_rtt);
+        }
+        if (d->d_fd >= 0)
+            close(d->d_fd);
+        free(d->d_out);
+        free(d->d_in);
+        free(d->d_queue);
+        free(d->d_rhost);
+    }
+    if (debug && e->lat.l_n > 0)
+        lat_print("all", NULL, &e->lat);
+    free(e->dix);
+    free(e->gix);
+    free(e->rep);
+    free(e->hedged);
+    free(e->dests);
+    free(e->groups);
+    free(e->pfds);
+    free(e->pdix);
+    free(e->slots);
+    free(e->freeslots);
+}
+
+/* Fail every request that has not completed by the deadline.
+ */
+static void
+expire_all(struct engine *e)
+{
+    struct slot *s;
+    struct dest *d;
+    int i;
+
+    for (s = &e->slots[0]; s < &e->slots[e->nslots]; s++) {
+        if (s->s_req < 0)
+            continue;
+        if (s->s_sib < 0)
+            fprintf(stderr, "%s: %s: %s\n", prog,
+                    e->dests[s->s_dix].d_rhost, clnt_sperrno(RPC_TIMEDOUT));
+        drop_call(e, s);
+    }
+    for (d = &e->dests[0]; d < &e->dests[e->ndests]; d++) {
+        while (d->d_qnext < d->d_nqueue) {
+            i = d->d_queue[d->d_qnext++];
+            fprintf(stderr, "%s: %s: %s\n", prog, d->d_rhost,
+                    clnt_sperrno(RPC_TIMEDOUT));
+            finish(e, i, -1);
+        }
+    }
+    e->pending = 0;
+}
+
+/* Get quotas for uids[0..n-1] into qv[0..n-1], which may name any mix of
+ * NFS servers.  rcv[i] is set to 0 on success, -1 on failure, and then
+ * done(i, arg) is called if done is non-NULL.  If deadline is nonzero,
+ * requests not complete by then (on the monotime() clock) fail.
+ * Returns the number of failures.
+ */
+int
+quota_get_nfs_many(uid_t *uids, int n, quota_t *qv, int *rcv,
+                   double deadline, quota_done_f done, void *arg)
+{
+    struct engine *e;
+    double t0 = monotime(), now, next, wake;
+    int i, j, npfd, fails = 0;
+
+    if (n == 0)
+        return 0;
+    e = xmalloc(sizeof(struct engine));
+    if (engine_init(e, uids, n, qv, rcv) < 0) {
+        for (i = 0; i < n; i++) {
+            rcv[i] = -1;
+            if (done)
+                done(i, arg);
+        }
+        free(e);
+        return n;
+    }
+    e->donefun = done;
+    e->donearg = arg;
+
+    while (e->done < n) {
+        if (deadline > 0 && monotime() >= deadline) {
+            expire_all(e);
+            break;
+        }
+        now = monotime();
+        wake = start_calls(e, now);
+        flush_all(e);
+        if (e->inflight == 0 && wake == 0)
+            continue;
+        next = run_timers(e, now);
+        flush_all(e);
+        if (e->inflight == 0 && wake == 0)
+            continue;
+        if (wake > 0 && wake < next)
+            next = wake;
+        if (deadline > 0 && deadline < next)
+            next = deadline;
+        npfd = build_pollset(e);
+        if (poll(e->pfds, npfd, (int)((next - now) * 1000) + 1) > 0) {
+            if (e->pfds[0].revents)
+                recv_replies(e);
+            for (j = 1; j < npfd; j++)
+                if (e->pfds[j].revents)
+                    tcp_event(e, &e->dests[e->pdix[j]], e->pfds[j].revents);
+        }
+    }
+    for (i = 0; i < n; i++)
+        if (rcv[i] != 0)
+            fails++;
+    if (debug)
+        printf("nfs: %d quotas (%d failed) in %.3fs: "
+               "%lu calls, %lu retransmits, %lu connections, window %d, "
+               "%lu hedges (%lu won)\n",
+               n, fails, monotime() - t0, e->calls, e->retrans, e->conns,
+               e->nslots, e->hedges, e->hedge_wins);
+    engine_fini(e);
+    free(e);
+    return fails;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
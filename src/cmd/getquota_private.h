@@ -31,6 +31,31 @@ typedef enum { NONE, UNDER, NOTSTARTED, STARTED, EXPIRED } qstate_t;
  * EXPIRED  hard < used || (soft < used < hard && now >= grace_expiration)
  */
 
+/* A quota backend, selected by the rhost field of a quota.conf entry.
+ * get_many() fills in qv[0..n-1] as quota_get_many() does, except that
+ * every query is for this backend.  get_all() is quota_get_all(), for
+ * backends that can list the ids with quota records.
+ */
+struct quota_backend {
+    char  *qb_name;         /* rhost that selects it, NULL = any (NFS) */
+    int    qb_blocking;     /* may block in a hung file system */
+    void (*qb_init)(void);  /* before first use, NULL = none */
+    int  (*qb_get)(uid_t uid, quota_t q);
+    int  (*qb_get_many)(uid_t *uids, int n, quota_t *qv, int *rcv,
+                        double deadline, quota_done_f done, void *arg);
+    int  (*qb_get_all)(quota_t q, listint_t uids, List qlist);   /* or NULL */
+    void (*qb_fini)(void);  /* at exit, if initialized, NULL = none */
+    int    qb_ready;
+};
+
+extern struct quota_backend quota_backend_nfs;
+extern struct quota_backend quota_backend_lustre;
+extern struct quota_backend quota_backend_local;
+
+extern int quota_lustre_depth;
+
+#define QUOTA_POOL_MAX_DEPTH 256
+
 #define QUOTA_MAGIC 0x3434aaaf
 struct quota_struct {
     int                q_magic;
@@ -39,7 +64,13 @@ struct quota_struct {
     char              *q_label;        /* assumed to be local mount point */
     char              *q_rhost;        /* lustre: set to "lustre" */
     char              *q_rpath;        /* lustre: set to local mount pt */
+    struct quota_backend *q_backend;
+    char              *q_proto;        /* NFS transport, NULL = default */
+    int                q_window;       /* max calls in flight, 0 = default */
+    double             q_qps;          /* max calls/sec, 0 = default */
     int                q_thresh;       /* 0 = unused */
+    int                q_want_targets; /* fill in q_targets */
+    List               q_targets;      /* per storage target, by label */
     unsigned long long q_bytes_used;
     unsigned long long q_bytes_softlim;/* 0 = no limit */
     unsigned long long q_bytes_hardlim;/* 0 = no limit */
@@ -53,8 +84,34 @@ struct quota_struct {
     qstate_t           q_files_state;
 };
 
-int quota_get_lustre(uid_t uid, quota_t q);
+quota_t quota_add_target(quota_t q, char *name);
+int quota_get_serial(uid_t *uids, int n, quota_t *qv, int *rcv,
+                     double deadline, quota_done_f done, void *arg);
+int quota_pool_depth(quota_t q);
 int quota_get_nfs(uid_t uid, quota_t q);
+int quota_get_nfs_many(uid_t *uids, int n, quota_t *qv, int *rcv,
+                       double deadline, quota_done_f done, void *arg);
+
+/* Smoothed round trip time to an NFS server, see quota_rtt_sample().
+ */
+struct rtt {
+    double  r_srtt;     /* seconds, 0 = no estimate yet */
+    double  r_rttvar;
+};
+
+void   quota_rtt_sample(struct rtt *r, double sample);
+double quota_rtt_rto(struct rtt *r);
+void   quota_rtt_load(char *rhost, char *proto, struct rtt *r);
+void   quota_rtt_save(char *rhost, char *proto, struct rtt *r);
+
+struct rquota;
+char *quota_nfs_lhost(void);
+char *quota_nfs_proto(quota_t q);
+int    quota_nfs_limit(quota_t q);
+double quota_nfs_qps(quota_t q);
+int quota_nfs_permitted(uid_t uid);
+int quota_nfs_status(quota_t q, int status);
+void quota_nfs_fill(uid_t uid, quota_t q, struct rquota *rq);
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
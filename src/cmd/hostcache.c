@@ -0,0 +1,516 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Persistent cache of rquotad addresses and ports.
+ *
+ * Resolving an rhost costs a DNS lookup plus a portmapper GETPORT, even
+ * though the rquotad port on a given server almost never changes.  The
+ * result is kept in a small text file shared by every quota and repquota
+ * run on the node, one entry per line:
+ *
+ *   rhost proto address port expires [srtt rttvar]
+ *
+ * Entries expire after quota_cache_ttl seconds and are invalidated by the
+ * caller when an RPC to the cached address fails.  The smoothed round trip
+ * time and its variance (seconds) are kept with the address so that each
+ * run starts with a good retransmit timeout, see quota_rtt_sample().
+ * When a host resolves to several addresses, GETPORT is sent to all of
+ * them at once and the first answer wins, so a dead address costs nothing
+ * if another is alive.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <rpc/rpc.h>
+#include <rpc/pmap_prot.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "src/liblsd/list.h"
+#include "src/libutil/util.h"
+#include "src/librpc/rquota.h"
+
+#include "hostcache.h"
+
+#define HOSTCACHE_FILE  "hosts"
+#define MAXRACE         16      /* max addresses raced per host */
+
+extern char *prog;
+extern int debug;
+extern double quota_nfs_timeout;
+extern double quota_nfs_retry_timeout;
+
+char *quota_cache_dir = _PATH_QUOTA_CACHEDIR;   /* "" disables the cache */
+double quota_cache_ttl = 3600;
+
+struct hcent {
+    char           *hc_rhost;
+    char           *hc_proto;
+    struct in_addr  hc_addr;
+    unsigned short  hc_port;        /* host byte order */
+    time_t          hc_expires;     /* 0 = invalidated */
+    double          hc_srtt;        /* 0 = unknown */
+    double          hc_rttvar;
+};
+
+static List hostcache = NULL;
+static int  hostcache_dirty = 0;
+static pthread_mutex_t hostcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+hcent_destroy(struct hcent *hc)
+{
+    free(hc->hc_rhost);
+    free(hc->hc_proto);
+    free(hc);
+}
+
+static int
+hcent_match(struct hcent *hc, struct hcent *key)
+{
+    return (!strcmp(hc->hc_rhost, key->hc_rhost)
+         && !strcmp(hc->hc_proto, key->hc_proto));
+}
+
+static struct hcent *
+hcent_find(char *rhost, char *proto)
+{
+    struct hcent key;
+
+    key.hc_rhost = rhost;
+    key.hc_proto = proto;
+    return list_find_first(hostcache, (ListFindF)hcent_match, &key);
+}
+
+static struct hcent *
+hcent_add(char *rhost, char *proto)
+{
+    struct hcent *hc = xmalloc(sizeof(struct hcent));
+
+    memset(hc, 0, sizeof(struct hcent));
+    hc->hc_rhost = xstrdup(rhost);
+    hc->hc_proto = xstrdup(proto);
+    list_append(hostcache, hc);
+    return hc;
+}
+
+static int
+hostcache_path(char *path, int len, char *name)
+{
+    if (!quota_cache_dir || quota_cache_dir[0] == '\0')
+        return -1;
+    if (snprintf(path, len, "%s/%s", quota_cache_dir, name) >= len)
+        return -1;
+    return 0;
+}
+
+/* Merge entries from the cache file that we don't already know about.
+ * Our own entries (including invalidated ones) take precedence.
+ */
+static void
+hostcache_read(void)
+{
+    char path[MAXPATHLEN], buf[BUFSIZ];
+    char rhost[256], proto[8], addr[INET_ADDRSTRLEN];
+    unsigned int port;
+    long expires;
+    double srtt, rttvar;
+    struct hcent *hc;
+    FILE *f;
+    int n;
+
+    if (hostcache_path(path, sizeof(path), HOSTCACHE_FILE) < 0)
+        return;
+    if (!(f = fopen(path, "r")))
+        return;
+    while (fgets(buf, sizeof(buf), f)) {
+        n = sscanf(buf, "%255s %7s %15s %u %ld %lf %lf",
+                   rhost, proto, addr, &port, &expires, &srtt, &rttvar);
+        if (n != 5 && n != 7)
+            continue;
+        if (hcent_find(rhost, proto))
+            continue;
+        hc = hcent_add(rhost, proto);
+        if (inet_pton(AF_INET, addr, &hc->hc_addr) != 1 || port > 65535)
+            expires = 0;
+        hc->hc_port = port;
+        hc->hc_expires = expires;
+        if (n == 7 && srtt > 0 && rttvar >= 0) {
+            hc->hc_srtt = srtt;
+            hc->hc_rttvar = rttvar;
+        }
+    }
+    fclose(f);
+}
+
+/* Rewrite the cache file atomically with all unexpired entries.
+ * Failure (e.g. unprivileged user, read-only /var) is silently ignored.
+ */
+static void
+hostcache_write(void)
+{
+    char path[MAXPATHLEN], tmp[MAXPATHLEN], addr[INET_ADDRSTRLEN];
+    time_t now = time(NULL);
+    ListIterator itr;
+    struct hcent *hc;
+    FILE *f;
+    int fd;
+
+    if (hostcache_path(path, sizeof(path), HOSTCACHE_FILE) < 0)
+        return;
+    if (hostcache_path(tmp, sizeof(tmp), "." HOSTCACHE_FILE ".XXXXXX") < 0)
+        return;
+    hostcache_read();
+    if ((fd = mkstemp(tmp)) < 0)
+        return;
+    if (fchmod(fd, 0644) < 0 || !(f = fdopen(fd, "w"))) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    itr = list_iterator_create(hostcache);
+    while ((hc = list_next(itr))) {
+        if (hc->hc_expires <= now)
+            continue;
+        inet_ntop(AF_INET, &hc->hc_addr, addr, sizeof(addr));
+        fprintf(f, "%s %s %s %u %ld", hc->hc_rhost, hc->hc_proto, addr,
+                hc->hc_port, (long)hc->hc_expires);
+        if (hc->hc_srtt > 0)
+            fprintf(f, " %.6f %.6f", hc->hc_srtt, hc->hc_rttvar);
+        fprintf(f, "\n");
+    }
+    list_iterator_destroy(itr);
+    if (fclose(f) != 0 || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+static void
+hostcache_fini(void)
+{
+    if (hostcache) {
+        if (hostcache_dirty)
+            hostcache_write();
+        list_destroy(hostcache);
+        hostcache = NULL;
+    }
+}
+
+static void
+hostcache_init(void)
+{
+    if (!hostcache) {
+        hostcache = list_create((ListDelF)hcent_destroy);
+        hostcache_read();
+        atexit(hostcache_fini);
+    }
+}
+
+/* Encode a portmapper GETPORT call for rquotad into buf.
+ */
+static int
+encode_getport(char *buf, int len, u_int32_t xid, int ipproto)
+{
+    struct rpc_msg msg;
+    struct pmap pm;
+    XDR xdrs;
+    int n = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.rm_xid = xid;
+    msg.rm_direction = CALL;
+    msg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+    msg.rm_call.cb_prog = PMAPPROG;
+    msg.rm_call.cb_vers = PMAPVERS;
+    msg.rm_call.cb_proc = PMAPPROC_GETPORT;
+    msg.rm_call.cb_cred = _null_auth;
+    msg.rm_call.cb_verf = _null_auth;
+
+    pm.pm_prog = RQUOTAPROG;
+    pm.pm_vers = RQUOTAVERS;
+    pm.pm_prot = ipproto;
+    pm.pm_port = 0;
+
+    xdrmem_create(&xdrs, buf, len, XDR_ENCODE);
+    if (xdr_callmsg(&xdrs, &msg) && xdr_pmap(&xdrs, &pm))
+        n = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+    return n;
+}
+
+/* Decode a GETPORT reply.  Returns 0 and sets *portp on success.
+ */
+static int
+decode_getport(char *buf, int len, u_int32_t xid, unsigned long *portp)
+{
+    struct rpc_msg msg;
+    XDR xdrs;
+    int rc = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.acpted_rply.ar_verf = _null_auth;
+    msg.acpted_rply.ar_results.where = (caddr_t)portp;
+    msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_u_long;
+
+    xdrmem_create(&xdrs, buf, len, XDR_DECODE);
+    if (xdr_replymsg(&xdrs, &msg) && msg.rm_xid == xid
+                                  && msg.rm_reply.rp_stat == MSG_ACCEPTED
+                                  && msg.acpted_rply.ar_stat == SUCCESS)
+        rc = 0;
+    xdr_destroy(&xdrs);
+    return rc;
+}
+
+/* Send GETPORT to the portmapper on every address at once, retransmitting
+ * every quota_nfs_retry_timeout, and take the first nonzero answer.
+ */
+static int
+race_getport(char *rhost, struct sockaddr_in *addrs, int naddrs, int ipproto,
+             struct sockaddr_in *sin)
+{
+    char buf[512], rbuf[512];
+    int len, fd, i, n, answered = 0;
+    u_int32_t xid = (u_int32_t)random() ^ (u_int32_t)getpid();
+    double now, deadline, resend;
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    unsigned long port;
+    struct pollfd pfd;
+    char refused[MAXRACE];
+    int rc = -1;
+
+    memset(refused, 0, sizeof(refused));
+    if ((len = encode_getport(buf, sizeof(buf), xid, ipproto)) < 0) {
+        fprintf(stderr, "%s: %s: RPC: Can't encode arguments\n", prog, rhost);
+        return -1;
+    }
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "%s: socket: %s\n", prog, strerror(errno));
+        return -1;
+    }
+    now = monotime();
+    deadline = now + quota_nfs_timeout;
+    resend = now;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((now = monotime()) < deadline) {
+        if (now >= resend) {
+            for (i = 0; i < naddrs; i++)
+                (void)sendto(fd, buf, len, 0, (struct sockaddr *)&addrs[i],
+                             sizeof(addrs[i]));
+            resend = now + quota_nfs_retry_timeout;
+        }
+        n = poll(&pfd, 1, (int)(((resend < deadline ? resend : deadline)
+                                 - now) * 1000) + 1);
+        if (n <= 0)
+            continue;
+        fromlen = sizeof(from);
+        n = recvfrom(fd, rbuf, sizeof(rbuf), 0, (struct sockaddr *)&from,
+                     &fromlen);
+        if (n <= 0 || decode_getport(rbuf, n, xid, &port) < 0)
+            continue;
+        if (port == 0 || port > 65535) {
+            for (i = 0; i < naddrs; i++) {
+                if (!refused[i] && addrs[i].sin_addr.s_addr
+                                        == from.sin_addr.s_addr) {
+                    refused[i] = 1;
+                    answered++;
+                }
+            }
+            if (answered == naddrs)
+                break; /* every portmapper says not registered */
+            continue;
+        }
+        *sin = from;
+        sin->sin_port = htons(port);
+        rc = 0;
+        break;
+    }
+    close(fd);
+    if (rc < 0)
+        fprintf(stderr, "%s: %s: RPC: %s\n", prog, rhost,
+                answered == naddrs ? "Program not registered"
+                                   : "Port mapper failure - Timed out");
+    return rc;
+}
+
+/* Resolve rhost and find its rquotad port for proto ("udp" or "tcp").
+ */
+static int
+resolve(char *rhost, char *proto, struct sockaddr_in *sin)
+{
+    struct sockaddr_in addrs[MAXRACE];
+    struct addrinfo hints, *res, *rp;
+    int naddrs = 0;
+    int ipproto = strcmp(proto, "tcp") ? IPPROTO_UDP : IPPROTO_TCP;
+    int e;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ((e = getaddrinfo(rhost, NULL, &hints, &res)) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", prog, rhost, gai_strerror(e));
+        return -1;
+    }
+    for (rp = res; rp != NULL && naddrs < MAXRACE; rp = rp->ai_next) {
+        memcpy(&addrs[naddrs], rp->ai_addr, sizeof(struct sockaddr_in));
+        addrs[naddrs++].sin_port = htons(PMAPPORT);
+    }
+    freeaddrinfo(res);
+    if (naddrs == 0) {
+        fprintf(stderr, "%s: %s: no IPv4 address\n", prog, rhost);
+        return -1;
+    }
+    return race_getport(rhost, addrs, naddrs, ipproto, sin);
+}
+
+/* Fill in sin with the address and port of rquotad on rhost,
+ * from the cache if possible.  Returns 0 on success, -1 on failure
+ * (with a message on stderr).
+ */
+int
+hostcache_lookup(char *rhost, char *proto, struct sockaddr_in *sin)
+{
+    char addr[INET_ADDRSTRLEN];
+    struct hcent *hc;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&hostcache_lock);
+    hostcache_init();
+    hc = hcent_find(rhost, proto);
+    if (hc && hc->hc_expires > now) {
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_addr = hc->hc_addr;
+        sin->sin_port = htons(hc->hc_port);
+        pthread_mutex_unlock(&hostcache_lock);
+        if (debug)
+            printf("hostcache: %s/%s: cached %s:%u\n", rhost, proto,
+                   inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr)),
+                   ntohs(sin->sin_port));
+        return 0;
+    }
+    /* don't hold the lock over DNS and portmapper round trips */
+    pthread_mutex_unlock(&hostcache_lock);
+    if (resolve(rhost, proto, sin) < 0)
+        return -1;
+    pthread_mutex_lock(&hostcache_lock);
+    if (!(hc = hcent_find(rhost, proto)))
+        hc = hcent_add(rhost, proto);
+    hc->hc_addr = sin->sin_addr;
+    hc->hc_port = ntohs(sin->sin_port);
+    hc->hc_expires = now + quota_cache_ttl;
+    hostcache_dirty = 1;
+    pthread_mutex_unlock(&hostcache_lock);
+    if (debug)
+        printf("hostcache: %s/%s: resolved %s:%u\n", rhost, proto,
+               inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr)),
+               ntohs(sin->sin_port));
+    return 0;
+}
+
+/* Forget the cached address of rhost, e.g. after an RPC to it failed,
+ * so the next lookup (in this or any later run) resolves it afresh.
+ */
+void
+hostcache_invalidate(char *rhost, char *proto)
+{
+    struct hcent *hc;
+
+    pthread_mutex_lock(&hostcache_lock);
+    hostcache_init();
+    if ((hc = hcent_find(rhost, proto)) && hc->hc_expires != 0) {
+        hc->hc_expires = 0;
+        hostcache_dirty = 1;
+    }
+    pthread_mutex_unlock(&hostcache_lock);
+}
+
+/* Get the round trip time estimate for rhost.  Returns 0 on success,
+ * or -1 if there is none.
+ */
+int
+hostcache_get_rtt(char *rhost, char *proto, double *srtt, double *rttvar)
+{
+    struct hcent *hc;
+    int rc = -1;
+
+    pthread_mutex_lock(&hostcache_lock);
+    hostcache_init();
+    if ((hc = hcent_find(rhost, proto)) && hc->hc_srtt > 0) {
+        *srtt = hc->hc_srtt;
+        *rttvar = hc->hc_rttvar;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&hostcache_lock);
+    return rc;
+}
+
+/* Has an estimate moved by more than a quarter of its old value?
+ */
+static int
+moved(double new, double old)
+{
+    double d = new > old ? new - old : old - new;
+
+    return d > old / 4;
+}
+
+/* Update the round trip time estimate for a cached rhost.  To spare the
+ * disk a rewrite on every run, the file is only rewritten if the estimate
+ * has moved by more than a quarter.
+ */
+void
+hostcache_set_rtt(char *rhost, char *proto, double srtt, double rttvar)
+{
+    struct hcent *hc;
+
+    pthread_mutex_lock(&hostcache_lock);
+    hostcache_init();
+    if ((hc = hcent_find(rhost, proto)) && hc->hc_expires != 0) {
+        if (moved(srtt, hc->hc_srtt) || moved(rttvar, hc->hc_rttvar))
+            hostcache_dirty = 1;
+        hc->hc_srtt = srtt;
+        hc->hc_rttvar = rttvar;
+    }
+    pthread_mutex_unlock(&hostcache_lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,469 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Persistent index of the password file.
+ *
+ * On a node whose passwd map comes from LDAP or the like, every
+ * getpwent() pass and getpwnam() is a round trip to the directory.  The
+ * map is enumerated once instead and written to a file in the cache
+ * directory, which later runs map read-only, so a lookup is a binary
+ * search in pages shared by every quota and repquota on the node:
+ *
+ *   header | entries by uid | entry numbers by name | strings
+ *
+ * The index is rebuilt when it is older than quota_cache_ttl seconds or
+ * when /etc/passwd has changed.  Users it doesn't have (e.g. those of a
+ * name service that won't enumerate) must be looked up the usual way.
+ * If the index can't be written, the one built is used for this run.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pwd.h>
+#include <pthread.h>
+
+#include "src/libutil/util.h"
+
+#include "pwcache.h"
+
+#define PWCACHE_FILE    "passwd.idx"
+#define PWCACHE_MAGIC   0x52515057  /* "RQPW" */
+#define PWCACHE_VERSION 1
+#define PATH_PASSWD     "/etc/passwd"
+
+extern char *prog;
+extern int debug;
+extern char *quota_cache_dir;
+extern double quota_cache_ttl;
+
+struct pwc_header {
+    uint32_t    h_magic;
+    uint32_t    h_version;
+    uint32_t    h_count;        /* entries */
+    uint32_t    h_strsize;      /* bytes of strings */
+    int64_t     h_built;        /* time of the enumeration */
+    int64_t     h_mtime;        /* of /etc/passwd then */
+};
+
+struct pwc_ent {
+    uint32_t    e_uid;
+    uint32_t    e_name;         /* offsets into the strings */
+    uint32_t    e_dir;
+};
+
+/* The index in use, mapped from the file or built in memory.
+ * Entries are in uid order, and for equal uids in password file order,
+ * so the first match is the one getpwuid() would return.  Likewise for
+ * names.
+ */
+static struct {
+    char               *p_base;
+    size_t              p_len;
+    int                 p_mapped;
+    struct pwc_ent     *p_ents;
+    uint32_t           *p_byname;
+    char               *p_strs;
+    uint32_t            p_count;
+} pwc;
+static int pwc_state = 0;           /* 1 = ready, -1 = unavailable */
+static pthread_mutex_t pwc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+pwcache_path(char *path, int len, char *name)
+{
+    if (!quota_cache_dir || quota_cache_dir[0] == '\0')
+        return -1;
+    if (snprintf(path, len, "%s/%s", quota_cache_dir, name) >= len)
+        return -1;
+    return 0;
+}
+
+static int64_t
+passwd_mtime(void)
+{
+    struct stat sb;
+
+    return stat(PATH_PASSWD, &sb) < 0 ? 0 : (int64_t)sb.st_mtime;
+}
+
+/* Point pwc at the index in base, after checking that it is whole and
+ * that every offset in it is in bounds.
+ */
+static int
+pwc_attach(char *base, size_t len)
+{
+    struct pwc_header *h = (struct pwc_header *)base;
+    uint64_t size;
+    uint32_t i;
+
+    if (len < sizeof(*h) || h->h_magic != PWCACHE_MAGIC
+                         || h->h_version != PWCACHE_VERSION)
+        return -1;
+    size = sizeof(*h) + (uint64_t)h->h_count * sizeof(struct pwc_ent)
+                      + (uint64_t)h->h_count * sizeof(uint32_t)
+                      + h->h_strsize;
+    if (size != len || h->h_strsize == 0)
+        return -1;
+    pwc.p_ents = (struct pwc_ent *)(base + sizeof(*h));
+    pwc.p_byname = (uint32_t *)(pwc.p_ents + h->h_count);
+    pwc.p_strs = (char *)(pwc.p_byname + h->h_count);
+    if (pwc.p_strs[h->h_strsize - 1] != '\0')
+        return -1;
+    for (i = 0; i < h->h_count; i++) {
+        if (pwc.p_ents[i].e_name >= h->h_strsize
+                || pwc.p_ents[i].e_dir >= h->h_strsize
+                || pwc.p_byname[i] >= h->h_count)
+            return -1;
+    }
+    pwc.p_base = base;
+    pwc.p_len = len;
+    pwc.p_count = h->h_count;
+    return 0;
+}
+
+/* Map the index file if it is current.
+ */
+static int
+pwc_load(void)
+{
+    char path[MAXPATHLEN];
+    struct pwc_header *h;
+    struct stat sb;
+    time_t now = time(NULL);
+    void *base;
+    int fd;
+
+    if (pwcache_path(path, sizeof(path), PWCACHE_FILE) < 0)
+        return -1;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0 || sb.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+    h = base;
+    if (pwc_attach(base, sb.st_size) < 0 || h->h_built > now
+                    || h->h_built + quota_cache_ttl <= now
+                    || h->h_mtime != passwd_mtime()) {
+        munmap(base, sb.st_size);
+        return -1;
+    }
+    pwc.p_mapped = 1;
+    return 0;
+}
+
+/* Entries as read from the name service, in that order.
+ */
+struct pwc_build {
+    struct pwc_ent *b_ents;
+    char           *b_strs;
+    uint32_t        b_count;
+    uint32_t        b_size;
+    uint32_t        b_strsize;
+    uint32_t        b_strmax;
+};
+
+static struct pwc_build *pwc_sort_arg;
+
+static uint32_t
+add_string(struct pwc_build *b, char *s)
+{
+    uint32_t off = b->b_strsize;
+    size_t len = strlen(s) + 1;
+
+    while (b->b_strsize + len > b->b_strmax) {
+        b->b_strmax = b->b_strmax ? b->b_strmax * 2 : 65536;
+        b->b_strs = xrealloc(b->b_strs, b->b_strmax);
+    }
+    memcpy(b->b_strs + off, s, len);
+    b->b_strsize += len;
+    return off;
+}
+
+/* qsort() comparators for entry numbers in pwc_sort_arg.  Ties go to
+ * the entry read first.
+ */
+static int
+cmp_uid(const void *a, const void *b)
+{
+    struct pwc_ent *e = pwc_sort_arg->b_ents;
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    if (e[x].e_uid != e[y].e_uid)
+        return e[x].e_uid < e[y].e_uid ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    struct pwc_build *p = pwc_sort_arg;
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    int rc = strcmp(p->b_strs + p->b_ents[x].e_name,
+                    p->b_strs + p->b_ents[y].e_name);
+
+    if (rc != 0)
+        return rc;
+    return x < y ? -1 : x > y;
+}
+
+/* Write the index atomically.  Failure (e.g. unprivileged user,
+ * read-only /var) is silently ignored.
+ */
+static void
+pwc_write(char *base, size_t len)
+{
+    char path[MAXPATHLEN], tmp[MAXPATHLEN];
+    int fd;
+
+    if (pwcache_path(path, sizeof(path), PWCACHE_FILE) < 0)
+        return;
+    if (pwcache_path(tmp, sizeof(tmp), "." PWCACHE_FILE ".XXXXXX") < 0)
+        return;
+    if ((fd = mkstemp(tmp)) < 0)
+        return;
+    if (fchmod(fd, 0644) < 0 || write(fd, base, len) != (ssize_t)len) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+
+/* Enumerate the name service into a new index, and save it.
+ */
+static int
+pwc_build(void)
+{
+    struct pwc_build b;
+    struct pwc_header *h;
+    struct pwc_ent *ents;
+    struct passwd *pw;
+    uint32_t *order, *pos, *byname, i;
+    int64_t mtime = passwd_mtime();
+    size_t len;
+    char *base;
+
+    memset(&b, 0, sizeof(b));
+    add_string(&b, "");
+    setpwent();
+    while ((pw = getpwent()) != NULL) {
+        if (b.b_count == b.b_size) {
+            b.b_size = b.b_size ? b.b_size * 2 : 1024;
+            b.b_ents = xrealloc(b.b_ents, sizeof(struct pwc_ent) * b.b_size);
+        }
+        b.b_ents[b.b_count].e_uid = pw->pw_uid;
+        b.b_ents[b.b_count].e_name = add_string(&b, pw->pw_name);
+        b.b_ents[b.b_count].e_dir = add_string(&b, pw->pw_dir);
+        b.b_count++;
+    }
+    endpwent();
+
+    len = sizeof(struct pwc_header) + b.b_count * sizeof(struct pwc_ent)
+                    + b.b_count * sizeof(uint32_t) + b.b_strsize;
+    base = xmalloc(len);
+    h = (struct pwc_header *)base;
+    memset(h, 0, sizeof(*h));
+    h->h_magic = PWCACHE_MAGIC;
+    h->h_version = PWCACHE_VERSION;
+    h->h_count = b.b_count;
+    h->h_strsize = b.b_strsize;
+    h->h_built = time(NULL);
+    h->h_mtime = mtime;
+    ents = (struct pwc_ent *)(base + sizeof(*h));
+    byname = (uint32_t *)(ents + b.b_count);
+    memcpy(byname + b.b_count, b.b_strs, b.b_strsize);
+
+    /* entries go in uid order; byname holds their new positions */
+    order = xmalloc(sizeof(uint32_t) * (b.b_count + 1));
+    pos = xmalloc(sizeof(uint32_t) * (b.b_count + 1));
+    pwc_sort_arg = &b;
+    for (i = 0; i < b.b_count; i++)
+        order[i] = i;
+    qsort(order, b.b_count, sizeof(uint32_t), cmp_uid);
+    for (i = 0; i < b.b_count; i++) {
+        ents[i] = b.b_ents[order[i]];
+        pos[order[i]] = i;
+    }
+    for (i = 0; i < b.b_count; i++)
+        order[i] = i;
+    qsort(order, b.b_count, sizeof(uint32_t), cmp_name);
+    for (i = 0; i < b.b_count; i++)
+        byname[i] = pos[order[i]];
+    free(order);
+    free(pos);
+    free(b.b_ents);
+    free(b.b_strs);
+
+    pwc_write(base, len);
+    if (pwc_attach(base, len) < 0) {
+        free(base);
+        return -1;
+    }
+    pwc.p_mapped = 0;
+    return 0;
+}
+
+static void
+pwc_fini(void)
+{
+    if (pwc.p_base) {
+        if (pwc.p_mapped)
+            munmap(pwc.p_base, pwc.p_len);
+        else
+            free(pwc.p_base);
+    }
+    memset(&pwc, 0, sizeof(pwc));
+}
+
+/* Map the index, or if build is set and it is missing or stale, build
+ * it.  A caller that would otherwise make only a few lookups shouldn't
+ * pay for enumerating the name service.  Returns 0 if the index can be
+ * used, else -1 (also if the cache is disabled).
+ */
+int
+pwcache_init(int build)
+{
+    double t0;
+    int rc;
+
+    pthread_mutex_lock(&pwc_lock);
+    if (pwc_state == 0 && (!quota_cache_dir || quota_cache_dir[0] == '\0'))
+        pwc_state = -1;
+    if (pwc_state == 0) {
+        t0 = monotime();
+        if ((rc = pwc_load()) == 0 || (build && pwc_build() == 0)) {
+            pwc_state = 1;
+            atexit(pwc_fini);
+            if (debug)
+                printf("pwcache: %s %u entries in %.3fs\n",
+                       rc == 0 ? "loaded" : "built", pwc.p_count,
+                       monotime() - t0);
+        } else if (build)
+            pwc_state = -1;
+    }
+    pthread_mutex_unlock(&pwc_lock);
+    return pwc_state > 0 ? 0 : -1;
+}
+
+static char *
+pwc_str(uint32_t off)
+{
+    return pwc.p_strs + off;
+}
+
+/* Look up uid in the index.  The strings returned stay valid for the
+ * rest of the run.  Returns -1 if it isn't there, or if pwcache_init()
+ * hasn't succeeded.
+ */
+int
+pwcache_byuid(uid_t uid, char **namep, char **dirp)
+{
+    uint32_t lo = 0, hi, mid;
+
+    if (pwc_state <= 0)
+        return -1;
+    hi = pwc.p_count;
+    while (lo < hi) {                   /* first entry >= uid */
+        mid = lo + (hi - lo) / 2;
+        if (pwc.p_ents[mid].e_uid < (uint32_t)uid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == pwc.p_count || pwc.p_ents[lo].e_uid != (uint32_t)uid)
+        return -1;
+    if (namep)
+        *namep = pwc_str(pwc.p_ents[lo].e_name);
+    if (dirp)
+        *dirp = pwc_str(pwc.p_ents[lo].e_dir);
+    return 0;
+}
+
+/* Look up name in the index, as pwcache_byuid().
+ */
+int
+pwcache_byname(char *name, uid_t *uidp, char **dirp)
+{
+    uint32_t lo = 0, hi, mid;
+    struct pwc_ent *e;
+
+    if (pwc_state <= 0)
+        return -1;
+    hi = pwc.p_count;
+    while (lo < hi) {                   /* first entry >= name */
+        mid = lo + (hi - lo) / 2;
+        e = &pwc.p_ents[pwc.p_byname[mid]];
+        if (strcmp(pwc_str(e->e_name), name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == pwc.p_count)
+        return -1;
+    e = &pwc.p_ents[pwc.p_byname[lo]];
+    if (strcmp(pwc_str(e->e_name), name) != 0)
+        return -1;
+    if (uidp)
+        *uidp = e->e_uid;
+    if (dirp)
+        *dirp = pwc_str(e->e_dir);
+    return 0;
+}
+
+/* Call f for each entry, in uid order.  Returns -1 if there is no index.
+ */
+int
+pwcache_for_each(void (*f)(uid_t uid, char *name, void *arg), void *arg)
+{
+    uint32_t i;
+
+    if (pwc_state <= 0)
+        return -1;
+    for (i = 0; i < pwc.p_count; i++)
+        f(pwc.p_ents[i].e_uid, pwc_str(pwc.p_ents[i].e_name), arg);
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -49,6 +49,7 @@
 #include "src/libutil/util.h"
 
 #include "getquota.h"
+#include "pwcache.h"
 
 static void usage(void);
 static void alarm_handler(int arg);
@@ -57,10 +58,10 @@ static void lookup_user_byuid(char *user, uid_t *uidp, char **dirp);
 static void lookup_self(char **userp, uid_t *uidp, char **dirp);
 static void get_login_quota(conf_t config, char *homedir, uid_t uid,
                             List qlist, int skipnolimit);
-static void get_all_quota(conf_t config, uid_t uid, List qlist,
-                          int skipnolimit);
+static void get_all_quota(conf_t config, uid_t uid, int skipnolimit,
+                          int vopt, int ropt);
 
-#define OPTIONS "f:rvlt:TdN:R:"
+#define OPTIONS "f:rvlt:TdN:R:C:D:P:B:w:Q:OMAm:"
 #if HAVE_GETOPT_LONG
 #define GETOPT(ac,av,opt,lopt) getopt_long(ac,av,opt,lopt,NULL)
 static const struct option longopts[] = {
@@ -73,6 +74,16 @@ static const struct option longopts[] = {
     {"debug",            no_argument,        0, 'd'},
     {"nfs-timeout",      required_argument,  0, 'N'},
     {"nfs-retry-timeout",required_argument,  0, 'R'},
+    {"cache-dir",        required_argument,  0, 'C'},
+    {"deadline",         required_argument,  0, 'D'},
+    {"nfs-transport",    required_argument,  0, 'P'},
+    {"nfs-breaker",      required_argument,  0, 'B'},
+    {"nfs-host-window",  required_argument,  0, 'w'},
+    {"nfs-qps",          required_argument,  0, 'Q'},
+    {"targets",          no_argument,        0, 'O'},
+    {"mounted",          no_argument,        0, 'M'},
+    {"add-mounts",       no_argument,        0, 'A'},
+    {"mountinfo",        required_argument,  0, 'm'},
     {0, 0, 0, 0},
 };
 #else
@@ -81,14 +92,22 @@ static const struct option longopts[] = {
 
 char *prog;
 int debug = 0;
+static double deadline = 0;
+static int targets = 0;                 /* --targets with --verbose */
 
 extern double quota_nfs_timeout;
 extern double quota_nfs_retry_timeout;
+extern char *quota_cache_dir;
+extern char *quota_nfs_transport;
+extern int quota_nfs_breaker;
+extern int quota_nfs_host_window;
+extern double quota_nfs_host_qps;
 
 int
 main(int argc, char *argv[])
 {
-    int vopt = 0, ropt = 0, lopt = 0;
+    int vopt = 0, ropt = 0, lopt = 0, mopt = 0, aopt = 0;
+    char *mountinfo = _PATH_MOUNTINFO;
     char *user = NULL;
     char *dir = NULL;
     uid_t uid;
@@ -136,6 +155,38 @@ main(int argc, char *argv[])
         case 'R':   /* --nfs-retry-timeout SECS */
             quota_nfs_retry_timeout = strtod (optarg, NULL);
             break;
+        case 'C':   /* --cache-dir DIR */
+            quota_cache_dir = optarg;
+            break;
+        case 'D':   /* --deadline SECS */
+            deadline = strtod (optarg, NULL);
+            break;
+        case 'P':   /* --nfs-transport udp|tcp */
+            if (strcmp(optarg, "udp") != 0 && strcmp(optarg, "tcp") != 0)
+                usage();
+            quota_nfs_transport = optarg;
+            break;
+        case 'B':   /* --nfs-breaker N */
+            quota_nfs_breaker = strtoul (optarg, NULL, 10);
+            break;
+        case 'w':   /* --nfs-host-window N */
+            quota_nfs_host_window = strtoul (optarg, NULL, 10);
+            break;
+        case 'Q':   /* --nfs-qps N */
+            quota_nfs_host_qps = strtod (optarg, NULL);
+            break;
+        case 'O':   /* --targets */
+            targets = 1;
+            break;
+        case 'M':   /* --mounted */
+            mopt = 1;
+            break;
+        case 'A':   /* --add-mounts */
+            mopt = aopt = 1;
+            break;
+        case 'm':   /* --mountinfo FILE */
+            mountinfo = optarg;
+            break;
         default:
             usage();
         }
@@ -144,6 +195,8 @@ main(int argc, char *argv[])
         user = xstrdup(argv[optind++]);
     if (optind < argc)
         usage();
+    if (!vopt)
+        targets = 0;
 
     if (!user)
         lookup_self(&user, &uid, &dir);
@@ -153,33 +206,40 @@ main(int argc, char *argv[])
         lookup_user_byname(user, &uid, &dir);
 
     config = conf_init(conf_path); /* exit/perror on error */
+    if (mopt)
+        conf_mounted(config, mountinfo, aopt ? CONF_ADD_MOUNTS : 0);
 
-    /* build list of quotas */
-    qlist = list_create((ListDelF)quota_destroy);
-    if (lopt)
+    if (lopt) {
+        /* build list of quotas */
+        qlist = list_create((ListDelF)quota_destroy);
         get_login_quota(config, dir, uid, qlist, !vopt);
-    else
-        get_all_quota(config, uid, qlist, !vopt);
-
-    /* print output */
-    if (vopt) {
-        quota_print_heading(user);
-        if (ropt)
-            list_for_each(qlist, (ListForF)quota_print_realpath, NULL);
-        else
-            list_for_each(qlist, (ListForF)quota_print, NULL);
+
+        /* print output */
+        if (vopt) {
+            quota_print_heading(user);
+            if (ropt)
+                list_for_each(qlist, (ListForF)quota_print_realpath, NULL);
+            else
+                list_for_each(qlist, (ListForF)quota_print, NULL);
+        } else {
+            int i = 0;
+
+            if (ropt)
+                list_for_each(qlist,
+                              (ListForF)quota_print_justwarn_realpath, &i);
+            else
+                list_for_each(qlist, (ListForF)quota_print_justwarn, &i);
+            if (i > 0)
+                printf("Run quota -v for more detailed information.\n");
+        }
+        list_destroy(qlist);
     } else {
-        int i = 0;
-
-        if (ropt)
-            list_for_each(qlist, (ListForF)quota_print_justwarn_realpath, &i);
-        else
-            list_for_each(qlist, (ListForF)quota_print_justwarn, &i);
-        if (i > 0)
-            printf("Run quota -v for more detailed information.\n");
+        /* print output as quotas arrive */
+        if (vopt)
+            quota_print_heading(user);
+        get_all_quota(config, uid, !vopt, vopt, ropt);
     }
 
-    list_destroy(qlist);
     if (user)
         free(user);
     if (dir)
@@ -192,7 +252,7 @@ main(int argc, char *argv[])
 static void
 usage(void)
 {
-    fprintf(stderr, "Usage: %s [-vlr] [-t sec] [-N sec] [-R sec] [-f conffile] [user]\n", prog);
+    fprintf(stderr, "Usage: %s [-vlrOMA] [-m mountinfo] [-t sec] [-D sec] [-N sec] [-R sec] [-P udp|tcp] [-B n] [-w n] [-Q qps] [-C dir] [-f conffile] [user]\n", prog);
     exit(1);
 }
 
@@ -221,15 +281,17 @@ static void
 lookup_user_byuid(char *user, uid_t *uidp, char **dirp)
 {
     struct passwd *pw;
-    char *endptr;
+    char *endptr, *dir;
     uid_t uid = strtoul(user, &endptr, 10);
 
     if (*endptr != '\0') {
         fprintf(stderr, "%s: error parsing uid\n", prog);
         exit(1);
     }
-    pw = getpwuid(uid);
-    if (pw) {
+    if (pwcache_init(0) == 0 && pwcache_byuid(uid, NULL, &dir) == 0) {
+        *uidp = uid;
+        *dirp = xstrdup(dir);
+    } else if ((pw = getpwuid(uid))) {
         *uidp = pw->pw_uid;
         *dirp = xstrdup(pw->pw_dir);
     /* N.B. Passwd lookup failure of numerical user arg is not fatal.
@@ -246,9 +308,14 @@ lookup_user_byuid(char *user, uid_t *uidp, char **dirp)
 static void
 lookup_user_byname(char *user, uid_t *uidp, char **dirp)
 {
-    struct passwd *pw = getpwnam(user);
+    struct passwd *pw;
+    char *dir;
 
-    if (!pw) {
+    if (pwcache_init(0) == 0 && pwcache_byname(user, uidp, &dir) == 0) {
+        *dirp = xstrdup(dir);
+        return;
+    }
+    if (!(pw = getpwnam(user))) {
         fprintf(stderr, "%s: no such user: %s\n", prog, user);
         exit(1);
     }
@@ -271,6 +338,9 @@ get_login_quota(conf_t config, char *homedir, uid_t uid, List qlist,
     if (skipnolimit && cp->cf_nolimit)
         return;
     q = quota_create(cp->cf_label, cp->cf_rhost, cp->cf_rpath, cp->cf_thresh);
+    quota_setproto(q, cp->cf_proto);
+    quota_setlimits(q, cp->cf_window, cp->cf_qps);
+    quota_settargets(q, targets);
     if (quota_get(uid, q)) {
         quota_destroy(q);
         exit(1);
@@ -278,26 +348,97 @@ get_login_quota(conf_t config, char *homedir, uid_t uid, List qlist,
     list_append(qlist, q);
 }
 
+/* State for printing get_all_quota() results in config file order
+ * as they arrive.
+ */
+struct report {
+    quota_t *qv;
+    int     *rcv;
+    char    *done;
+    int      n;
+    int      next;          /* next entry to print */
+    int      vopt;
+    int      ropt;
+    int      msgcount;
+};
+
+/* Called as each quota arrives: print it, and any later ones that arrived
+ * before it, as soon as all earlier entries are accounted for.
+ */
 static void
-get_all_quota(conf_t config, uid_t uid, List qlist, int skipnolimit)
+report_done(int i, struct report *r)
 {
-    confent_t *cp;
     quota_t q;
+
+    r->done[i] = 1;
+    while (r->next < r->n && r->done[r->next]) {
+        q = r->qv[r->next];
+        if (r->rcv[r->next] == 0) {
+            if (r->vopt && r->ropt)
+                quota_print_realpath(q, NULL);
+            else if (r->vopt)
+                quota_print(q, NULL);
+            else if (r->ropt)
+                quota_print_justwarn_realpath(q, &r->msgcount);
+            else
+                quota_print_justwarn(q, &r->msgcount);
+        }
+        r->next++;
+    }
+    fflush(stdout);
+}
+
+/* Query all quota.conf entries at once, under the --deadline if any,
+ * so the total latency is that of the slowest file system rather than
+ * the sum of all of them.
+ */
+static void
+get_all_quota(conf_t config, uid_t uid, int skipnolimit, int vopt, int ropt)
+{
+    confent_t *cp;
     conf_iterator_t itr;
+    struct report r;
+    uid_t *uids;
+    int i, n = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.vopt = vopt;
+    r.ropt = ropt;
 
     itr = conf_iterator_create(config);
+    while ((cp = conf_next(itr)) != NULL)
+        n++;
+    uids = xmalloc(sizeof(uid_t) * (n + 1));
+    r.qv = xmalloc(sizeof(quota_t) * (n + 1));
+    r.rcv = xmalloc(sizeof(int) * (n + 1));
+    r.done = xmalloc(n + 1);
+    conf_iterator_reset(itr);
     while ((cp = conf_next(itr)) != NULL) {
         if (skipnolimit && cp->cf_nolimit)
             continue;
-        q = quota_create(cp->cf_label, cp->cf_rhost, cp->cf_rpath,
-                          cp->cf_thresh);
-        if (quota_get(uid, q)) {
-            quota_destroy(q);
-            continue; /* keep going and get the rest */
-        }
-        list_append(qlist, q);
+        uids[r.n] = uid;
+        r.qv[r.n] = quota_create(cp->cf_label, cp->cf_rhost, cp->cf_rpath,
+                                 cp->cf_thresh);
+        quota_setproto(r.qv[r.n], cp->cf_proto);
+        quota_settargets(r.qv[r.n], targets);
+        quota_setlimits(r.qv[r.n++], cp->cf_window, cp->cf_qps);
     }
     conf_iterator_destroy(itr);
+    memset(r.done, 0, r.n);
+
+    /* failures are reported and skipped - keep going and get the rest */
+    (void)quota_get_many(uids, r.n, r.qv, r.rcv, deadline,
+                         (quota_done_f)report_done, &r);
+
+    if (!vopt && r.msgcount > 0)
+        printf("Run quota -v for more detailed information.\n");
+
+    for (i = 0; i < r.n; i++)
+        quota_destroy(r.qv[i]);
+    free(r.qv);
+    free(r.rcv);
+    free(r.done);
+    free(uids);
 }
 
 /*
@@ -42,30 +42,148 @@
 #include <dirent.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "src/libutil/getconf.h"
 #include "src/libutil/util.h"
 #include "src/libutil/listint.h"
+#include "src/libutil/uidset.h"
+#include "src/libutil/bqueue.h"
 
 #include "getquota.h"
+#include "hostcache.h"
+#include "dirscan.h"
+#include "pwcache.h"
+
+/* Users whose names are looked up once their quotas are in, so that
+ * only rows that are printed cost a name service lookup.  They are
+ * first looked up in the password file index (pwcache.c), which a large
+ * scan builds if need be, or without one a large batch is matched
+ * against the password file in one getpwent() pass after the scan;
+ * either is cheaper than a round trip per user where the name service
+ * can enumerate.  The rest are looked up NAME_THREADS at a time.
+ */
+#define NAME_THREADS    8
+#define NAME_PWENT_MIN  1000
+
+struct names {
+    pthread_mutex_t n_lock;
+    quota_t        *n_qv;
+    int             n_count;
+    int             n_next;
+    int             n_found;
+};
+
+/* Users found by the scans flow through stages connected by bounded
+ * queues, so that quotas are fetched while the scans are still finding
+ * users, and names looked up while quotas are still coming in:
+ *
+ *   scan -> found -> dedup -> unique -> query -> fetched -> names -> qlist
+ *
+ * Each stage has its own concurrency: the scans run in the main thread
+ * (dirscan with threads of its own), de-duplication in one thread, and
+ * the query stage hands batches of up to PIPE_BATCH users to
+ * quota_get_many(), so the NFS backend keeps its window of queries in
+ * flight; a batch is started once PIPE_LINGER seconds pass without it
+ * filling.  Names are looked up by NAME_THREADS threads.
+ */
+#define PIPE_QUEUE      65536   /* users queued between two stages */
+#define PIPE_BATCH      16384
+#define PIPE_LINGER     0.05
+
+struct cand {
+    uid_t       c_uid;
+    char       *c_name;         /* stand-in or real name, or NULL */
+    int         c_lookup;       /* c_name is a stand-in */
+    quota_t     c_quota;
+};
+
+struct stage {
+    int         s_in;
+    int         s_out;
+    double      s_done;         /* seconds from the start */
+};
+
+typedef struct {
+    confent_t  *p_conf;
+    List        p_qlist;
+    uidset_t    p_unnamed;      /* users to name, or NULL if not naming */
+    uidset_t    p_nameless;     /* users without names, if naming */
+    int         p_defer;        /* leave naming to get_names() */
+    bqueue_t    p_found;
+    bqueue_t    p_unique;
+    bqueue_t    p_fetched;
+    pthread_t   p_dedup_thread;
+    pthread_t   p_query_thread;
+    pthread_t   p_name_threads[NAME_THREADS];
+    pthread_mutex_t p_lock;     /* for the rest */
+    double      p_start;
+    struct stage p_scan;
+    struct stage p_dedup;
+    struct stage p_query;
+    struct stage p_names;
+    int         p_batches;
+    int         p_looked_up;
+    int         p_found_names;
+    int         p_from_index;
+} cand_t;
+
+/* A top-level directory, whose name stands in for its owner's if the
+ * owner has none.
+ */
+struct dirname {
+    uid_t       n_uid;
+    char       *n_name;
+};
+
+struct dirscan {
+    cand_t         *d_cands;
+    listint_t       d_uids;
+    int             d_getusername;
+    struct dirname *d_names;
+    int             d_count;
+    int             d_size;
+};
 
 static void usage(void);
-static void add_quota(confent_t *cp, List qlist, uid_t uid, char *name);
-static void dirscan(confent_t *conf, List qlist, List uids, int getusername);
-static void pwscan(confent_t *conf, List qlist, List uids, int getusername);
-static void uidscan(confent_t *conf, List qlist, List uids, int getusername);
+static void add_quota(cand_t *cands, uid_t uid, char *name, int lookup);
+static void pipe_start(cand_t *cands, confent_t *cp, List qlist,
+                       uidset_t unnamed, int large);
+static void pipe_finish(cand_t *cands);
+static int  get_all(confent_t *cp, listint_t uids, List qlist,
+                    uidset_t unnamed);
+static void get_names(List qlist, uidset_t unnamed);
+static void dirscan(confent_t *conf, cand_t *cands, listint_t uids,
+                    int getusername, int depth, struct dirscan *d);
+static void dirscan_names(struct dirscan *d, List qlist, cand_t *cands,
+                          uidset_t unnamed);
+static void pwscan(confent_t *conf, cand_t *cands, listint_t uids,
+                   int getusername);
+static void uidscan(confent_t *conf, cand_t *cands, listint_t uids,
+                    int getusername);
 
 char *prog;
 int debug = 0;
 
 extern double quota_nfs_timeout;
 extern double quota_nfs_retry_timeout;
+extern char *quota_cache_dir;
+extern int quota_nfs_window;
+extern char *quota_nfs_transport;
+extern int quota_nfs_breaker;
+extern int quota_nfs_host_window;
+extern double quota_nfs_host_qps;
+extern int quota_lustre_depth;
 
-#define OPTIONS "u:b:dHrsFf:UpTDnhN:R:"
+#define OPTIONS "u:b:ade:HrsFf:UpTDnhN:R:C:W:P:B:w:Q:j:"
 #if HAVE_GETOPT_LONG
 #define GETOPT(ac,av,opt,lopt) getopt_long(ac,av,opt,lopt,NULL)
 static const struct option longopts[] = {
+    {"all",              no_argument,        0, 'a'},
     {"dirscan",          no_argument,        0, 'd'},
+    {"dirscan-depth",    required_argument,  0, 'e'},
     {"pwscan",           no_argument,        0, 'p'},
     {"blocksize",        required_argument,  0, 'b'},
     {"uid-range",        required_argument,  0, 'u'},
@@ -81,6 +199,13 @@ static const struct option longopts[] = {
     {"human-readable",   no_argument,        0, 'h'},
     {"nfs-timeout",      required_argument,  0, 'N'},
     {"nfs-retry-timeout",required_argument,  0, 'R'},
+    {"cache-dir",        required_argument,  0, 'C'},
+    {"nfs-window",       required_argument,  0, 'W'},
+    {"nfs-transport",    required_argument,  0, 'P'},
+    {"nfs-breaker",      required_argument,  0, 'B'},
+    {"nfs-host-window",  required_argument,  0, 'w'},
+    {"nfs-qps",          required_argument,  0, 'Q'},
+    {"lustre-depth",     required_argument,  0, 'j'},
 
     {0, 0, 0, 0},
 };
@@ -93,7 +218,9 @@ main(int argc, char *argv[])
 {
     confent_t *conf;
     int c;
+    int aopt = 0;
     int dopt = 0;
+    int depth = 1;
     int popt = 0;
     unsigned long bsize = 1024*1024;
     char *fsname = NULL;
@@ -105,15 +232,30 @@ main(int argc, char *argv[])
     int Uopt = 0;
     int nopt = 0;
     int hopt = 0;
-    List uids = NULL;
+    listint_t uids = NULL;
     char *conf_path = _PATH_QUOTA_CONF;
+    char *endptr;
     conf_t config;
+    cand_t cands;
+    struct dirscan dscan;
+    uidset_t unnamed = NULL;
 
     prog = basename(argv[0]);
     while ((c = GETOPT(argc, argv, OPTIONS, longopts)) != EOF) {
         switch(c) {
+            case 'a':   /* --all */
+                aopt++;
+                break;
             case 'd':   /* --dirscan */
-                dopt++;
+                dopt = 1;
+                break;
+            case 'e':   /* --dirscan-depth N (implies -d) */
+                dopt = 1;
+                depth = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || depth < 1) {
+                    fprintf(stderr, "%s: error parsing dirscan depth\n", prog);
+                    exit(1);
+                }
                 break;
             case 'p':   /* --pwscan */
                 popt++;
@@ -173,6 +315,29 @@ main(int argc, char *argv[])
             case 'R':   /* --nfs-retry-timeout SECS */
                 quota_nfs_retry_timeout = strtod (optarg, NULL);
                 break;
+            case 'C':   /* --cache-dir DIR */
+                quota_cache_dir = optarg;
+                break;
+            case 'W':   /* --nfs-window N */
+                quota_nfs_window = strtoul (optarg, NULL, 10);
+                break;
+            case 'P':   /* --nfs-transport udp|tcp */
+                if (strcmp(optarg, "udp") != 0 && strcmp(optarg, "tcp") != 0)
+                    usage();
+                quota_nfs_transport = optarg;
+                break;
+            case 'B':   /* --nfs-breaker N */
+                quota_nfs_breaker = strtoul (optarg, NULL, 10);
+                break;
+            case 'w':   /* --nfs-host-window N */
+                quota_nfs_host_window = strtoul (optarg, NULL, 10);
+                break;
+            case 'Q':   /* --nfs-qps N */
+                quota_nfs_host_qps = strtod (optarg, NULL);
+                break;
+            case 'j':   /* --lustre-depth N */
+                quota_lustre_depth = strtoul (optarg, NULL, 10);
+                break;
             default:
                 usage();
         }
@@ -181,12 +346,12 @@ main(int argc, char *argv[])
         fprintf(stderr, "%s: -f and -s are mutually exclusive\n", prog);
         exit(1);
     }
-    if (popt && dopt) {
-        fprintf(stderr, "%s: -p and -d are mutually exclusive\n", prog);
+    if (popt + dopt + aopt > 1) {
+        fprintf(stderr, "%s: -a, -p and -d are mutually exclusive\n", prog);
         exit(1);
     }
-    if (!popt && !dopt && !uids) {
-        fprintf(stderr, "%s: need at least one of -pdu\n", prog);
+    if (!aopt && !popt && !dopt && !uids) {
+        fprintf(stderr, "%s: need at least one of -apdu\n", prog);
         exit(1);
     }
     if (optind < argc)
@@ -202,16 +367,31 @@ main(int argc, char *argv[])
         exit(1);
     }
 
-    /* Scan.
+    /* Scan and query.
      */
     qlist = list_create((ListDelF)quota_destroy);
-    if (popt)
-        pwscan(conf, qlist, uids, !nopt);
-    if (dopt)
-        dirscan(conf, qlist, uids, !nopt);
-    if (!dopt && !popt)
-        uidscan(conf, qlist, uids, !nopt);
-
+    if (!nopt)
+        unnamed = uidset_create();
+    if (aopt && get_all(conf, uids, qlist, unnamed) < 0) {
+        fprintf(stderr, "%s: %s: can't list quota records, "
+                "scanning the password file\n", prog, fsname);
+        popt = 1;
+    }
+    if (popt || dopt || !aopt) {
+        pipe_start(&cands, conf, qlist, unnamed, popt || dopt
+                   || (uids && listint_count(uids) >= NAME_PWENT_MIN));
+        if (popt)
+            pwscan(conf, &cands, uids, !nopt);
+        if (dopt)
+            dirscan(conf, &cands, uids, !nopt, depth, &dscan);
+        if (!aopt && !dopt && !popt)
+            uidscan(conf, &cands, uids, !nopt);
+        pipe_finish(&cands);
+        if (dopt)
+            dirscan_names(&dscan, qlist, &cands, unnamed);
+        if (cands.p_nameless)
+            uidset_destroy(cands.p_nameless);
+    }
 
     /* Sort.
      */
@@ -231,6 +411,13 @@ main(int argc, char *argv[])
             list_sort(qlist, (ListCmpF)quota_cmp_uid);
     }
 
+    /* Name the users the pipeline didn't.
+     */
+    if (unnamed) {
+        get_names(qlist, unnamed);
+        uidset_destroy(unnamed);
+    }
+
     /* Report.
      */
     if (!Hopt) {
@@ -273,10 +460,14 @@ usage(void)
 {
     fprintf(stderr,
   "Usage: %s [--options] fs\n"
+  "  -a,--all               report on users with quota records on fs\n"
+  "                         (or in the password file if fs can't list them)\n"
   "  -d,--dirscan           report on users who own top level dirs of fs\n"
+  "  -e,--dirscan-depth=N   ... or dirs up to N levels deep (1 default)\n"
   "  -p,--pwscan            report on users in the password file\n"
   "  -b,--blocksize         report usage in blocksize units (default 1M)\n"
   "  -u,--uid-range         set range/list of uid's to include in report\n"
+  "                         (@file reads the list from file)\n"
   "  -r,--reverse-sort      sort in reverse order\n"
   "  -s,--space-sort        sort on space used (default sort on uid)\n"
   "  -F,--files-sort        sort on files used (default sort on uid)\n"
@@ -287,111 +478,615 @@ usage(void)
   "  -f,--config            use a config file other than %s\n"
   "  -N,--nfs-timeout=SEC   set per filesystem NFS timeout (%.2fs default)\n"
   "  -R,--nfs-retry-timeout=SEC    set NFS retry timeout (%.2fs default)\n"
+  "  -C,--cache-dir=DIR     cache NFS server addresses in DIR (%s default)\n"
+  "  -W,--nfs-window=N      keep up to N NFS queries in flight in all\n"
+  "                         (default: the sum of the per server limits)\n"
+  "  -w,--nfs-host-window=N keep up to N NFS queries in flight per server,\n"
+  "                         overriding quota.conf (%d default)\n"
+  "  -Q,--nfs-qps=N         start at most N NFS queries/sec per server,\n"
+  "                         overriding quota.conf (default no limit)\n"
+  "  -P,--nfs-transport=udp|tcp   query NFS servers over udp or tcp,\n"
+  "                         overriding quota.conf (default udp)\n"
+  "  -B,--nfs-breaker=N     skip a server after N consecutive timeouts\n"
+  "                         (%d default, 0 never)\n"
+  "  -j,--lustre-depth=N    keep up to N Lustre quotactls in flight,\n"
+  "                         overriding quota.conf (%d default)\n"
                 , prog, _PATH_QUOTA_CONF,
                 quota_nfs_timeout,
-                quota_nfs_retry_timeout);
+                quota_nfs_retry_timeout,
+                _PATH_QUOTA_CACHEDIR,
+                QUOTA_NFS_HOST_WINDOW,
+                quota_nfs_breaker,
+                QUOTA_LUSTRE_DEPTH);
     exit(1);
 }
 
-/* Query the quota for uid and add it to qlist if successful.
+/* Add uid to the users whose quota will be queried, under name.  If
+ * lookup is set and names are wanted, name is a stand-in for the real
+ * name, which is looked up later.
+ */
+static void
+add_quota(cand_t *cands, uid_t uid, char *name, int lookup)
+{
+    struct cand *c = xmalloc(sizeof(struct cand));
+
+    c->c_uid = uid;
+    c->c_name = name ? xstrdup(name) : NULL;
+    c->c_lookup = lookup && cands->p_unnamed;
+    c->c_quota = NULL;
+    cands->p_scan.s_out++;
+    bqueue_push(cands->p_found, c);
+}
+
+static void
+free_cand(struct cand *c)
+{
+    if (c->c_name)
+        free(c->c_name);
+    free(c);
+}
+
+static void
+stage_done(cand_t *cands, struct stage *st)
+{
+    pthread_mutex_lock(&cands->p_lock);
+    st->s_done = monotime() - cands->p_start;
+    pthread_mutex_unlock(&cands->p_lock);
+}
+
+/* Drop users already seen.
+ */
+static void *
+dedup_stage(void *arg)
+{
+    cand_t *cands = arg;
+    uidset_t seen = uidset_create();
+    void *v[256];
+    int i, n;
+
+    while ((n = bqueue_pop(cands->p_found, v, 256, 0)) > 0) {
+        for (i = 0; i < n; i++) {
+            struct cand *c = v[i];
+
+            cands->p_dedup.s_in++;
+            if (uidset_add(seen, c->c_uid)) {
+                cands->p_dedup.s_out++;
+                bqueue_push(cands->p_unique, c);
+            } else
+                free_cand(c);
+        }
+    }
+    uidset_destroy(seen);
+    bqueue_close(cands->p_unique);
+    stage_done(cands, &cands->p_dedup);
+    return NULL;
+}
+
+struct query_batch {
+    cand_t         *b_cands;
+    struct cand   **b_cv;
+    int            *b_rcv;
+};
+
+/* Pass each quota on to the name stage as soon as it is in.
+ */
+static void
+query_done(int i, void *arg)
+{
+    struct query_batch *b = arg;
+
+    if (b->b_rcv[i] == 0) {
+        b->b_cands->p_query.s_out++;
+        bqueue_push(b->b_cands->p_fetched, b->b_cv[i]);
+    }
+}
+
+/* Query quotas a batch at a time.
+ */
+static void *
+query_stage(void *arg)
+{
+    cand_t *cands = arg;
+    confent_t *cp = cands->p_conf;
+    struct query_batch b;
+    struct cand **cv = xmalloc(sizeof(struct cand *) * PIPE_BATCH);
+    uid_t *uids = xmalloc(sizeof(uid_t) * PIPE_BATCH);
+    quota_t *qv = xmalloc(sizeof(quota_t) * PIPE_BATCH);
+    int *rcv = xmalloc(sizeof(int) * PIPE_BATCH);
+    int i, n;
+
+    b.b_cands = cands;
+    b.b_cv = cv;
+    b.b_rcv = rcv;
+    while ((n = bqueue_pop(cands->p_unique, (void **)cv, PIPE_BATCH,
+                           PIPE_LINGER)) > 0) {
+        for (i = 0; i < n; i++) {
+            uids[i] = cv[i]->c_uid;
+            qv[i] = cv[i]->c_quota = quota_create(cp->cf_label, cp->cf_rhost,
+                                                  cp->cf_rpath, cp->cf_thresh);
+            quota_setproto(qv[i], cp->cf_proto);
+            quota_setlimits(qv[i], cp->cf_window, cp->cf_qps);
+        }
+        cands->p_query.s_in += n;
+        cands->p_batches++;
+        (void)quota_get_many(uids, n, qv, rcv, 0, query_done, &b);
+        for (i = 0; i < n; i++) {
+            if (rcv[i] != 0) {
+                quota_destroy(qv[i]);
+                free_cand(cv[i]);
+            }
+        }
+    }
+    free(cv);
+    free(uids);
+    free(qv);
+    free(rcv);
+    bqueue_close(cands->p_fetched);
+    stage_done(cands, &cands->p_query);
+    return NULL;
+}
+
+/* Name users and add their quotas to the report.
+ */
+static void *
+name_stage(void *arg)
+{
+    cand_t *cands = arg;
+    struct passwd pwd, *pw;
+    size_t len = 16384;
+    char *buf = xmalloc(len), *name;
+    struct cand *c;
+    void *v[16];
+    int i, n, rc, found, index;
+
+    while ((n = bqueue_pop(cands->p_fetched, v, 16, 0)) > 0) {
+        for (i = 0; i < n; i++) {
+            c = v[i];
+            found = index = 0;
+            if (c->c_name)
+                quota_adduser(c->c_quota, c->c_name);
+            if (c->c_lookup && !cands->p_defer) {
+                if (pwcache_byuid(c->c_uid, &name, NULL) == 0) {
+                    quota_adduser(c->c_quota, name);
+                    found = index = 1;
+                } else {
+                    while ((rc = getpwuid_r(c->c_uid, &pwd, buf, len, &pw))
+                                                                == ERANGE)
+                        buf = xrealloc(buf, len *= 2);
+                    if (rc == 0 && pw) {
+                        quota_adduser(c->c_quota, pw->pw_name);
+                        found = 1;
+                    }
+                }
+            }
+            pthread_mutex_lock(&cands->p_lock);
+            if (c->c_lookup && cands->p_defer)
+                uidset_add(cands->p_unnamed, c->c_uid);
+            else if (c->c_lookup) {
+                if (!found)
+                    uidset_add(cands->p_nameless, c->c_uid);
+                cands->p_looked_up++;
+                cands->p_found_names += found;
+                cands->p_from_index += index;
+            }
+            cands->p_names.s_in++;
+            list_append(cands->p_qlist, c->c_quota);
+            pthread_mutex_unlock(&cands->p_lock);
+            c->c_quota = NULL;
+            free_cand(c);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Start the stages after the scan.  Quotas end up in qlist.  Names are
+ * looked up as they come in, unless the scan is large and there is no
+ * password file index, in which case the users are left in unnamed.
+ */
+static void
+pipe_start(cand_t *cands, confent_t *cp, List qlist, uidset_t unnamed,
+           int large)
+{
+    int i;
+
+    memset(cands, 0, sizeof(*cands));
+    cands->p_conf = cp;
+    cands->p_qlist = qlist;
+    cands->p_unnamed = unnamed;
+    if (unnamed) {
+        cands->p_nameless = uidset_create();
+        cands->p_defer = (pwcache_init(large) < 0 && large);
+    }
+    cands->p_found = bqueue_create(PIPE_QUEUE);
+    cands->p_unique = bqueue_create(PIPE_QUEUE);
+    cands->p_fetched = bqueue_create(PIPE_QUEUE);
+    pthread_mutex_init(&cands->p_lock, NULL);
+    cands->p_start = monotime();
+    if (pthread_create(&cands->p_dedup_thread, NULL, dedup_stage, cands) != 0
+            || pthread_create(&cands->p_query_thread, NULL, query_stage,
+                              cands) != 0) {
+        fprintf(stderr, "%s: pthread_create: %m\n", prog);
+        exit(1);
+    }
+    for (i = 0; i < NAME_THREADS; i++) {
+        if (pthread_create(&cands->p_name_threads[i], NULL, name_stage,
+                           cands) != 0) {
+            fprintf(stderr, "%s: pthread_create: %m\n", prog);
+            exit(1);
+        }
+    }
+}
+
+static void
+queue_stats(char *name, bqueue_t q)
+{
+    struct bqueue_stats st;
+
+    bqueue_stats(q, &st);
+    printf("queue: %s: %lu users, peak %d of %d, "
+           "%.3fs waiting for room, %.3fs waiting for users\n",
+           name, st.s_items, st.s_peak, st.s_max, st.s_full, st.s_empty);
+}
+
+static double
+rate(int n, double t)
+{
+    return t > 0 ? n / t : 0;
+}
+
+/* End the scan and wait for the stages to drain.
  */
 static void
-add_quota(confent_t *cp, List qlist, uid_t uid, char *name)
+pipe_finish(cand_t *cands)
+{
+    int i;
+
+    stage_done(cands, &cands->p_scan);
+    bqueue_close(cands->p_found);
+    pthread_join(cands->p_dedup_thread, NULL);
+    pthread_join(cands->p_query_thread, NULL);
+    for (i = 0; i < NAME_THREADS; i++)
+        pthread_join(cands->p_name_threads[i], NULL);
+    stage_done(cands, &cands->p_names);
+    if (debug) {
+        printf("stage: scan: %d users in %.3fs (%.0f/s)\n",
+               cands->p_scan.s_out, cands->p_scan.s_done,
+               rate(cands->p_scan.s_out, cands->p_scan.s_done));
+        printf("stage: dedup: %d users, %d unique, done at %.3fs\n",
+               cands->p_dedup.s_in, cands->p_dedup.s_out,
+               cands->p_dedup.s_done);
+        printf("stage: query: %d quotas (%d failed) in %d batches, "
+               "done at %.3fs (%.0f/s)\n", cands->p_query.s_in,
+               cands->p_query.s_in - cands->p_query.s_out, cands->p_batches,
+               cands->p_query.s_done,
+               rate(cands->p_query.s_in, cands->p_query.s_done));
+        printf("stage: names: %d rows, done at %.3fs\n",
+               cands->p_names.s_in, cands->p_names.s_done);
+        queue_stats("found", cands->p_found);
+        queue_stats("unique", cands->p_unique);
+        queue_stats("fetched", cands->p_fetched);
+        if (cands->p_unnamed && !cands->p_defer)
+            printf("names: %d of %d found (%d from index) in %.3fs\n",
+                   cands->p_found_names, cands->p_looked_up,
+                   cands->p_from_index, cands->p_names.s_done);
+    }
+    bqueue_destroy(cands->p_found);
+    bqueue_destroy(cands->p_unique);
+    bqueue_destroy(cands->p_fetched);
+    pthread_mutex_destroy(&cands->p_lock);
+}
+
+/* Get the quotas of all users with quota records, optionally filtered
+ * by uids, straight from the file system.  Returns -1 if it can't list
+ * them.  If unnamed is set, the users' names are to be looked up.
+ */
+static int
+get_all(confent_t *cp, listint_t uids, List qlist, uidset_t unnamed)
 {
     quota_t q;
+    ListIterator itr;
+    char name[32];
+    int n;
 
-    if (list_find_first(qlist, (ListFindF)quota_match_uid, &uid))
-        return;
     q = quota_create(cp->cf_label, cp->cf_rhost, cp->cf_rpath, cp->cf_thresh);
-    if (quota_get(uid, q)) {
-        quota_destroy(q);
-        return;
+    n = quota_get_all(q, uids, qlist);
+    quota_destroy(q);
+    if (n > 0 && unnamed) {
+        itr = list_iterator_create(qlist);
+        while ((q = list_next(itr))) {
+            snprintf (name, sizeof(name), "[%lu]",
+                      (unsigned long)quota_uid(q));
+            quota_adduser(q, name);
+            uidset_add(unnamed, quota_uid(q));
+        }
+        list_iterator_destroy(itr);
     }
-    if (name)
-        quota_adduser (q, name);
-    list_append(qlist, q);
+    return n;
 }
 
-/* Get quotas for all uid's in uids list.
+/* Get quotas for all uid's in uids list, walking its ranges in order.
  */
 static void
-uidscan(confent_t *cp, List qlist, List uids, int getusername)
+uidscan(confent_t *cp, cand_t *cands, listint_t uids, int getusername)
 {
-    struct passwd *pw;
-    ListIterator itr;
-    quota_t q;
-    unsigned long *up;
-    int rc;
+    listint_iterator_t itr;
+    unsigned long u;
     char name[32];
 
-    itr = list_iterator_create(uids);
-    while ((up = list_next(itr))) {
+    itr = listint_iterator_create(uids);
+    while (listint_next(itr, &u)) {
         if (getusername) {
-            if ((pw = getpwuid ((uid_t)*up)))
-                snprintf (name, sizeof(name), "%s", pw->pw_name);
-            else
-                snprintf (name, sizeof(name), "[%lu]", *up);
-            add_quota(cp, qlist, pw->pw_uid, name);
+            snprintf (name, sizeof(name), "[%lu]", u);
+            add_quota(cands, (uid_t)u, name, 1);
         } else
-            add_quota(cp, qlist, (uid_t)*up, NULL);
+            add_quota(cands, (uid_t)u, NULL, 0);
     }
-    list_iterator_destroy(itr);
+    listint_iterator_destroy(itr);
 }
 
-/* Get quotas for all owners of top-level directories, optionally
- * filtered by uids.
- */
 static void
-dirscan(confent_t *cp, List qlist, List uids, int getusername)
+dirscan_one(uid_t uid, char *dname, void *arg)
 {
-    struct passwd *pw;
-    struct dirent *dp;
-    DIR *dir;
-    char fqp[MAXPATHLEN];
-    struct stat sb;
-    quota_t q;
+    struct dirscan *d = arg;
     char name[32];
 
-    if (!(dir = opendir(cp->cf_rpath))) {
+    if (d->d_uids && !listint_member(d->d_uids, uid))
+        return;
+    if (d->d_getusername) {
+        if (dname) {
+            if (d->d_count == d->d_size) {
+                d->d_size = d->d_size ? d->d_size * 2 : 256;
+                d->d_names = xrealloc(d->d_names,
+                                      sizeof(struct dirname) * d->d_size);
+            }
+            d->d_names[d->d_count].n_uid = uid;
+            d->d_names[d->d_count++].n_name = xstrdup(dname);
+        }
+        snprintf (name, sizeof(name), "[%lu]", (unsigned long)uid);
+        add_quota(d->d_cands, uid, name, 1);
+    } else
+        add_quota(d->d_cands, uid, NULL, 0);
+}
+
+static int
+cmp_dirname(const void *a, const void *b)
+{
+    const struct dirname *x = a, *y = b;
+
+    if (x->n_uid != y->n_uid)
+        return x->n_uid < y->n_uid ? -1 : 1;
+    return strcmp(x->n_name, y->n_name);
+}
+
+static int
+cmp_dirname_uid(const void *a, const void *b)
+{
+    const struct dirname *x = a, *y = b;
+
+    return x->n_uid < y->n_uid ? -1 : x->n_uid > y->n_uid ? 1 : 0;
+}
+
+/* Get quotas for all owners of directories down to depth levels,
+ * optionally filtered by uids.  The names of the top-level directories
+ * are kept in d for dirscan_names().
+ */
+static void
+dirscan(confent_t *cp, cand_t *cands, listint_t uids, int getusername,
+        int depth, struct dirscan *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->d_cands = cands;
+    d->d_uids = uids;
+    d->d_getusername = getusername;
+    if (dirscan_walk(cp->cf_rpath, depth, dirscan_one, d) < 0) {
         fprintf(stderr, "%s: could not open %s\n", prog, cp->cf_rpath);
         exit(1);
     }
-    while ((dp = readdir(dir))) {
-        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
-            continue;
-        snprintf(fqp, sizeof(fqp), "%s/%s", cp->cf_rpath, dp->d_name);
-        if (stat(fqp, &sb) < 0)
-            continue;
-        if (uids && !listint_member(uids, sb.st_uid))
-            continue;
-        if (getusername) {
-            if ((pw = getpwuid(sb.st_uid)))
-                snprintf (name, sizeof(name), "%s", pw->pw_name);
-            else
-                snprintf (name, sizeof(name), "[%.*s]",
-                          (int)sizeof (name) - 3, dp->d_name);
-            add_quota(cp, qlist, sb.st_uid, name);
-        } else
-            add_quota(cp, qlist, sb.st_uid, NULL);
+}
+
+/* Show a user without a name by the first, in sorted order, of the
+ * top-level directories they own, or by uid if they own none (-e).
+ * The users still to be named by get_names() get the stand-in too, in
+ * case it doesn't find them either.  Frees d's names.
+ */
+static void
+dirscan_names(struct dirscan *d, List qlist, cand_t *cands, uidset_t unnamed)
+{
+    struct dirname key, *n;
+    ListIterator itr;
+    quota_t q;
+    char name[32];
+    int i;
+
+    if (d->d_count > 0) {
+        qsort(d->d_names, d->d_count, sizeof(struct dirname), cmp_dirname);
+        itr = list_iterator_create(qlist);
+        while ((q = list_next(itr))) {
+            key.n_uid = quota_uid(q);
+            if (!uidset_member(cands->p_nameless, key.n_uid)
+                        && !uidset_member(unnamed, key.n_uid))
+                continue;
+            if (!(n = bsearch(&key, d->d_names, d->d_count,
+                              sizeof(struct dirname), cmp_dirname_uid)))
+                continue;
+            while (n > d->d_names && n[-1].n_uid == key.n_uid)
+                n--;
+            snprintf (name, sizeof(name), "[%.*s]",
+                      (int)sizeof (name) - 3, n->n_name);
+            quota_adduser(q, name);
+        }
+        list_iterator_destroy(itr);
     }
-    if (closedir(dir) < 0)
-        fprintf(stderr, "%s: closedir %s: %m\n", prog, cp->cf_rpath);
+    for (i = 0; i < d->d_count; i++)
+        free(d->d_names[i].n_name);
+    free(d->d_names);
+}
+
+struct pwscan {
+    cand_t     *p_cands;
+    listint_t   p_uids;
+    int         p_getusername;
+};
+
+static void
+pwscan_one(uid_t uid, char *name, void *arg)
+{
+    struct pwscan *p = arg;
+
+    if (p->p_uids && !listint_member(p->p_uids, uid))
+        return;
+    add_quota(p->p_cands, uid, p->p_getusername ? name : NULL, 0);
 }
 
 /* Get quotas for all users in the password file, optionally filtered
- * by uids list.
+ * by uids list.  The password file index is used if there is one.
  */
 static void
-pwscan(confent_t *cp, List qlist, List uids, int getusername)
+pwscan(confent_t *cp, cand_t *cands, listint_t uids, int getusername)
 {
+    struct pwscan p = { cands, uids, getusername };
     struct passwd *pw;
-    quota_t q;
 
+    if (pwcache_init(1) == 0 && pwcache_for_each(pwscan_one, &p) == 0)
+        return;
+    while ((pw = getpwent()) != NULL)
+        pwscan_one(pw->pw_uid, pw->pw_name, &p);
+}
+
+static int
+cmp_quota_uid(quota_t *x, quota_t *y)
+{
+    return quota_cmp_uid(*x, *y);
+}
+
+/* Match names from one pass over the password file to the users in
+ * qv (n of them, sorted by uid), marking those found in done.
+ */
+static int
+names_pwent(quota_t *qv, int n, char *done)
+{
+    struct passwd *pw;
+    int lo, hi, mid, found = 0;
+
+    setpwent();
     while ((pw = getpwent()) != NULL) {
-        if (uids && !listint_member(uids, pw->pw_uid))
-            continue;
-        add_quota(cp, qlist, pw->pw_uid, getusername ? pw->pw_name : NULL);
+        lo = 0;
+        hi = n - 1;
+        while (lo <= hi) {
+            mid = lo + (hi - lo) / 2;
+            if (pw->pw_uid < quota_uid(qv[mid]))
+                hi = mid - 1;
+            else if (pw->pw_uid > quota_uid(qv[mid]))
+                lo = mid + 1;
+            else {
+                if (!done[mid]) {
+                    quota_adduser(qv[mid], pw->pw_name);
+                    done[mid] = 1;
+                    found++;
+                }
+                break;
+            }
+        }
+    }
+    endpwent();
+    return found;
+}
+
+static void *
+names_worker(void *arg)
+{
+    struct names *n = arg;
+    struct passwd pwd, *pw;
+    size_t len = 16384;
+    char *buf = xmalloc(len);
+    quota_t q;
+    int i, rc;
+
+    pthread_mutex_lock(&n->n_lock);
+    while ((i = n->n_next) < n->n_count) {
+        n->n_next++;
+        pthread_mutex_unlock(&n->n_lock);
+        q = n->n_qv[i];
+        while ((rc = getpwuid_r(quota_uid(q), &pwd, buf, len, &pw)) == ERANGE)
+            buf = xrealloc(buf, len *= 2);
+        if (rc == 0 && pw)
+            quota_adduser(q, pw->pw_name);
+        pthread_mutex_lock(&n->n_lock);
+        if (rc == 0 && pw)
+            n->n_found++;
+    }
+    pthread_mutex_unlock(&n->n_lock);
+    free(buf);
+    return NULL;
+}
+
+/* Look up the names of the users in qlist that are in unnamed.  Those
+ * without one keep their stand-in names.
+ */
+static void
+get_names(List qlist, uidset_t unnamed)
+{
+    struct names n;
+    pthread_t t[NAME_THREADS];
+    ListIterator itr;
+    quota_t q, *qv;
+    char *done, *name, *src = "getpwent";
+    double t0 = monotime();
+    int i, j, nt = 0, total, pwent = 0;
+
+    qv = xmalloc(sizeof(quota_t) * (list_count(qlist) + 1));
+    total = 0;
+    itr = list_iterator_create(qlist);
+    while ((q = list_next(itr)))
+        if (uidset_member(unnamed, quota_uid(q)))
+            qv[total++] = q;
+    list_iterator_destroy(itr);
+    if (total == 0) {
+        free(qv);
+        return;
+    }
+
+    /* what the password file doesn't have is looked up one by one */
+    if (pwcache_init(total >= NAME_PWENT_MIN) == 0) {
+        src = "index";
+        for (i = j = 0; i < total; i++) {
+            if (pwcache_byuid(quota_uid(qv[i]), &name, NULL) == 0) {
+                quota_adduser(qv[i], name);
+                pwent++;
+            } else
+                qv[j++] = qv[i];
+        }
+    } else if (total >= NAME_PWENT_MIN) {
+        done = xmalloc(total);
+        memset(done, 0, total);
+        qsort(qv, total, sizeof(quota_t),
+              (int (*)(const void *, const void *))cmp_quota_uid);
+        pwent = names_pwent(qv, total, done);
+        for (i = j = 0; i < total; i++)
+            if (!done[i])
+                qv[j++] = qv[i];
+        free(done);
+    } else
+        j = total;
+
+    memset(&n, 0, sizeof(n));
+    pthread_mutex_init(&n.n_lock, NULL);
+    n.n_qv = qv;
+    n.n_count = j;
+    while (nt < NAME_THREADS - 1 && nt < j - 1) {
+        if (pthread_create(&t[nt], NULL, names_worker, &n) != 0)
+            break;
+        nt++;
     }
+    names_worker(&n);
+    for (i = 0; i < nt; i++)
+        pthread_join(t[i], NULL);
+    pthread_mutex_destroy(&n.n_lock);
+    free(qv);
+    if (debug)
+        printf("names: %d of %d found (%d from %s) in %.3fs\n",
+               n.n_found + pwent, total, pwent, src, monotime() - t0);
 }
 
 /*
@@ -27,6 +27,7 @@
 #endif
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/param.h>
@@ -89,7 +90,7 @@ int main(int argc, char **argv)
     uid_t uid = geteuid ();
     uid_t gid = getegid ();
     CLIENT *cl;
-    getquota_rslt *result;
+    getquota_rslt res, *result = &res;
     getquota_args args;
     char localhost[MAXHOSTNAMELEN + 1];
     char *host;
@@ -135,7 +136,8 @@ int main(int argc, char **argv)
         die ("authunix_create");
     args.gqa_pathp = filesystem;
     args.gqa_uid = uid;
-    if (!(result = rquotaproc_getquota_1 (&args, cl)))
+    memset (&res, 0, sizeof (res));
+    if (rquotaproc_getquota_1 (&args, &res, cl) != RPC_SUCCESS)
         die ("%s", clnt_sperror (cl, host));
     if (result->gqr_status == Q_NOQUOTA)
         die ("No quota");
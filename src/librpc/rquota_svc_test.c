@@ -25,58 +25,210 @@
 #include "config.h"
 #endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <rpc/pmap_clnt.h>
 #include "rquota.h"
 
-/* TODO: Server implementation for testing
+/* Stand-in rquotad for testing.
+ *
+ * Replies are a function of the uid so clients can check that each
+ * reply was matched to the right request:  1K blocks, uid*10 blocks
+ * used against a 2000/3000 block soft/hard limit, uid files used and
+ * no file limits.  Some paths trigger special behavior:
+ *   drop      no response
+ *   exit      server exits
+ *   noquota   Q_NOQUOTA
+ *   eperm     Q_EPERM
+ * The server listens on UDP and TCP.  With --loss, a percentage of UDP
+ * requests is ignored at random to mimic a lossy network.  With --stall,
+ * the server sleeps for 50ms before a percentage of its replies, holding
+ * up everything behind them, like a busy single threaded rquotad.
  */
 
-void rquota_bump (struct rquota *rq)
+extern void rquotaprog_1(struct svc_req *rqstp, SVCXPRT *transp);
+
+static const char *prog = "rquota_svc_test";
+static int quiet = 0;
+static int loss = 0;
+static int stall = 0;
+static SVCXPRT *udp_transp = NULL;
+
+static bool_t
+getquota(getquota_args *args, getquota_rslt *res, struct svc_req *req,
+         const char *func)
 {
-    rq->rq_bsize++;
-    rq->rq_active++;
+    struct rquota *rq = &res->getquota_rslt_u.gqr_rquota;
 
-    rq->rq_bhardlimit++;
-    rq->rq_bsoftlimit++;
-    rq->rq_curblocks++;
+    if (!quiet)
+        fprintf (stderr, "%s: uid=%d path=%s\n", func,
+                 args->gqa_uid, args->gqa_pathp);
+    if (!(strcmp (args->gqa_pathp, "drop")))
+        return FALSE; // no response
+    if (loss > 0 && req->rq_xprt == udp_transp && random () % 100 < loss)
+        return FALSE;
+    if (!(strcmp (args->gqa_pathp, "exit")))
+        exit (0);
+    if (stall > 0 && random () % 100 < stall)
+        usleep (50000);
+    memset (res, 0, sizeof (*res));
+    if (!(strcmp (args->gqa_pathp, "noquota"))) {
+        res->gqr_status = Q_NOQUOTA;
+        return TRUE;
+    }
+    if (!(strcmp (args->gqa_pathp, "eperm"))) {
+        res->gqr_status = Q_EPERM;
+        return TRUE;
+    }
+    res->gqr_status = Q_OK;
+    rq->rq_bsize = 1024;
+    rq->rq_active = TRUE;
+    rq->rq_bsoftlimit = 2000;
+    rq->rq_bhardlimit = 3000;
+    rq->rq_curblocks = args->gqa_uid * 10;
+    rq->rq_curfiles = args->gqa_uid;
+    return TRUE;
+}
 
-    rq->rq_fhardlimit++;
-    rq->rq_fsoftlimit++;
-    rq->rq_curfiles++;
+bool_t rquotaproc_getquota_1_svc(getquota_args *args, getquota_rslt *res,
+                                 struct svc_req *req)
+{
+    return getquota (args, res, req, __FUNCTION__);
+}
 
-    rq->rq_btimeleft++;
-    rq->rq_ftimeleft++;
+bool_t rquotaproc_getactivequota_1_svc(getquota_args *args,
+                                       getquota_rslt *res,
+                                       struct svc_req *req)
+{
+    return getquota (args, res, req, __FUNCTION__);
 }
 
-getquota_rslt *rquotaproc_getquota_1_svc(getquota_args *args,
-					 struct svc_req *req)
+int rquotaprog_1_freeresult (SVCXPRT *transp, xdrproc_t xdr_result,
+                             caddr_t result)
 {
-    static getquota_rslt res;
+    xdr_free (xdr_result, result);
+    return 1;
+}
 
-    fprintf (stderr, "%s: uid=%d path=%s\n", __FUNCTION__,
-             args->gqa_uid, args->gqa_pathp);
-    if (!(strcmp (args->gqa_pathp, "drop")))
-        return NULL; // no response
-    if (!(strcmp (args->gqa_pathp, "exit")))
-        exit (0);
-    res.gqr_status = Q_OK;
-    rquota_bump (&res.getquota_rslt_u.gqr_rquota);
-    return &res;
+static void die (const char *msg)
+{
+    fprintf (stderr, "%s: %s\n", prog, msg);
+    exit (1);
+}
+
+static void usage (void)
+{
+    fprintf (stderr, "Usage: %s [-q] [-p port] [-l percent] [-s percent]\n", prog);
+    exit (1);
+}
+
+/* Bind a socket of the given type to the loopback address.
+ * If *port is zero, one is chosen and returned in *port.
+ */
+static int bind_loopback (int type, int *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof (sin);
+    int one = 1;
+    int fd;
+
+    if ((fd = socket (AF_INET, type, 0)) < 0)
+        die ("socket");
+    (void)setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    sin.sin_port = htons (*port);
+    if (bind (fd, (struct sockaddr *)&sin, sizeof (sin)) < 0)
+        die ("bind");
+    if (type == SOCK_STREAM && listen (fd, SOMAXCONN) < 0)
+        die ("listen");
+    if (getsockname (fd, (struct sockaddr *)&sin, &len) < 0)
+        die ("getsockname");
+    *port = ntohs (sin.sin_port);
+    return fd;
 }
 
-getquota_rslt * rquotaproc_getactivequota_1_svc(getquota_args *args,
-						struct svc_req *req)
+#define OPTIONS "qp:l:s:"
+static const struct option longopts[] = {
+    {"quiet",           no_argument,        0, 'q'},
+    {"port",            required_argument,  0, 'p'},
+    {"loss",            required_argument,  0, 'l'},
+    {"stall",           required_argument,  0, 's'},
+    {0, 0, 0, 0},
+};
+
+/* With --port, serve on loopback without registering with the portmapper
+ * and print the port on stdout, so tests can run without rpcbind.
+ * TCP is served on the same port number as UDP.
+ */
+int main (int argc, char **argv)
 {
-    static getquota_rslt res;
+    SVCXPRT *transp, *tcp_transp;
+    int port = -1;
+    int c;
 
-    fprintf (stderr, "%s: uid=%d path=%s\n", __FUNCTION__,
-             args->gqa_uid, args->gqa_pathp);
-    res.gqr_status = Q_OK;
-    rquota_bump (&res.getquota_rslt_u.gqr_rquota);
-    return &res;
+    while ((c = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != EOF) {
+        switch (c) {
+            case 'q':   // --quiet
+                quiet = 1;
+                break;
+            case 'p':   // --port=PORT
+                port = strtoul (optarg, NULL, 10);
+                break;
+            case 'l':   // --loss=PERCENT
+                loss = strtoul (optarg, NULL, 10);
+                break;
+            case 's':   // --stall=PERCENT
+                stall = strtoul (optarg, NULL, 10);
+                break;
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc)
+        usage ();
+
+    if (port >= 0) {
+        int fd = bind_loopback (SOCK_DGRAM, &port);
+
+        if (!(transp = svcudp_create (fd)))
+            die ("svcudp_create");
+        if (!svc_register (transp, RQUOTAPROG, RQUOTAVERS, rquotaprog_1, 0))
+            die ("svc_register udp");
+        fd = bind_loopback (SOCK_STREAM, &port);
+        if (!(tcp_transp = svctcp_create (fd, 0, 0)))
+            die ("svctcp_create");
+        if (!svc_register (tcp_transp, RQUOTAPROG, RQUOTAVERS, rquotaprog_1,
+                           0))
+            die ("svc_register tcp");
+        printf ("%d\n", port);
+        fflush (stdout);
+    } else {
+        pmap_unset (RQUOTAPROG, RQUOTAVERS);
+        if (!(transp = svcudp_create (RPC_ANYSOCK)))
+            die ("svcudp_create");
+        if (!svc_register (transp, RQUOTAPROG, RQUOTAVERS, rquotaprog_1,
+                           IPPROTO_UDP))
+            die ("unable to register (RQUOTAPROG, RQUOTAVERS, udp)");
+        if (!(tcp_transp = svctcp_create (RPC_ANYSOCK, 0, 0)))
+            die ("svctcp_create");
+        if (!svc_register (tcp_transp, RQUOTAPROG, RQUOTAVERS, rquotaprog_1,
+                           IPPROTO_TCP))
+            die ("unable to register (RQUOTAPROG, RQUOTAVERS, tcp)");
+    }
+    udp_transp = transp;
+    srandom (getpid ());
+    svc_run ();
+    die ("svc_run returned");
+    return 1;
 }
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
  */
-
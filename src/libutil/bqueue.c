@@ -0,0 +1,179 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Bounded FIFO of pointers between pipeline stages.  A producer that
+ * finds the queue full waits, which holds a fast stage back to the pace
+ * of the one after it instead of letting the queue grow without limit.
+ * Time spent waiting on either side is counted, so --debug can show
+ * which stage a pipeline is waiting for.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "bqueue.h"
+#include "util.h"
+
+#define BQUEUE_MAGIC    0x42515545
+
+struct bqueue_struct {
+    int             q_magic;
+    pthread_mutex_t q_lock;
+    pthread_cond_t  q_notempty;
+    pthread_cond_t  q_notfull;
+    void          **q_items;        /* circular, q_max slots */
+    int             q_max;
+    int             q_head;
+    int             q_count;
+    int             q_closed;
+    struct bqueue_stats q_stats;
+};
+
+bqueue_t
+bqueue_create(int max)
+{
+    bqueue_t q = xmalloc(sizeof(struct bqueue_struct));
+    pthread_condattr_t attr;
+
+    assert(max > 0);
+    memset(q, 0, sizeof(struct bqueue_struct));
+    q->q_magic = BQUEUE_MAGIC;
+    pthread_mutex_init(&q->q_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->q_notempty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&q->q_notfull, NULL);
+    q->q_items = xmalloc(sizeof(void *) * max);
+    q->q_max = q->q_stats.s_max = max;
+    return q;
+}
+
+void
+bqueue_destroy(bqueue_t q)
+{
+    assert(q->q_magic == BQUEUE_MAGIC);
+    pthread_mutex_destroy(&q->q_lock);
+    pthread_cond_destroy(&q->q_notempty);
+    pthread_cond_destroy(&q->q_notfull);
+    q->q_magic = 0;
+    free(q->q_items);
+    free(q);
+}
+
+/* Append item, waiting for room.
+ */
+void
+bqueue_push(bqueue_t q, void *item)
+{
+    double t0;
+
+    assert(q->q_magic == BQUEUE_MAGIC);
+    pthread_mutex_lock(&q->q_lock);
+    assert(!q->q_closed);
+    if (q->q_count == q->q_max) {
+        t0 = monotime();
+        while (q->q_count == q->q_max)
+            pthread_cond_wait(&q->q_notfull, &q->q_lock);
+        q->q_stats.s_full += monotime() - t0;
+    }
+    q->q_items[(q->q_head + q->q_count) % q->q_max] = item;
+    if (++q->q_count > q->q_stats.s_peak)
+        q->q_stats.s_peak = q->q_count;
+    q->q_stats.s_items++;
+    pthread_cond_signal(&q->q_notempty);
+    pthread_mutex_unlock(&q->q_lock);
+}
+
+/* Take up to n items into items[], waiting for at least one.  If linger
+ * is nonzero, wait up to that many seconds more for n, so that a stage
+ * that works in batches gets full ones while its producer keeps up.
+ * Returns the number taken, 0 once the queue is closed and empty.
+ */
+int
+bqueue_pop(bqueue_t q, void **items, int n, double linger)
+{
+    struct timespec ts;
+    double t0, deadline;
+    int i;
+
+    assert(q->q_magic == BQUEUE_MAGIC);
+    pthread_mutex_lock(&q->q_lock);
+    t0 = monotime();
+    while (q->q_count == 0 && !q->q_closed)
+        pthread_cond_wait(&q->q_notempty, &q->q_lock);
+    if (linger > 0) {
+        deadline = monotime() + linger;
+        ts.tv_sec = (time_t)deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1E9);
+        while (q->q_count < n && q->q_count < q->q_max && !q->q_closed
+                              && monotime() < deadline)
+            pthread_cond_timedwait(&q->q_notempty, &q->q_lock, &ts);
+    }
+    q->q_stats.s_empty += monotime() - t0;
+    for (i = 0; i < n && q->q_count > 0; i++) {
+        items[i] = q->q_items[q->q_head];
+        q->q_head = (q->q_head + 1) % q->q_max;
+        q->q_count--;
+    }
+    if (i > 0)
+        pthread_cond_broadcast(&q->q_notfull);
+    else if (q->q_closed)
+        pthread_cond_broadcast(&q->q_notempty);
+    pthread_mutex_unlock(&q->q_lock);
+    return i;
+}
+
+/* Say that nothing more will be pushed.  Consumers drain what is left.
+ */
+void
+bqueue_close(bqueue_t q)
+{
+    assert(q->q_magic == BQUEUE_MAGIC);
+    pthread_mutex_lock(&q->q_lock);
+    q->q_closed = 1;
+    pthread_cond_broadcast(&q->q_notempty);
+    pthread_mutex_unlock(&q->q_lock);
+}
+
+void
+bqueue_stats(bqueue_t q, struct bqueue_stats *st)
+{
+    assert(q->q_magic == BQUEUE_MAGIC);
+    pthread_mutex_lock(&q->q_lock);
+    *st = q->q_stats;
+    pthread_mutex_unlock(&q->q_lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,47 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+
+/* A bounded queue of pointers connecting threads, see bqueue.c.
+ */
+typedef struct bqueue_struct *bqueue_t;
+
+struct bqueue_stats {
+    unsigned long   s_items;        /* pushed in all */
+    int             s_peak;         /* most queued at once */
+    int             s_max;          /* the bound */
+    double          s_full;         /* seconds producers waited */
+    double          s_empty;        /* seconds consumers waited */
+};
+
+bqueue_t bqueue_create(int max);
+void     bqueue_destroy(bqueue_t q);
+void     bqueue_push(bqueue_t q, void *item);
+int      bqueue_pop(bqueue_t q, void **items, int n, double linger);
+void     bqueue_close(bqueue_t q);
+void     bqueue_stats(bqueue_t q, struct bqueue_stats *st);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -34,6 +34,10 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "getconf.h"
 #include "util.h"
@@ -59,7 +63,9 @@ next_field(char **str, char sep)
     while (**str != '\0' && **str != sep && **str != '\n')
         (*str)++;
 
-    *(*str)++ = '\0';
+    /* don't step past the terminator, so missing fields come back empty */
+    if (**str != '\0')
+        *(*str)++ = '\0';
 
     return rv;
 }
@@ -82,6 +88,46 @@ zap_trailing_spaces(char *str)
         *p-- = '\0';
 }
 
+/*
+ * Parse the comma-separated flags field into e.
+ * Unknown flags are ignored.
+ */
+static void
+parse_flags(confent_t *e, char *flags)
+{
+    char *flag, *save;
+
+    for (flag = strtok_r(flags, ",", &save); flag;
+                                    flag = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(flag, "nolimit"))
+            e->cf_nolimit = 1;
+        else if (!strcmp(flag, "udp") || !strcmp(flag, "tcp")) {
+            if (e->cf_proto)
+                free(e->cf_proto);
+            e->cf_proto = xstrdup(flag);
+        } else if (!strncmp(flag, "window=", 7))
+            e->cf_window = strtoul(flag + 7, NULL, 10);
+        else if (!strncmp(flag, "qps=", 4))
+            e->cf_qps = strtod(flag + 4, NULL);
+    }
+}
+
+static confent_t *
+newconfent(char *label, char *rhost, char *rpath)
+{
+    confent_t *e = (confent_t *)xmalloc(sizeof(confent_t));
+
+    e->cf_label = xstrdup(label);
+    e->cf_rhost = xstrdup(rhost);
+    e->cf_rpath = xstrdup(rpath);
+    e->cf_thresh = 0;
+    e->cf_nolimit = 0;
+    e->cf_proto = NULL;
+    e->cf_window = 0;
+    e->cf_qps = 0;
+    return e;
+}
+
 /*
  * Read/parse the next configuration file entry.
  *  RETURN      config file entry (caller must free)
@@ -89,7 +135,7 @@ zap_trailing_spaces(char *str)
 static confent_t *
 getconfent(FILE *f)
 {
-    static char buf[BUFSIZ];
+    char buf[BUFSIZ];
     char *thresh, *label, *rhost, *rpath, *flags, *p;
     confent_t *e = NULL;
 
@@ -104,12 +150,9 @@ getconfent(FILE *f)
             thresh = next_field(&p, ':');
             flags = next_field(&p, ':');
 
-            e = (confent_t *)xmalloc(sizeof(confent_t));
-            e->cf_label = xstrdup(label);
-            e->cf_rhost = xstrdup(rhost);
-            e->cf_rpath = xstrdup(rpath);
+            e = newconfent(label, rhost, rpath);
             e->cf_thresh = thresh ? strtoul(thresh, NULL, 10) : 0;
-            e->cf_nolimit = !strcmp(flags, "nolimit") ? 1 : 0;
+            parse_flags(e, flags);
             break;
         }
     }
@@ -127,6 +170,8 @@ freeconfent(confent_t *e)
             free(e->cf_rhost);
         if (e->cf_rpath)
             free(e->cf_rpath);
+        if (e->cf_proto)
+            free(e->cf_proto);
         free(e);
     }
 }
@@ -184,12 +229,243 @@ conf_iterator_destroy(conf_iterator_t itr)
     list_iterator_destroy(itr);
 }
 
+void
+conf_iterator_reset(conf_iterator_t itr)
+{
+    list_iterator_reset(itr);
+}
+
 confent_t *
 conf_next(conf_iterator_t itr)
 {
     return list_next(itr);
 }
 
+/*
+ * One line of the mount table, see proc(5) /proc/[pid]/mountinfo.
+ */
+struct mnt {
+    char *m_dir;        /* mount point */
+    char *m_type;       /* file system type */
+    char *m_src;        /* mount source, "host:/path" for NFS */
+    char *m_addr;       /* NFS server address (addr= option), or NULL */
+    int   m_used;       /* matched by a config entry */
+};
+
+static void
+freemnt(struct mnt *m)
+{
+    free(m->m_dir);
+    free(m->m_type);
+    free(m->m_src);
+    if (m->m_addr)
+        free(m->m_addr);
+    free(m);
+}
+
+/*
+ * Undo the octal escapes (e.g. \040 for space) of a mountinfo field.
+ */
+static char *
+unescape(char *s)
+{
+    char *p = s, *q = s;
+
+    while (*p) {
+        if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3'
+                        && p[2] >= '0' && p[2] <= '7'
+                        && p[3] >= '0' && p[3] <= '7') {
+            *q++ = (p[1] - '0') << 6 | (p[2] - '0') << 3 | (p[3] - '0');
+            p += 4;
+        } else
+            *q++ = *p++;
+    }
+    *q = '\0';
+    return s;
+}
+
+static int
+is_nfs(struct mnt *m)
+{
+    return (!strcmp(m->m_type, "nfs") || !strcmp(m->m_type, "nfs4"))
+                                      && strchr(m->m_src, ':');
+}
+
+/*
+ * Parse a mountinfo line: the mount point is the 5th field, then after
+ * the optional fields and "-", the type, source and super block options.
+ */
+static struct mnt *
+getmnt(char *line)
+{
+    char *f[5], *type, *src, *opts, *opt, *save;
+    struct in_addr in;
+    struct mnt *m;
+    int i;
+
+    if (!(f[0] = strtok_r(line, " \n", &save)))
+        return NULL;
+    for (i = 1; i < 5; i++)
+        if (!(f[i] = strtok_r(NULL, " \n", &save)))
+            return NULL;
+    while ((type = strtok_r(NULL, " \n", &save)) && strcmp(type, "-") != 0)
+        ;
+    if (!type || !(type = strtok_r(NULL, " \n", &save))
+              || !(src = strtok_r(NULL, " \n", &save)))
+        return NULL;
+    opts = strtok_r(NULL, " \n", &save);
+
+    m = xmalloc(sizeof(struct mnt));
+    m->m_dir = xstrdup(unescape(f[4]));
+    m->m_type = xstrdup(unescape(type));
+    m->m_src = xstrdup(unescape(src));
+    m->m_addr = NULL;
+    m->m_used = 0;
+    /* hostcache takes IPv4 addresses only */
+    if (is_nfs(m) && opts) {
+        for (opt = strtok_r(opts, ",", &save); opt;
+                                        opt = strtok_r(NULL, ",", &save)) {
+            if (!strncmp(opt, "addr=", 5) && inet_aton(opt + 5, &in))
+                m->m_addr = xstrdup(opt + 5);
+        }
+    }
+    return m;
+}
+
+static int
+mnt_set_used(struct mnt *m, char *src)
+{
+    if (!strcmp(m->m_src, src))
+        m->m_used = 1;
+    return 0;
+}
+
+/*
+ * Is rhost, a comma-separated list, exporting path by m?
+ */
+static int
+mnt_exports(struct mnt *m, char *rhost, char *rpath)
+{
+    char *path = strchr(m->m_src, ':');
+    char *hosts, *host, *save;
+    int len = path - m->m_src;
+    int match = 0;
+
+    if (strcmp(path + 1, rpath) != 0)
+        return 0;
+    hosts = xstrdup(rhost);
+    for (host = strtok_r(hosts, ",", &save); host && !match;
+                                        host = strtok_r(NULL, ",", &save))
+        match = (strlen(host) == len && !strncmp(host, m->m_src, len));
+    free(hosts);
+    return match;
+}
+
+/*
+ * The mount that config entry e is for, or NULL if it isn't mounted.
+ * It's the mount on the entry's label, or the mount of its remote path
+ * (the mount point for Lustre and local file systems, host:path for
+ * NFS).  *exported is set if it's an NFS mount of the entry's rhost and
+ * rpath, as opposed to something that happens to be mounted on the label.
+ */
+static struct mnt *
+find_mount(List mounts, confent_t *e, int *exported)
+{
+    ListIterator itr = list_iterator_create(mounts);
+    struct mnt *m, *found = NULL;
+    int local = !strcmp(e->cf_rhost, "lustre")
+             || !strcmp(e->cf_rhost, "local");
+    int match;
+
+    /* if something is mounted over a mount point, the last one wins */
+    *exported = 0;
+    while ((m = list_next(itr))) {
+        match = !local && is_nfs(m)
+                       && mnt_exports(m, e->cf_rhost, e->cf_rpath);
+        if (match || !strcmp(m->m_dir, e->cf_label)
+                || (local && !strcmp(m->m_dir, e->cf_rpath))) {
+            found = m;
+            *exported = match;
+        }
+    }
+    list_iterator_destroy(itr);
+    return found;
+}
+
+/*
+ * Read the mount table from path (normally _PATH_MOUNTINFO) once and
+ * drop config entries whose file systems aren't mounted, so that they
+ * cost nothing.  An NFS entry naming the single server that the kernel
+ * mounted from is pointed at the address it used, so no name lookup is
+ * needed; replica lists, and entries that matched only by label (and may
+ * name a separate rquotad host), are left alone.  With CONF_ADD_MOUNTS,
+ * NFS and Lustre mounts that no entry covers get entries of their own,
+ * labeled with their mount points.  Exits if path can't be read.
+ */
+void
+conf_mounted(conf_t cp, char *path, int flags)
+{
+    char buf[BUFSIZ];
+    List mounts;
+    ListIterator itr;
+    confent_t *e;
+    struct mnt *m;
+    char *p;
+    FILE *f;
+    int exported;
+
+    assert(cp);
+    assert(cp->conf_magic == CONF_MAGIC);
+
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        exit(1);
+    }
+    mounts = list_create((ListDelF)freemnt);
+    while (fgets(buf, BUFSIZ, f)) {
+        if ((m = getmnt(buf)))
+            list_append(mounts, m);
+    }
+    fclose(f);
+
+    itr = list_iterator_create(cp->conf_ents);
+    while ((e = list_next(itr))) {
+        if (!(m = find_mount(mounts, e, &exported))) {
+            list_delete(itr);
+            continue;
+        }
+        m->m_used = 1;
+        if (m->m_addr && exported && !strchr(e->cf_rhost, ',')) {
+            free(e->cf_rhost);
+            e->cf_rhost = xstrdup(m->m_addr);
+        }
+    }
+    list_iterator_destroy(itr);
+
+    if ((flags & CONF_ADD_MOUNTS)) {
+        itr = list_iterator_create(mounts);
+        while ((m = list_next(itr))) {
+            if (m->m_used)
+                continue;
+            if (is_nfs(m)) {
+                p = strchr(m->m_src, ':');
+                *p = '\0';
+                e = newconfent(m->m_dir, m->m_addr ? m->m_addr : m->m_src,
+                               p + 1);
+                *p = ':';
+            } else if (!strcmp(m->m_type, "lustre"))
+                e = newconfent(m->m_dir, "lustre", m->m_dir);
+            else
+                continue;
+            list_append(cp->conf_ents, e);
+            /* one entry per file system, however many places it's mounted */
+            list_for_each(mounts, (ListForF)mnt_set_used, m->m_src);
+        }
+        list_iterator_destroy(itr);
+    }
+    list_destroy(mounts);
+}
+
 confent_t *
 conf_get_bylabel(conf_t cp, char *label, int flags)
 {
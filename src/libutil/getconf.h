@@ -30,24 +30,35 @@ typedef struct {
     char *cf_rpath;
     int   cf_thresh;
     int   cf_nolimit;
+    char *cf_proto;     /* NFS transport ("udp", "tcp"), NULL = default */
+    int   cf_window;    /* max NFS queries in flight to rhost, 0 = default */
+    double cf_qps;      /* max NFS queries/sec to rhost, 0 = default */
 } confent_t;
 
 #ifndef _PATH_QUOTA_CONF
 #define _PATH_QUOTA_CONF "/etc/quota.conf"
 #endif
 
+#ifndef _PATH_MOUNTINFO
+#define _PATH_MOUNTINFO "/proc/self/mountinfo"
+#endif
+
 typedef ListIterator          conf_iterator_t;
 typedef struct conf_struct *  conf_t;
 
 #define CONF_MATCH_SUBDIR 1 /* conf_get_bylabel() flag: match mountpt subdir */
                             /* see util.c::match_path() */
 
+#define CONF_ADD_MOUNTS   1 /* conf_mounted() flag: add unlisted NFS/Lustre */
+
 conf_t            conf_init(char *path);
 void              conf_fini(conf_t conf);
 confent_t *       conf_get_bylabel(conf_t conf, char *label, int flags);
 conf_iterator_t   conf_iterator_create(conf_t conf);
 void              conf_iterator_destroy(conf_iterator_t itr);
+void              conf_iterator_reset(conf_iterator_t itr);
 confent_t *       conf_next(conf_iterator_t itr);
+void              conf_mounted(conf_t conf, char *path, int flags);
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
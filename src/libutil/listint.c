@@ -22,6 +22,12 @@
  *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
 \*****************************************************************************/
 
+/*
+ * Sets of uids given as lists of numbers and ranges, e.g. "0,100-9999".
+ * They are kept as sorted, merged ranges, so a range of a million uids
+ * costs no more than a single uid, and membership is a binary search.
+ */
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -29,23 +35,33 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "listint.h"
+#include "util.h"
 
-#ifdef WITH_LSD_NOMEM_ERROR_FUNC
-#  undef lsd_nomem_error
-   extern void * lsd_nomem_error(char *file, int line, char *mesg);
-#else /* !WITH_LSD_NOMEM_ERROR_FUNC */
-#  ifndef lsd_nomem_error
-#    define lsd_nomem_error(file, line, mesg) (NULL)
-#  endif /* !lsd_nomem_error */
-#endif /* !WITH_LSD_NOMEM_ERROR_FUNC */
+#define LISTINT_MAGIC 0x4c494e54
 
-typedef enum { INVALID, SINGLE, RANGE } parsetype_t;
+struct range {
+    unsigned long r_lo;
+    unsigned long r_hi;         /* inclusive */
+};
+
+struct listint_struct {
+    int           l_magic;
+    struct range *l_ranges;
+    int           l_count;
+    int           l_size;
+};
 
-static unsigned long *dup_int(unsigned long u);
-static parsetype_t   parse_int(char *s, unsigned long *u1p, unsigned long *u2p);
-static int           listint_match(unsigned long *entry, unsigned long *key);
+struct listint_iterator_struct {
+    listint_t     i_list;
+    int           i_range;      /* current range */
+    unsigned long i_next;       /* next value in it */
+};
+
+typedef enum { INVALID, SINGLE, RANGE } parsetype_t;
 
 static parsetype_t
 parse_int(char *s, unsigned long *u1p, unsigned long *u2p)
@@ -78,147 +94,318 @@ done:
     return rc;
 }
 
-static unsigned long *
-dup_int(unsigned long u)
+static void
+add_range(listint_t l, unsigned long lo, unsigned long hi)
 {
-    unsigned long *up = malloc(sizeof(unsigned long));
-
-    if (up == NULL)
-        return lsd_nomem_error(__FILE__, __LINE__, "dup_int");
-    *up = u;
-    return up;
+    if (l->l_count == l->l_size) {
+        l->l_size = l->l_size ? l->l_size * 2 : 16;
+        l->l_ranges = xrealloc(l->l_ranges, sizeof(struct range) * l->l_size);
+    }
+    l->l_ranges[l->l_count].r_lo = lo;
+    l->l_ranges[l->l_count].r_hi = hi;
+    l->l_count++;
 }
 
-static char *
-dup_str(char *s)
+/* Add a number or range, e.g. "5" or "100-200" (or "200-100").
+ */
+static int
+add_token(listint_t l, char *t)
 {
-    char *cpy = strdup(s);
+    unsigned long u1, u2;
 
-    if (cpy == NULL)
-        return lsd_nomem_error(__FILE__, __LINE__, "dup_str");
-    return cpy;
+    switch (parse_int(t, &u1, &u2)) {
+        case SINGLE:
+            add_range(l, u1, u1);
+            return 0;
+        case RANGE:
+            if (u1 <= u2)
+                add_range(l, u1, u2);
+            else
+                add_range(l, u2, u1);
+            return 0;
+        default:
+            return -1;
+    }
 }
 
-/* Create a list of ints, parsing an string consisting of comma
- * separated numbers and ranges (mixed).  Return NULL on parse error.
- * N.B. we allow duplicates.
+/* Add the numbers and ranges in a file, separated by commas or white
+ * space, with "#" starting a comment.
  */
-List
-listint_create(char *s)
+static int
+add_file(listint_t l, char *path)
 {
-    List l;
-    char *cpy, *t;
-    unsigned long u, u1, u2;
-    int rc;
+    char buf[BUFSIZ], *t, *p, *save;
+    FILE *f;
+    int rc = 0;
 
-    if (!(l = list_create((ListDelF)free)))
-        return NULL;
-    if (!(cpy = dup_str(s))) {
-        list_destroy(l);
-        return NULL;
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        return -1;
     }
-    t = strtok(cpy, ",");
-    while (t) {
-        rc = parse_int(t, &u1, &u2);
-        if (rc == INVALID) {
-            list_destroy(l);
-            l = NULL;
-            break;
-        } else if (rc == SINGLE) {
-            list_append(l, dup_int(u1));
-        } else { /* rc == RANGE */
-            if (u1 <= u2)
-                for (u = u1; u <= u2; u++)
-                    list_append(l, dup_int(u));
-            else
-                for (u = u1; u >= u2; u--)
-                    list_append(l, dup_int(u));
-        }
-        t = strtok(NULL, ",");
+    while (rc == 0 && fgets(buf, sizeof(buf), f)) {
+        if ((p = strchr(buf, '#')))
+            *p = '\0';
+        for (t = strtok_r(buf, ", \t\r\n", &save); t && rc == 0;
+                                    t = strtok_r(NULL, ", \t\r\n", &save))
+            rc = add_token(l, t);
     }
-    if (l && list_count(l) == 0) {
-        list_destroy(l);
-        l = NULL;
+    fclose(f);
+    return rc;
+}
+
+static int
+cmp_range(const void *a, const void *b)
+{
+    const struct range *x = a, *y = b;
+
+    return x->r_lo < y->r_lo ? -1 : x->r_lo > y->r_lo ? 1 : 0;
+}
+
+/* Sort the ranges and merge those that overlap or touch.
+ */
+static void
+merge_ranges(listint_t l)
+{
+    struct range *r = l->l_ranges;
+    int i, n = 0;
+
+    if (l->l_count == 0)
+        return;
+    qsort(r, l->l_count, sizeof(struct range), cmp_range);
+    for (i = 1; i < l->l_count; i++) {
+        if (r[n].r_hi == ULONG_MAX || r[i].r_lo <= r[n].r_hi + 1) {
+            if (r[i].r_hi > r[n].r_hi)
+                r[n].r_hi = r[i].r_hi;
+        } else
+            r[++n] = r[i];
     }
+    l->l_count = n + 1;
+}
+
+/* Create a set of ints, parsing a string consisting of comma separated
+ * numbers and ranges (mixed).  "@path" reads more from a file.  Return
+ * NULL on parse error or if the set is empty.
+ */
+listint_t
+listint_create(char *s)
+{
+    listint_t l = xmalloc(sizeof(struct listint_struct));
+    char *cpy, *t, *save;
+    int rc = 0;
+
+    l->l_magic = LISTINT_MAGIC;
+    l->l_ranges = NULL;
+    l->l_count = l->l_size = 0;
+
+    cpy = xstrdup(s);
+    for (t = strtok_r(cpy, ",", &save); t && rc == 0;
+                                        t = strtok_r(NULL, ",", &save))
+        rc = t[0] == '@' ? add_file(l, t + 1) : add_token(l, t);
     free(cpy);
+    if (rc < 0 || l->l_count == 0) {
+        listint_destroy(l);
+        return NULL;
+    }
+    merge_ranges(l);
     return l;
 }
 
-static int
-listint_match(unsigned long *entry, unsigned long *key)
+int
+listint_member(listint_t l, unsigned long u)
+{
+    int lo = 0, hi, mid;
+
+    assert(l->l_magic == LISTINT_MAGIC);
+    hi = l->l_count - 1;
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (u < l->l_ranges[mid].r_lo)
+            hi = mid - 1;
+        else if (u > l->l_ranges[mid].r_hi)
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/* The number of ints in l.
+ */
+unsigned long
+listint_count(listint_t l)
+{
+    unsigned long n = 0;
+    int i;
+
+    assert(l->l_magic == LISTINT_MAGIC);
+    for (i = 0; i < l->l_count; i++)
+        n += l->l_ranges[i].r_hi - l->l_ranges[i].r_lo + 1;
+    return n;
+}
+
+void
+listint_destroy(listint_t l)
 {
-    return (*entry == *key);
+    assert(l->l_magic == LISTINT_MAGIC);
+    l->l_magic = 0;
+    if (l->l_ranges)
+        free(l->l_ranges);
+    free(l);
 }
 
+listint_iterator_t
+listint_iterator_create(listint_t l)
+{
+    listint_iterator_t itr = xmalloc(sizeof(struct listint_iterator_struct));
+
+    assert(l->l_magic == LISTINT_MAGIC);
+    itr->i_list = l;
+    itr->i_range = 0;
+    itr->i_next = l->l_count > 0 ? l->l_ranges[0].r_lo : 0;
+    return itr;
+}
+
+/* Get the next int in ascending order.  Returns 0 at the end.
+ */
 int
-listint_member(List l, unsigned long u)
+listint_next(listint_iterator_t itr, unsigned long *up)
 {
-    unsigned long *up;
+    listint_t l = itr->i_list;
+    struct range *r;
 
-    up = list_find_first(l, (ListFindF)listint_match, &u);
-    return (up ? 1 : 0);
+    if (itr->i_range >= l->l_count)
+        return 0;
+    r = &l->l_ranges[itr->i_range];
+    *up = itr->i_next;
+    if (itr->i_next == r->r_hi) {
+        if (++itr->i_range < l->l_count)
+            itr->i_next = l->l_ranges[itr->i_range].r_lo;
+    } else
+        itr->i_next++;
+    return 1;
 }
 
 void
-listint_destroy(List l)
+listint_iterator_destroy(listint_iterator_t itr)
 {
-    list_destroy(l);
+    free(itr);
 }
 
 #ifndef NDEBUG
 void
 listint_test(void)
 {
-    List l;
-    ListIterator itr;
-    unsigned long *u;
-    int i;
+    listint_t l;
+    listint_iterator_t itr;
+    unsigned long u;
+    char path[] = "/tmp/listint.XXXXXX";
+    char arg[64];
+    FILE *f;
+    int fd, i;
 
     l = listint_create("1,2,3");
     assert(l);
-    assert(list_count(l) == 3);
-    list_destroy(l);
+    assert(listint_count(l) == 3);
+    listint_destroy(l);
 
     l = listint_create("1-1000");
     assert(l);
-    assert(list_count(l) == 1000);
-    list_destroy(l);
+    assert(listint_count(l) == 1000);
+    listint_destroy(l);
 
+    /* duplicates are merged */
     l = listint_create("1-1000,1,2,50-100");
     assert(l);
-    assert(list_count(l) == 1053);
-    list_destroy(l);
+    assert(listint_count(l) == 1000);
+    assert(l->l_count == 1);
+    listint_destroy(l);
 
     l = listint_create("0,1-1000,1005");
     assert(l);
-    assert(list_count(l) == 1002);
-    list_destroy(l);
+    assert(listint_count(l) == 1002);
+    assert(l->l_count == 2);
+    assert(listint_member(l, 0));
+    assert(listint_member(l, 1000));
+    assert(!listint_member(l, 1001));
+    assert(!listint_member(l, 1004));
+    assert(listint_member(l, 1005));
+    assert(!listint_member(l, 1006));
+    listint_destroy(l);
 
     l = listint_create("");
     assert(l == NULL);
 
     l = listint_create(",1");
     assert(l);
-    assert(list_count(l) == 1);
-    list_destroy(l);
+    assert(listint_count(l) == 1);
+    listint_destroy(l);
 
     l = listint_create("1,x");
     assert(l == NULL);
 
     l = listint_create("100-102,204-106");
     assert(l);
-    assert(list_count(l) == 102);
-    list_destroy(l);
+    assert(listint_count(l) == 102);
+    assert(l->l_count == 2);
+    listint_destroy(l);
+
+    /* a big range costs one range */
+    l = listint_create("1000-2000000,5");
+    assert(l);
+    assert(listint_count(l) == 1999002);
+    assert(l->l_count == 2);
+    assert(listint_member(l, 1500000));
+    listint_destroy(l);
+
+    l = listint_create("0-4294967295,7");
+    assert(l);
+    assert(l->l_count == 1);
+    assert(listint_member(l, 4294967295UL));
+    listint_destroy(l);
 
     l = listint_create("100-106"); /* ../test/11.sh */
     assert(l);
-    assert(list_count(l) == 7);
+    assert(listint_count(l) == 7);
     i = 100;
-    itr = list_iterator_create(l);
-    while ((u = list_next(itr)) != NULL)
-        assert(*u == i++);
-    list_iterator_destroy(itr);
-    list_destroy(l);
+    itr = listint_iterator_create(l);
+    while (listint_next(itr, &u))
+        assert(u == i++);
+    assert(i == 107);
+    listint_iterator_destroy(itr);
+    listint_destroy(l);
+
+    /* iteration is in order, across ranges */
+    l = listint_create("9,3-4,6");
+    assert(l);
+    itr = listint_iterator_create(l);
+    assert(listint_next(itr, &u) && u == 3);
+    assert(listint_next(itr, &u) && u == 4);
+    assert(listint_next(itr, &u) && u == 6);
+    assert(listint_next(itr, &u) && u == 9);
+    assert(!listint_next(itr, &u));
+    listint_iterator_destroy(itr);
+    listint_destroy(l);
+
+    /* from a file */
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    f = fdopen(fd, "w");
+    assert(f);
+    fprintf(f, "# uids\n10 12-14\n\n20,30 # more\n");
+    fclose(f);
+    snprintf(arg, sizeof(arg), "1,@%s", path);
+    l = listint_create(arg);
+    assert(l);
+    assert(listint_count(l) == 7);
+    assert(listint_member(l, 13));
+    assert(!listint_member(l, 11));
+    listint_destroy(l);
+    f = fopen(path, "w");
+    assert(f);
+    fprintf(f, "10 x\n");
+    fclose(f);
+    assert(listint_create(arg) == NULL);
+    unlink(path);
 }
 #endif
 
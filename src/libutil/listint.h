@@ -22,11 +22,19 @@
  *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
 \*****************************************************************************/
 
-#include "src/liblsd/list.h"
+/* A set of unsigned longs (uids), held as sorted, disjoint ranges.
+ */
+typedef struct listint_struct *listint_t;
+typedef struct listint_iterator_struct *listint_iterator_t;
+
+listint_t     listint_create(char *s);
+int           listint_member(listint_t l, unsigned long u);
+unsigned long listint_count(listint_t l);
+void          listint_destroy(listint_t l);
 
-List listint_create(char *s);
-int  listint_member(List l, unsigned long u);
-void listint_destroy(List l);
+listint_iterator_t listint_iterator_create(listint_t l);
+int                listint_next(listint_iterator_t itr, unsigned long *up);
+void               listint_iterator_destroy(listint_iterator_t itr);
 
 void listint_test(void);
 
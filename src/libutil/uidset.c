@@ -0,0 +1,164 @@
+/*****************************************************************************\
+ *  Copyright (C) 2001-2008 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  Written by Jim Garlick <garlick@llnl.gov>.
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Quota, a remote quota program.
+ *  For details, see <http://www.llnl.gov/linux/quota/>.
+ *
+ *  Quota is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Quota is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Quota; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Open addressing hash set of uids.  (uid_t)-1 marks an empty slot, so
+ * it is kept out of the table and tracked with a flag.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "uidset.h"
+#include "util.h"
+
+#define UIDSET_MAGIC    0x55494453
+#define UIDSET_EMPTY    ((uid_t)-1)
+#define UIDSET_MINSIZE  1024        /* slots, a power of two */
+
+struct uidset_struct {
+    int     s_magic;
+    uid_t  *s_slots;
+    int     s_size;                 /* number of slots */
+    int     s_shift;                /* 32 - log2(s_size) */
+    int     s_count;                /* uids in slots */
+    int     s_hasempty;             /* (uid_t)-1 is in the set */
+};
+
+/* Fibonacci hashing: the top bits of the product depend on all the bits
+ * of the uid, so runs of consecutive uids and uids that differ only in
+ * their high bits are both spread across the table.
+ */
+static int
+slot(uidset_t s, uid_t uid)
+{
+    return (uint32_t)((uint32_t)uid * 2654435769U) >> s->s_shift;
+}
+
+static int
+lookup(uidset_t s, uid_t uid)
+{
+    int i = slot(s, uid);
+
+    while (s->s_slots[i] != UIDSET_EMPTY && s->s_slots[i] != uid)
+        i = (i + 1) & (s->s_size - 1);
+    return i;
+}
+
+static void
+alloc_slots(uidset_t s, int size)
+{
+    int n;
+
+    s->s_size = size;
+    for (s->s_shift = 32, n = size; n > 1; n >>= 1)
+        s->s_shift--;
+    s->s_slots = xmalloc(sizeof(uid_t) * size);
+    memset(s->s_slots, 0xff, sizeof(uid_t) * size);
+}
+
+/* Double the table, keeping it at most half full.
+ */
+static void
+grow(uidset_t s)
+{
+    uid_t *old = s->s_slots;
+    int i, oldsize = s->s_size;
+
+    alloc_slots(s, oldsize * 2);
+    for (i = 0; i < oldsize; i++)
+        if (old[i] != UIDSET_EMPTY)
+            s->s_slots[lookup(s, old[i])] = old[i];
+    free(old);
+}
+
+uidset_t
+uidset_create(void)
+{
+    uidset_t s = xmalloc(sizeof(struct uidset_struct));
+
+    s->s_magic = UIDSET_MAGIC;
+    s->s_count = 0;
+    s->s_hasempty = 0;
+    alloc_slots(s, UIDSET_MINSIZE);
+    return s;
+}
+
+void
+uidset_destroy(uidset_t s)
+{
+    assert(s->s_magic == UIDSET_MAGIC);
+    s->s_magic = 0;
+    free(s->s_slots);
+    free(s);
+}
+
+/* Add uid to s.  Returns 1 if it was added, 0 if it was already there.
+ */
+int
+uidset_add(uidset_t s, uid_t uid)
+{
+    int i;
+
+    assert(s->s_magic == UIDSET_MAGIC);
+    if (uid == UIDSET_EMPTY) {
+        if (s->s_hasempty)
+            return 0;
+        s->s_hasempty = 1;
+        return 1;
+    }
+    i = lookup(s, uid);
+    if (s->s_slots[i] == uid)
+        return 0;
+    s->s_slots[i] = uid;
+    if (++s->s_count * 2 > s->s_size)
+        grow(s);
+    return 1;
+}
+
+int
+uidset_member(uidset_t s, uid_t uid)
+{
+    assert(s->s_magic == UIDSET_MAGIC);
+    if (uid == UIDSET_EMPTY)
+        return s->s_hasempty;
+    return s->s_slots[lookup(s, uid)] == uid;
+}
+
+int
+uidset_count(uidset_t s)
+{
+    assert(s->s_magic == UIDSET_MAGIC);
+    return s->s_count + s->s_hasempty;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
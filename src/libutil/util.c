@@ -30,6 +30,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -83,6 +84,27 @@ xmalloc(size_t size)
     return ptr;
 }
 
+void *
+xrealloc(void *ptr, size_t size)
+{
+    if (!(ptr = realloc(ptr, size))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Return monotonic time in seconds, for measuring timeouts.
+ */
+double
+monotime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
 /* Match a directory against a mountpoint containing it.
  * We must match whole path components, see
  *  https://chaos.llnl.gov/bugzilla/show_bug.cgi?id=301
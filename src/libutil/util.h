@@ -25,6 +25,8 @@
 char *size2str(unsigned long long size, char *str, int len);
 char *xstrdup(char *str);
 void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+double monotime(void);
 int match_path(char *dir, const char *mountpoint);
 void test_match_path(void);
 unsigned long parse_blocksize(char *s, unsigned long *b);
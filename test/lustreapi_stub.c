@@ -0,0 +1,197 @@
+/* A stand-in for liblustreapi.so, to test the Lustre backend without a
+ * Lustre file system.  Preloaded, it makes the directory named by
+ * $STUB_LUSTRE_MNT look like a Lustre mount to fstatfs() and answers
+ * quotactls on it, whether they come through llapi_quotactl() or the
+ * LL_IOC_QUOTACTL ioctl, from a fixed table of quota records.  Setting
+ * $STUB_LUSTRE_NOITER makes it a server without LUSTRE_Q_ITERQUOTA.
+ * The number of each kind of quotactl is written to stderr at exit, if
+ * there were any.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <lustre/lustreapi.h>
+
+#define KB  1024ULL
+
+static struct rec {
+    uint32_t    id;
+    uint64_t    space, bsoft, bhard;    /* bytes, limits in KB */
+    uint64_t    inodes, isoft, ihard;
+} recs[] = {
+    { 0,            512 * KB,       0,      0,      40,     0,      0 },
+    { 7,            0,              1024,   2048,   0,      100,    200 },
+    { 500,          3000 * KB,      2048,   4096,   12,     0,      0 },
+    { 70000,        1 * KB,         0,      0,      1,      0,      0 },
+    { 4000000000U,  64 * KB,        0,      0,      2,      10,     20 },
+};
+#define NRECS ((int)(sizeof(recs) / sizeof(recs[0])))
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int ngetquota, niterquota, registered;
+
+static void
+report(void)
+{
+#ifdef LUSTRE_Q_ITERQUOTA
+    fprintf(stderr, "stub: %d getquota, %d iterquota\n",
+            ngetquota, niterquota);
+#else
+    fprintf(stderr, "stub: %d getquota, no iterquota\n", ngetquota);
+#endif
+}
+
+static void
+count(int *n)
+{
+    pthread_mutex_lock(&lock);
+    if (!registered) {
+        atexit(report);
+        registered = 1;
+    }
+    (*n)++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+fill(struct if_quotactl *qctl, struct rec *r)
+{
+    memset(&qctl->qc_dqblk, 0, sizeof(qctl->qc_dqblk));
+    qctl->qc_id = r->id;
+    qctl->qc_dqblk.dqb_curspace = r->space;
+    qctl->qc_dqblk.dqb_bsoftlimit = r->bsoft;
+    qctl->qc_dqblk.dqb_bhardlimit = r->bhard;
+    qctl->qc_dqblk.dqb_curinodes = r->inodes;
+    qctl->qc_dqblk.dqb_isoftlimit = r->isoft;
+    qctl->qc_dqblk.dqb_ihardlimit = r->ihard;
+}
+
+static int
+stub_quotactl(struct if_quotactl *qctl)
+{
+    int i;
+
+    switch (qctl->qc_cmd) {
+        case LUSTRE_Q_GETQUOTA:
+            count(&ngetquota);
+            for (i = 0; i < NRECS; i++)
+                if (recs[i].id == qctl->qc_id)
+                    break;
+            if (i < NRECS)
+                fill(qctl, &recs[i]);
+            else
+                memset(&qctl->qc_dqblk, 0, sizeof(qctl->qc_dqblk));
+            return 0;
+#ifdef LUSTRE_Q_ITERQUOTA
+        case LUSTRE_Q_ITERQUOTA:
+            count(&niterquota);
+            if (getenv("STUB_LUSTRE_NOITER"))
+                break;
+            for (i = 0; i < NRECS; i++)
+                if (recs[i].id >= qctl->qc_id)
+                    break;
+            if (i == NRECS) {
+                errno = ENOENT;
+                return -1;
+            }
+            fill(qctl, &recs[i]);
+            return 0;
+#endif
+    }
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/* Is path, or the directory open on fd, the fake mount?
+ */
+static int
+is_mnt(const char *path, int fd)
+{
+    char *mnt = getenv("STUB_LUSTRE_MNT");
+    char real[PATH_MAX], link[64];
+    struct stat a, b;
+
+    if (!mnt || stat(mnt, &a) < 0)
+        return 0;
+    if (path)
+        return realpath(path, real) && stat(real, &b) == 0
+            && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    return stat(link, &b) == 0
+        && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+int
+llapi_quotactl(char *mnt, struct if_quotactl *qctl)
+{
+    if (!is_mnt(mnt, -1)) {
+        errno = ENODEV;
+        return -1;
+    }
+    return stub_quotactl(qctl);
+}
+
+int
+llapi_get_obd_count(char *mnt, int *count, int is_mdt)
+{
+    if (!is_mnt(mnt, -1)) {
+        errno = ENODEV;
+        return -1;
+    }
+    *count = 0;
+    return 0;
+}
+
+int
+fstatfs(int fd, struct statfs *buf)
+{
+    static int (*real)(int, struct statfs *) = NULL;
+    int rc;
+
+    if (!real)
+        real = (int (*)(int, struct statfs *))dlsym(RTLD_NEXT, "fstatfs");
+    if ((rc = real(fd, buf)) == 0 && is_mnt(NULL, fd))
+        buf->f_type = LL_SUPER_MAGIC;
+    return rc;
+}
+
+int
+ioctl(int fd, unsigned long req, ...)
+{
+    static int (*real)(int, unsigned long, ...) = NULL;
+    va_list ap;
+    void *arg;
+
+    va_start(ap, req);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+#ifdef LL_IOC_QUOTACTL
+    if (req == LL_IOC_QUOTACTL && is_mnt(NULL, fd))
+        return stub_quotactl(arg);
+#endif
+#ifdef LL_IOC_GETOBDCOUNT
+    if (req == LL_IOC_GETOBDCOUNT && is_mnt(NULL, fd)) {
+        *(int *)arg = 0;
+        return 0;
+    }
+#endif
+    if (!real)
+        real = (int (*)(int, unsigned long, ...))dlsym(RTLD_NEXT, "ioctl");
+    return real(fd, req, arg);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
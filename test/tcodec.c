@@ -0,0 +1,312 @@
+/* Check the GETQUOTA codec (src/cmd/getquota_codec.c) against the
+ * sunrpc/rpcgen XDR routines.  Random calls are encoded both ways and
+ * must match byte for byte.  Random replies, some of them truncated or
+ * corrupted, are decoded both ways and must give the same RPC status,
+ * gqr_status and quota.
+ */
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "src/librpc/rquota.h"
+#include "src/cmd/getquota.h"
+#include "src/cmd/getquota_private.h"
+#include "src/cmd/getquota_codec.h"
+
+#define BUFSIZE 2048
+
+char *prog = "tcodec";
+int debug = 0;
+
+static void usage(void);
+
+static u_int32_t
+rand32(void)
+{
+    return ((u_int32_t)random() << 16) ^ (u_int32_t)random();
+}
+
+/* Mostly edge cases, sometimes anything.
+ */
+static u_int32_t
+interesting(void)
+{
+    static u_int32_t vals[] = { 0, 1, 2, 3, 4, 5, 6, 400, 401, 1024,
+                                0x7fffffff, 0x80000000, 0xfffffffe,
+                                0xffffffff };
+
+    if (random() % 4 == 0)
+        return rand32();
+    return vals[random() % (sizeof(vals) / sizeof(vals[0]))];
+}
+
+static void
+random_string(char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = "abcdefghijklmnopqrstuvwxyz0123456789./-"[random() % 39];
+    buf[len] = '\0';
+}
+
+/* The call as the sunrpc client would encode it.
+ */
+static int
+ref_encode_call(char *buf, int len, u_int32_t xid, u_int32_t stamp,
+                char *lhost, uid_t uid, gid_t gid, char *path)
+{
+    char cred[MAX_AUTH_BYTES];
+    struct authunix_parms aup;
+    struct rpc_msg msg;
+    getquota_args args;
+    XDR xdrs;
+    int n = -1;
+
+    aup.aup_time = stamp;
+    aup.aup_machname = lhost;
+    aup.aup_uid = uid;
+    aup.aup_gid = gid;
+    aup.aup_len = 0;
+    aup.aup_gids = NULL;
+    xdrmem_create(&xdrs, cred, sizeof(cred), XDR_ENCODE);
+    if (!xdr_authunix_parms(&xdrs, &aup)) {
+        xdr_destroy(&xdrs);
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.rm_call.cb_cred.oa_flavor = AUTH_UNIX;
+    msg.rm_call.cb_cred.oa_base = cred;
+    msg.rm_call.cb_cred.oa_length = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+
+    msg.rm_xid = xid;
+    msg.rm_direction = CALL;
+    msg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+    msg.rm_call.cb_prog = RQUOTAPROG;
+    msg.rm_call.cb_vers = RQUOTAVERS;
+    msg.rm_call.cb_proc = RQUOTAPROC_GETQUOTA;
+    msg.rm_call.cb_verf = _null_auth;
+
+    args.gqa_pathp = path;
+    args.gqa_uid = uid;
+
+    xdrmem_create(&xdrs, buf, len, XDR_ENCODE);
+    if (xdr_callmsg(&xdrs, &msg) && xdr_getquota_args(&xdrs, &args))
+        n = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+    return n;
+}
+
+/* The reply as the sunrpc client would decode it.
+ */
+static enum clnt_stat
+ref_decode_reply(char *buf, int len, uid_t uid, quota_t q, int *statusp)
+{
+    char verf[MAX_AUTH_BYTES];
+    struct rpc_msg msg;
+    struct rpc_err err;
+    getquota_rslt res;
+    XDR xdrs;
+    enum clnt_stat stat = RPC_CANTDECODERES;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&res, 0, sizeof(res));
+    msg.acpted_rply.ar_verf.oa_base = verf;
+    msg.acpted_rply.ar_results.where = (caddr_t)&res;
+    msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_getquota_rslt;
+
+    xdrmem_create(&xdrs, buf, len, XDR_DECODE);
+    if (xdr_replymsg(&xdrs, &msg)) {
+        _seterr_reply(&msg, &err);
+        stat = err.re_status;
+        if (stat == RPC_SUCCESS) {
+            *statusp = res.gqr_status;
+            if (res.gqr_status == Q_OK)
+                quota_nfs_fill(uid, q, &res.getquota_rslt_u.gqr_rquota);
+        }
+    }
+    xdr_destroy(&xdrs);
+    return stat;
+}
+
+#define PUT32(v) do { \
+    if (p + 4 <= end) { \
+        u_int32_t _w = htonl(v); \
+        memcpy(p, &_w, 4); \
+        p += 4; \
+    } \
+} while (0)
+
+/* Make up a reply that is mostly well formed.
+ */
+static int
+make_reply(char *buf, int size)
+{
+    char *p = buf, *end = buf + size;
+    u_int32_t w, i;
+
+    PUT32(rand32());                                    /* xid */
+    PUT32(random() % 16 ? REPLY : interesting());
+    w = random() % 16 ? random() % 2 : interesting();
+    PUT32(w);
+    if (w == MSG_ACCEPTED) {
+        PUT32(random() % 2 ? AUTH_NONE : interesting());
+        w = random() % 4 ? random() % 3 * 4 : interesting();
+        PUT32(w);
+        for (i = 0; i < w && p < end; i++)
+            *p++ = random();
+        w = random() % 2 ? SUCCESS : interesting();
+        PUT32(w);
+        if (w == PROG_MISMATCH) {
+            PUT32(interesting());
+            PUT32(interesting());
+        } else if (w == SUCCESS) {
+            w = random() % 4 ? Q_OK : interesting();
+            PUT32(w);
+            if (w == Q_OK) {
+                for (i = 0; i < 10; i++)
+                    PUT32(interesting());
+            }
+        }
+    } else {
+        w = random() % 8 ? random() % 2 : interesting();
+        PUT32(w);
+        PUT32(interesting());
+        PUT32(interesting());
+    }
+    return p - buf;
+}
+
+static int
+quota_equal(quota_t x, quota_t y)
+{
+    return (x->q_uid == y->q_uid
+         && x->q_bytes_used == y->q_bytes_used
+         && x->q_bytes_softlim == y->q_bytes_softlim
+         && x->q_bytes_hardlim == y->q_bytes_hardlim
+         && x->q_bytes_secleft == y->q_bytes_secleft
+         && x->q_bytes_state == y->q_bytes_state
+         && x->q_files_used == y->q_files_used
+         && x->q_files_softlim == y->q_files_softlim
+         && x->q_files_hardlim == y->q_files_hardlim
+         && x->q_files_secleft == y->q_files_secleft
+         && x->q_files_state == y->q_files_state);
+}
+
+static void
+dump(char *what, char *buf, int len)
+{
+    int i;
+
+    fprintf(stderr, "%s: %s (%d bytes):", prog, what, len);
+    for (i = 0; i < len; i++)
+        fprintf(stderr, "%s%02x", i % 16 ? " " : "\n  ", (unsigned char)buf[i]);
+    fprintf(stderr, "\n");
+}
+
+static int
+test_encode(int n)
+{
+    char lhost[300], path[1100];
+    char a[BUFSIZE], b[BUFSIZE];
+    u_int32_t xid, stamp;
+    uid_t uid;
+    gid_t gid;
+    int i, alen, blen, fails = 0;
+
+    for (i = 0; i < n; i++) {
+        random_string(lhost, random() % 8 ? random() % 64 : random() % 270);
+        random_string(path, random() % 8 ? random() % 64 : random() % 1040);
+        xid = rand32();
+        stamp = rand32();
+        uid = interesting();
+        gid = interesting();
+        alen = ref_encode_call(a, sizeof(a), xid, stamp, lhost, uid, gid, path);
+        blen = gq_encode_call(b, sizeof(b), xid, stamp, lhost, uid, gid, path);
+        if (alen != blen || (alen > 0 && memcmp(a, b, alen) != 0)) {
+            fprintf(stderr, "%s: encode mismatch: lhost %d path %d bytes\n",
+                    prog, (int)strlen(lhost), (int)strlen(path));
+            if (alen > 0)
+                dump("sunrpc", a, alen);
+            if (blen > 0)
+                dump("codec", b, blen);
+            fails++;
+        }
+    }
+    printf("encode: %d calls, %d mismatches\n", n, fails);
+    return fails;
+}
+
+static int
+test_decode(int n)
+{
+    char buf[BUFSIZE];
+    quota_t qa = quota_create("label", "rhost", "rpath", 0);
+    quota_t qb = quota_create("label", "rhost", "rpath", 0);
+    enum clnt_stat astat, bstat;
+    int i, len, astatus, bstatus, fails = 0;
+    int garbage = 0, rpcerr = 0, ok = 0;
+    uid_t uid;
+
+    for (i = 0; i < n; i++) {
+        len = make_reply(buf, sizeof(buf));
+        if (random() % 4 == 0)
+            len = random() % (len + 1);
+        if (random() % 4 == 0 && len > 0)
+            buf[random() % len] ^= 1 << (random() % 8);
+        uid = interesting();
+        memset(&qa->q_uid, 0, sizeof(*qa) - offsetof(struct quota_struct,
+                                                      q_uid));
+        memset(&qb->q_uid, 0, sizeof(*qb) - offsetof(struct quota_struct,
+                                                      q_uid));
+        astatus = bstatus = -1;
+        astat = ref_decode_reply(buf, len, uid, qa, &astatus);
+        bstat = gq_decode_reply(buf, len, uid, qb, &bstatus);
+        if (astat != bstat || astatus != bstatus || !quota_equal(qa, qb)) {
+            fprintf(stderr, "%s: decode mismatch: sunrpc %d/%d codec %d/%d\n",
+                    prog, astat, astatus, bstat, bstatus);
+            dump("reply", buf, len);
+            fails++;
+        }
+        if (astat == RPC_CANTDECODERES)
+            garbage++;
+        else if (astat != RPC_SUCCESS)
+            rpcerr++;
+        else if (astatus == Q_OK)
+            ok++;
+    }
+    printf("decode: %d replies (%d garbage, %d rpc errors, %d quotas), "
+           "%d mismatches\n", n, garbage, rpcerr, ok, fails);
+    quota_destroy(qa);
+    quota_destroy(qb);
+    return fails;
+}
+
+int main(int argc, char *argv[])
+{
+    int n, fails;
+
+    if (argc < 2 || argc > 3)
+        usage();
+    n = strtoul(argv[1], NULL, 10);
+    srandom(argc == 3 ? strtoul(argv[2], NULL, 10) : 1);
+
+    fails = test_encode(n);
+    fails += test_decode(n);
+    exit(fails ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: tcodec iterations [seed]\n");
+    exit(1);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,136 @@
+/* Check the password file index (src/cmd/pwcache.c) against getpwent().
+ * Every uid and name must be found, with the entry that comes first in
+ * the password file, and the index must hold each entry exactly once.
+ * Says whether the index was built or loaded from the cache directory.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+
+#include "src/cmd/pwcache.h"
+#include "src/libutil/util.h"
+
+char *prog = "tpwcache";
+int debug = 1;
+
+extern char *quota_cache_dir;
+
+struct ent {
+    uid_t   uid;
+    char   *name;
+    char   *dir;
+    int     seq;
+};
+
+static int count;
+
+static void usage(void);
+
+static int
+cmp_uid(const void *a, const void *b)
+{
+    const struct ent *x = a, *y = b;
+
+    if (x->uid != y->uid)
+        return x->uid < y->uid ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    const struct ent *x = a, *y = b;
+    int rc = strcmp(x->name, y->name);
+
+    return rc ? rc : x->seq - y->seq;
+}
+
+static void
+count_one(uid_t uid, char *name, void *arg)
+{
+    count++;
+}
+
+int main(int argc, char *argv[])
+{
+    struct ent *v = NULL;
+    struct passwd *pw;
+    char *name, *dir;
+    uid_t uid;
+    int i, n = 0, size = 0, fails = 0;
+
+    if (argc != 2)
+        usage();
+    quota_cache_dir = argv[1];
+
+    while ((pw = getpwent()) != NULL) {
+        if (n == size) {
+            size = size ? size * 2 : 256;
+            v = xrealloc(v, sizeof(struct ent) * size);
+        }
+        v[n].uid = pw->pw_uid;
+        v[n].name = xstrdup(pw->pw_name);
+        v[n].dir = xstrdup(pw->pw_dir);
+        v[n].seq = n;
+        n++;
+    }
+    endpwent();
+
+    if (pwcache_init(1) < 0) {
+        fprintf(stderr, "%s: no index\n", prog);
+        exit(1);
+    }
+    if (pwcache_for_each(count_one, NULL) < 0 || count != n) {
+        fprintf(stderr, "%s: index has %d entries, expected %d\n",
+                prog, count, n);
+        fails++;
+    }
+
+    qsort(v, n, sizeof(struct ent), cmp_uid);
+    for (i = 0; i < n; i++) {
+        if (i > 0 && v[i].uid == v[i - 1].uid)
+            continue;
+        if (pwcache_byuid(v[i].uid, &name, &dir) < 0
+                || strcmp(name, v[i].name) != 0
+                || strcmp(dir, v[i].dir) != 0) {
+            fprintf(stderr, "%s: uid %u: bad entry\n", prog,
+                    (unsigned)v[i].uid);
+            fails++;
+        }
+    }
+    qsort(v, n, sizeof(struct ent), cmp_name);
+    for (i = 0; i < n; i++) {
+        if (i > 0 && strcmp(v[i].name, v[i - 1].name) == 0)
+            continue;
+        if (pwcache_byname(v[i].name, &uid, &dir) < 0
+                || uid != v[i].uid || strcmp(dir, v[i].dir) != 0) {
+            fprintf(stderr, "%s: %s: bad entry\n", prog, v[i].name);
+            fails++;
+        }
+    }
+    if (pwcache_byname("no such user", &uid, NULL) == 0) {
+        fprintf(stderr, "%s: found a user that doesn't exist\n", prog);
+        fails++;
+    }
+
+    printf("%d entries, %d failed\n", n, fails);
+    for (i = 0; i < n; i++) {
+        free(v[i].name);
+        free(v[i].dir);
+    }
+    free(v);
+    exit(fails ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: tpwcache cachedir\n");
+    exit(1);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,94 @@
+/* Call quota_get() from many threads at once against the test rquotad
+ * (src/librpc/rquota_svc_test) and check every answer.  The server
+ * must be in the host cache as "svchost" for both udp and tcp; half the
+ * threads use each transport.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "src/cmd/getquota.h"
+#include "src/cmd/getquota_private.h"
+
+char *prog = "tstress";
+int debug = 0;
+
+extern char *quota_cache_dir;
+extern double quota_nfs_timeout;
+extern double quota_nfs_retry_timeout;
+
+static int iterations;
+
+struct worker {
+    pthread_t   w_thread;
+    int         w_id;
+    int         w_fails;
+};
+
+static void usage(void);
+
+static void *
+worker(void *arg)
+{
+    struct worker *w = arg;
+    quota_t q = quota_create("/s", "svchost", "/export", 0);
+    uid_t uid;
+    int i;
+
+    quota_setproto(q, w->w_id % 2 ? "tcp" : "udp");
+    for (i = 0; i < iterations; i++) {
+        uid = 1 + w->w_id * iterations + i;
+        if (quota_get(uid, q) < 0 || q->q_uid != uid
+                                  || q->q_files_used != uid
+                                  || q->q_bytes_used != uid * 10 * 1024ULL) {
+            fprintf(stderr, "%s: thread %d: uid %u: bad quota\n", prog,
+                    w->w_id, (unsigned)uid);
+            w->w_fails++;
+        }
+    }
+    quota_destroy(q);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *w;
+    int i, n, fails = 0;
+
+    if (argc != 4)
+        usage();
+    quota_cache_dir = argv[1];
+    n = strtoul(argv[2], NULL, 10);
+    iterations = strtoul(argv[3], NULL, 10);
+    quota_nfs_timeout = 10;
+    quota_nfs_retry_timeout = 0.5;
+
+    w = calloc(n, sizeof(struct worker));
+    for (i = 0; i < n; i++) {
+        w[i].w_id = i;
+        if (pthread_create(&w[i].w_thread, NULL, worker, &w[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(w[i].w_thread, NULL);
+        fails += w[i].w_fails;
+    }
+    printf("%d threads, %d queries, %d failed\n", n, n * iterations, fails);
+    free(w);
+    exit(fails ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: tstress cachedir threads iterations\n");
+    exit(1);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,129 @@
+/* Check and time uidset (src/libutil/uidset.c), which repquota uses to
+ * drop duplicate candidate uids.  Each size n adds 2n uids drawn from n
+ * distinct values, dense, sparse or strided (differing only in their high
+ * bits), in random order and checks the set against a sorted reference.
+ * The time per add should not grow with n, and a sparse or strided set
+ * that costs much more per add than a dense one of the same size counts
+ * as a failure: the hash is then clustering the uids.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/libutil/uidset.h"
+#include "src/libutil/util.h"
+
+#define DENSE       0
+#define SPARSE      1
+#define STRIDED     2
+
+static char *modes[] = { "dense", "sparse", "strided" };
+
+static void usage(void);
+
+static int
+cmp_uid(const void *a, const void *b)
+{
+    uid_t x = *(const uid_t *)a, y = *(const uid_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Run one case and return the number of failures.  The time per add in
+ * ns is returned in *nsp; if base is non-zero, a time more than 20 times
+ * base (with some slack for tiny timings) is a failure.
+ */
+static int
+run(int n, int mode, double base, double *nsp)
+{
+    uid_t *v = malloc(sizeof(uid_t) * 2 * n);
+    uid_t *ref = malloc(sizeof(uid_t) * 2 * n);
+    uidset_t s;
+    double t0, t, ns;
+    int i, j, added = 0, distinct = 0, fails = 0;
+    uid_t tmp;
+
+    if (!v || !ref) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        if (mode == SPARSE)
+            v[i] = (uid_t)random();
+        else if (mode == STRIDED)
+            v[i] = (uid_t)(((uint32_t)i << 16) | ((uint32_t)i >> 16));
+        else
+            v[i] = (uid_t)(1000 + i);
+        v[n + i] = v[i];
+    }
+    v[0] = v[n] = (uid_t)-1;
+    for (i = 2 * n - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        tmp = v[i];
+        v[i] = v[j];
+        v[j] = tmp;
+    }
+    memcpy(ref, v, sizeof(uid_t) * 2 * n);
+    qsort(ref, 2 * n, sizeof(uid_t), cmp_uid);
+    for (i = 0; i < 2 * n; i++)
+        if (i == 0 || ref[i] != ref[i - 1])
+            distinct++;
+
+    s = uidset_create();
+    t0 = monotime();
+    for (i = 0; i < 2 * n; i++)
+        added += uidset_add(s, v[i]);
+    t = monotime() - t0;
+    ns = t * 1e9 / (2 * n);
+    if (base > 0 && ns > 20 * base + 200)
+        fails++;
+
+    if (added != distinct || uidset_count(s) != distinct)
+        fails++;
+    for (i = 0; i < 2 * n; i++)
+        if (!uidset_member(s, ref[i]))
+            fails++;
+    /* values between the ones added must not be members */
+    for (i = 1; i < 2 * n; i++)
+        if (ref[i] - ref[i - 1] > 1 && uidset_member(s, ref[i] - 1))
+            fails++;
+    uidset_destroy(s);
+
+    printf("%s %d: %d adds, %d uids, %d failed\n",
+           modes[mode], n, 2 * n, distinct, fails);
+    fprintf(stderr, "%s %d: %.3fs, %.0f ns/add\n", modes[mode], n, t, ns);
+    *nsp = ns;
+    free(v);
+    free(ref);
+    return fails;
+}
+
+int main(int argc, char *argv[])
+{
+    double base, ns;
+    int i, n, fails = 0;
+
+    if (argc < 2)
+        usage();
+    srandom(1);
+    for (i = 1; i < argc; i++) {
+        n = strtoul(argv[i], NULL, 10);
+        fails += run(n, DENSE, 0, &base);
+        fails += run(n, SPARSE, base, &ns);
+        fails += run(n, STRIDED, base, &ns);
+    }
+    exit(fails ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: tuidset size [size...]\n");
+    exit(1);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */